@@ -12,14 +12,24 @@
 #ifndef ASTAIRE_H__
 #define ASTAIRE_H__
 
+#include "memcached_tap_client.hpp"
 #include "memcachedstoreview.h"
 #include "astaire_statistics.hpp"
+#include "resync_rate_limiter.hpp"
+#include "resync_concurrency_controller.hpp"
+#include "resync_checkpoint.hpp"
+#include "resync_history.hpp"
+#include "resync_merge.hpp"
+#include "resync_snapshot.hpp"
+#include "resync_digest.hpp"
 #include "updater.h"
 #include "alarm.h"
 
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
 
 // Class that manages resyncing the local memcached node with the rest of the
 // cluster. This makes use of the memcached "tap protocol" to stream records
@@ -32,9 +42,12 @@
 //
 // -  A control thread. This decides when to do a resync, what sort of resync
 //    to do (see below) and what taps to set up. It also handles raising alarms
-//    and PD logs.
-// -  Tap threads. These are spawned by the control thread when doing a resync.
-//    There is one thread per server being tapped.
+//    and PD logs.  During a resync it sets up new taps as soon as earlier ones
+//    complete (see "Scheduling Taps" below).
+// -  Tap worker threads. A fixed pool of these, created with Astaire, run
+//    the taps the control thread sets up during a resync, one at a time each.
+//    Taps queue for a free worker, so the size of the pool bounds the threads
+//    and sockets Astaire uses however many servers there are to tap.
 // -  An updater thread that handles SIGHUP.  This updates the cluster view and
 //    kicks the control thread to do a partial resync.
 // -  An updater thread that handles SIGUSR1. This updates the cluster view and
@@ -46,6 +59,21 @@
 // long as they are executing. The private methods should assume that the lock
 // is held when they are called.
 //
+// The exceptions are these methods, which the control thread calls outside
+// of resyncs.  They release the lock while they do I/O, so that the updater
+// threads aren't held up:
+//
+// -  `take_snapshot` while it taps the local memcached.
+// -  `restore_snapshot` while it reloads the snapshot.
+// -  `check_for_divergence` while `compare_digests` builds the digests (but
+//    not while it resyncs any diverged vbuckets).
+//
+// While the lock is released these only use `_self`, `_snapshot` and
+// `_restored_buckets`, which only the control thread uses, and the local
+// connection pool and rate limiter, which are thread-safe.  Once they have
+// retaken the lock, they (or for `restore_snapshot`, the control thread)
+// check `trigger_pending` before carrying on, as the view may have changed.
+//
 // The class also contains a condition variable to signal the control thread to
 // do a resync / terminate itself.
 //
@@ -61,6 +89,113 @@
 //    memcached has restarted (so it has lost all of its data), or when
 //    triggered by user action.
 //
+// In a minimal resync the local node doesn't have any of the records being
+// streamed, so rather than checking for a local copy of each record before
+// writing it, Astaire ADDs it straight away.  Only if that fails because the
+// record already exists (because a client has written it in the meantime, or
+// it has already been streamed from another replica) does it fall back to
+// comparing the two copies.
+//
+// Scheduling Taps
+// ===============
+//
+// Each vbucket must be streamed from each of its source replicas in turn,
+// primary first, and never from two at once.  Rather than tapping every
+// vbucket's primary, waiting for all of those taps to finish and then moving
+// on to the backups, the control thread tracks each vbucket separately.  Tap
+// threads tell the control thread when they finish, and as soon as a vbucket's
+// tap from one replica has completed it becomes eligible to be tapped from its
+// next replica, alongside any other eligible vbuckets from that server.  This
+// stops one slow or unreachable server holding up every other vbucket's
+// backups.
+//
+// After a resize one server is often the primary for most of the vbuckets
+// being moved.  Which replica each vbucket is tapped from next is fixed, so
+// the control thread balances the load by how it starts the taps instead.  It
+// estimates the work in each tap from the size of each vbucket and the
+// throughput of each server in earlier taps.  A server gets a share of the
+// tap fan-out (see below) in proportion to the work queued on it, with its
+// vbuckets split so that its sub-streams finish together, and the taps that
+// start off the most work (counting each vbucket's remaining replicas) are
+// queued first.
+//
+// Tap Fan-out
+// ===========
+//
+// When most of the vbuckets come from the same server (as in a 2->3
+// scale-up) that one stream limits the whole resync, so Astaire can split each
+// server's vbuckets into up to `tap_fanout` disjoint lists and tap them in
+// parallel, each on its own tap worker with its own local connection.  A
+// vbucket only counts as streamed once the sub-stream carrying it succeeds.
+//
+// Adaptive Concurrency
+// ====================
+//
+// The local memcached is also serving the node's own clients, so if given a
+// latency target Astaire backs off when the local memcached slows down.  The
+// tap threads time their requests to it, and a ResyncConcurrencyController
+// uses those timings to decide how deep each tap's pipeline may be and how
+// many taps may run at once.
+//
+// Resuming Resyncs
+// ================
+//
+// Astaire untags the local memcached while it does a full resync, so if it
+// restarts part way through it does the resync again.  To avoid repeating the
+// work already done, Astaire can keep a checkpoint of which vbuckets it has
+// streamed from which replicas (see ResyncCheckpoint).  A restarted Astaire
+// skips that work as long as the resync it is doing is for the same view,
+// the local memcached hasn't restarted in the meantime, and the resync wasn't
+// requested by the user.
+//
+// Delta Resyncs
+// =============
+//
+// When the local node gets back vbuckets it has owned before (for example
+// after a scale-in is backed out), it still has most of their records, so
+// Astaire can keep a history of when it last streamed each vbucket from each
+// replica (see ResyncHistory).  A minimal resync then asks each replica for
+// just the records that have changed since (a TAP backfill), falling back to
+// a full dump of vbuckets with no history, and of all vbuckets on a replica
+// that doesn't support backfills.
+//
+// Merging Replicas
+// ================
+//
+// Streaming each vbucket from one replica after another makes a resync take
+// as many times longer as there are replicas.  Astaire can instead tap all of
+// a vbucket's replicas at once, and merge their records before writing them
+// (see ResyncMerge), so the local node is still only written to once the
+// newest copy of each record is known.  The vbuckets with the same replicas
+// are merged together, from one tap of each replica.
+//
+// Snapshots
+// =========
+//
+// When the local memcached restarts it loses all its data, and a full resync
+// streams all of it again from the other replicas.  To make that quicker,
+// Astaire can keep a snapshot of the local memcached on disk (see
+// ResyncSnapshot), which it refreshes after each resync and periodically
+// after that by tapping the local memcached.  A snapshot is only taken while
+// the local memcached is up-to-date, so when the local memcached restarts
+// Astaire reloads the snapshot into it, and the full resync that follows
+// only needs the records that have changed since the snapshot was taken (a
+// TAP backfill, as for delta resyncs).  Records are reloaded with ADDs, so
+// any that clients have written since the restart are kept.  Records deleted
+// since the snapshot was taken come back, until they expire.
+//
+// Anti-entropy
+// ============
+//
+// A full resync requested by the user streams every vbucket the local node
+// owns, even though the local node usually has nearly all their records
+// already.  In anti-entropy mode Astaire first builds digests of the records
+// (keys and timestamps) in each vbucket on the local node and on each source
+// replica (see ResyncDigest), using taps that ask for just the keys, and only
+// streams a vbucket from the replicas whose digests differ from the local
+// node's.  Astaire can also run the same comparison periodically, resyncing
+// any vbuckets that have silently diverged.
+//
 class Astaire
 {
 public:
@@ -69,36 +204,156 @@ public:
           Alarm* alarm,
           AstaireGlobalStatistics* global_stats,
           AstairePerConnectionStatistics* per_conn_stats,
-          std::string self);
+          ResyncRateLimiter* rate_limiter,
+          std::string self,
+          int tap_fanout = 1,
+          int tap_workers = 8,
+          int target_latency_us = 0,
+          const std::string& checkpoint_file = "",
+          const std::string& history_file = "",
+          bool merge_replicas = false,
+          const std::string& snapshot_file = "",
+          int snapshot_interval_s = 3600,
+          bool anti_entropy = false,
+          int anti_entropy_interval_s = 0);
 
   ~Astaire();
 
   typedef std::map<std::string, std::vector<uint16_t>> TapList;
   typedef std::map<uint16_t, std::vector<std::string>> OutstandingWorkList;
 
+  // The vbuckets to tap from a server, indexed by the date to backfill them
+  // from (0 for those to dump in full).
+  typedef std::map<uint64_t, std::vector<uint16_t>> BackfillList;
+
+  // The vbuckets to merge, indexed by the replicas they are merged from.
+  typedef std::map<std::vector<std::string>, std::vector<uint16_t>> MergeList;
+
+  // A tap to queue, and how much work it starts off - its own, and its
+  // vbuckets' taps from their remaining replicas.
+  struct PlannedTap
+  {
+    std::string server;
+    uint64_t backfill_date;
+    std::vector<uint16_t> buckets;
+    double chain_seconds;
+  };
+
+  // The work given to each source replica during a resync, used to balance
+  // the taps across them.
+  struct SourceLoads
+  {
+    // The estimated seconds of tapping queued or running on each server.
+    std::map<std::string, double> busy_seconds;
+
+    // The estimated seconds for each busy vbucket, to take off its server's
+    // load when its tap finishes.
+    std::map<uint16_t, double> bucket_seconds;
+
+    // The bytes each server was expected to send, and has sent.
+    std::map<std::string, uint64_t> expected_bytes;
+    std::map<std::string, uint64_t> actual_bytes;
+  };
+
+  // Receives the records streamed by `tap_records`.
+  class RecordHandler
+  {
+  public:
+    virtual ~RecordHandler() {}
+
+    // Handle a TAP_MUTATE for one of the vbuckets being tapped.  Returns
+    // false if the tap should be abandoned.
+    virtual bool record(const Memcached::Message& mutate, uint16_t vbucket) = 0;
+  };
+
   struct TapBucketsThreadData
   {
     TapBucketsThreadData(const std::string& tap_server,
-                         const std::string& local_server,
+                         Memcached::ClientConnectionPool* local_conn_pool,
                          const std::vector<uint16_t>& buckets,
+                         bool blind_add,
                          AstaireGlobalStatistics* global_stats,
-                         AstairePerConnectionStatistics::ConnectionRecord* conn_stats) :
+                         AstairePerConnectionStatistics::ConnectionRecord* conn_stats,
+                         ResyncRateLimiter* rate_limiter,
+                         ResyncConcurrencyController* concurrency_controller,
+                         uint64_t backfill_date = 0,
+                         ResyncMerge* merge = NULL,
+                         int merge_rank = 0) :
       tap_server(tap_server),
-      local_server(local_server),
+      local_server(local_conn_pool->address()),
+      local_conn_pool(local_conn_pool),
       buckets(buckets),
+      blind_add(blind_add),
       success(false),
       global_stats(global_stats),
-      conn_stats(conn_stats)
+      conn_stats(conn_stats),
+      rate_limiter(rate_limiter),
+      concurrency_controller(concurrency_controller),
+      backfill_date(backfill_date),
+      start_time(0),
+      backfill_rejected(false),
+      merge(merge),
+      merge_rank(merge_rank)
     {}
 
     std::string tap_server;
     std::string local_server;
+    Memcached::ClientConnectionPool* local_conn_pool;
     std::vector<uint16_t> buckets;
+
+    // Whether to ADD each record without first checking whether the local
+    // node has it (see "Types of Resync" above).
+    bool blind_add;
+
     bool success;
     AstaireGlobalStatistics* global_stats;
     AstairePerConnectionStatistics::ConnectionRecord* conn_stats;
+
+    // Limits how fast the tap applies records.  May be NULL, in which case
+    // there is no limit.
+    ResyncRateLimiter* rate_limiter;
+
+    // Sets how many requests the tap may have in flight to the local
+    // memcached, and is told how long they take.  May be NULL, in which case
+    // the tap always pipelines as many requests as it can.
+    ResyncConcurrencyController* concurrency_controller;
+
+    // If non-zero, the tap is only for records that have changed since this
+    // date, in seconds since the epoch.
+    uint64_t backfill_date;
+
+    // When the tap started, in seconds since the epoch.
+    uint64_t start_time;
+
+    // Whether the tap failed because the server doesn't support backfills.
+    bool backfill_rejected;
+
+    // The merge to offer the tap's records to, or NULL if the tap should
+    // write them to the local memcached itself.
+    ResyncMerge* merge;
+
+    // The rank of the tap's server in the merged vbuckets' replica list.
+    int merge_rank;
+
+    // The bytes of TAP_MUTATEs received for each vbucket, indexed by vbucket.
+    std::vector<uint64_t> bucket_bytes;
   };
 
+  // A tap queued by the control thread.  The tap worker that runs it puts it
+  // on the queue of completed taps when it has finished.
+  struct TapJob
+  {
+    TapBucketsThreadData* thread_data;
+    uint64_t start_time_ms;
+  };
+
+  // Static entry point for the tap worker threads.  This simply calls the
+  // `tap_worker_thread` member method.
+  static void* tap_worker_thread_fn(void* data);
+
+  // Method executed by the tap worker threads.
+  void tap_worker_thread();
+
   // Static function called by the control thread.  This simply calls
   // the `control_thread` member method.
   static void* control_thread_fn(void* data);
@@ -121,26 +376,149 @@ public:
   // field updated appropriately.
   static void* tap_buckets_thread(void* data);
 
+  // Write the records held by a tap's merge to the local memcached.
+  static void write_merged_records(TapBucketsThreadData* tap_data);
+
 private:
+  // Applies the TAP_MUTATEs from a single tap to the local memcached.  Each
+  // record is fetched from the local node with a GET, and then added or
+  // replaced if the local copy is missing or older.  If the tap is doing
+  // blind ADDs the record is added first, and only fetched if that fails
+  // because the local node already has it.  Rather than waiting for
+  // each of these requests in turn, the applier keeps a window of them in
+  // flight on the local connection and matches the responses to the mutates
+  // they are for by opaque.
+  class MutateApplier
+  {
+  public:
+    // The mutates are released back to `tap_conn`, or deleted if it is NULL
+    // (because they are merged records, owned by the applier).
+    MutateApplier(TapBucketsThreadData* tap_data,
+                  Memcached::ClientConnection* tap_conn,
+                  Memcached::ClientConnection* local_conn);
+    ~MutateApplier();
+
+    // Start applying a TAP_MUTATE received on the tap connection.  If the
+    // window is full this first waits for earlier mutates to complete.  The
+    // applier takes ownership of the message, and releases it back to the tap
+    // connection once the mutate has been applied.
+    void apply(Memcached::Message* mutate, uint16_t vbucket);
+
+    // Handle every response from the local memcached that has already
+    // arrived, without waiting for any more.
+    void poll();
+
+    // Wait for every mutate in flight to complete.
+    void drain();
+
+    // Whether every mutate so far has been applied successfully.  Mutates
+    // that are discarded (because they're for another vbucket or are
+    // Astaire's own records) count as success.
+    bool success() const { return _success; }
+
+  private:
+    struct PendingMutate
+    {
+      enum Stage { BLIND_ADD, GET, ADD, REPLACE };
+
+      Memcached::Message* mutate;
+      uint16_t vbucket;
+      Stage stage;
+
+      // When the current request for the mutate was sent.
+      uint64_t sent_time_us;
+    };
+
+    void send_local(const Memcached::BaseReq& req, PendingMutate& pending);
+    void send_store(uint8_t op_code, uint64_t cas, PendingMutate& pending);
+    void track_request(PendingMutate& pending);
+    void handle_local_rsp();
+    void complete(PendingMutate& pending);
+    void release(Memcached::Message* mutate);
+    void local_conn_failed();
+    size_t max_in_flight() const;
+    void report_latencies();
+
+    TapBucketsThreadData* _tap_data;
+    Memcached::ClientConnection* _tap_conn;
+    Memcached::ClientConnection* _local_conn;
+
+    // The counters this thread records the keys it resyncs in for the
+    // global statistics.
+    ResyncCounters* _counters;
+
+    bool _success;
+    bool _local_conn_ok;
+
+    // The mutates in flight, indexed by the opaque of the local request that
+    // is outstanding for each, and the total size of their values.
+    std::map<uint32_t, PendingMutate> _in_flight;
+    size_t _in_flight_bytes;
+    uint32_t _next_opaque;
+
+    // Latencies of local requests not yet reported to the concurrency
+    // controller.
+    std::vector<uint32_t> _latencies_us;
+  };
+
   void do_resync(bool full_resync);
+  void resync_worklist(OutstandingWorkList& owl, bool blind_add, bool delta);
   OutstandingWorkList calculate_worklist(bool full_resync);
-  void process_worklist(OutstandingWorkList& owl);
-  TapList calculate_taps(OutstandingWorkList& owl);
-  bool perform_single_tap(const std::string& server,
+  void process_worklist(OutstandingWorkList& owl, bool blind_add, bool delta);
+  TapList calculate_taps(OutstandingWorkList& owl,
+                         const std::set<uint16_t>& busy_buckets,
+                         SourceLoads& loads);
+  double estimated_bucket_bytes(uint16_t vbucket) const;
+  double estimated_throughput(const std::string& server) const;
+  void update_estimates(const std::string& server,
+                        const std::vector<uint64_t>& bucket_bytes,
+                        bool full_dump,
+                        uint64_t duration_ms);
+  MergeList calculate_merges(OutstandingWorkList& owl,
+                             const std::set<uint16_t>& busy_buckets);
+  size_t server_fanout(const std::string& server, const SourceLoads& loads) const;
+  std::vector<std::vector<uint16_t>> split_tap(const std::vector<uint16_t>& buckets,
+                                               size_t num_sub_taps,
+                                               const SourceLoads& loads);
+  BackfillList calculate_backfills(const std::string& server,
+                                   const std::vector<uint16_t>& buckets,
+                                   bool delta);
+  void perform_single_tap(const std::string& server,
                           const std::vector<uint16_t>& buckets,
-                          pthread_t* handle);
-  bool complete_single_tap(pthread_t thread_id,
-                           std::string& tap_server);
+                          bool blind_add,
+                          uint64_t backfill_date,
+                          ResyncMerge* merge,
+                          int merge_rank);
+  void wait_for_taps(std::vector<TapJob*>& jobs);
+  bool complete_single_tap(TapJob* job,
+                           std::string& tap_server,
+                           std::vector<uint16_t>& tap_buckets);
   void blacklist_server(OutstandingWorkList& owl, const std::string& server);
   static int owl_total_buckets(const OutstandingWorkList& owl);
   static bool owl_empty(const OutstandingWorkList& owl);
   static uint16_t vbucket_for_key(const std::string& key);
+  static uint16_t vbucket_for_hash(uint32_t hash);
   bool update_view();
+  bool trigger_pending() const;
 
   enum PollResult { UP_TO_DATE, OUT_OF_DATE, ERROR };
   PollResult poll_local_memcached();
   bool tag_local_memcached();
   bool untag_local_memcached();
+  void apply_checkpoint(OutstandingWorkList& owl, bool full_resync);
+  void load_history();
+  std::string local_data_id();
+  std::vector<uint16_t> owned_buckets();
+  void take_snapshot();
+  void restore_snapshot();
+  void check_for_divergence();
+  void compare_digests(OutstandingWorkList& owl);
+  bool tap_records(const std::string& server,
+                   const std::vector<uint16_t>& buckets,
+                   bool keys_only,
+                   RecordHandler* handler);
+  bool read_local_marker(const std::string& key, std::string& id);
+  bool write_local_marker(const std::string& key, const std::string& id);
   bool local_req_rsp(Memcached::BaseReq* req,
                      Memcached::BaseRsp** rsp_ptr);
 
@@ -150,6 +528,19 @@ private:
   pthread_t _control_thread_hdl;
   bool _terminated;
 
+  // The tap workers, the taps waiting for a worker, and the taps that have
+  // finished but not yet been processed by the control thread.  These are
+  // protected by their own lock, as the control thread holds the main lock
+  // throughout a resync.  The workers wait on `_tap_worker_cv` for taps to
+  // run, and the control thread on `_tap_cv` for them to finish.
+  pthread_mutex_t _tap_lock;
+  pthread_cond_t _tap_cv;
+  pthread_cond_t _tap_worker_cv;
+  std::vector<pthread_t> _tap_worker_hdls;
+  bool _tap_workers_terminated;
+  std::deque<TapJob*> _pending_taps;
+  std::deque<TapJob*> _completed_taps;
+
   Updater<void, Astaire>* _sighup_updater;
   Updater<void, Astaire>* _sigusr1_updater;
 
@@ -162,8 +553,56 @@ private:
   Alarm* _alarm;
   AstaireGlobalStatistics* _global_stats;
   AstairePerConnectionStatistics* _per_conn_stats;
+  ResyncRateLimiter* _rate_limiter;
+
+  // Adapts how hard the tap threads drive the local memcached to how it's
+  // coping.  NULL if there is no latency target.
+  ResyncConcurrencyController* _concurrency_controller;
+
+  // Records the progress of resyncs so they can be resumed.  NULL if there is
+  // no checkpoint file.
+  ResyncCheckpoint* _checkpoint;
+
+  // Records when vbuckets were last streamed from each replica, for delta
+  // resyncs.  NULL if there is no history file.
+  ResyncHistory* _history;
+
+  // A copy of the local memcached's records on disk, to reload if it
+  // restarts.  NULL if there is no snapshot file.
+  ResyncSnapshot* _snapshot;
+
+  // How often to refresh the snapshot, and when it is next due (from the
+  // monotonic clock).
+  uint64_t _snapshot_interval_ms;
+  uint64_t _next_snapshot_ms;
+
+  // The vbuckets reloaded from the snapshot since the last resync, and when
+  // that snapshot was taken.
+  std::map<uint16_t, uint64_t> _restored_buckets;
+
+  // Whether to compare digests before a full resync, and how often to check
+  // for divergence from the other replicas (0 for never), and when the next
+  // check is due.
+  bool _anti_entropy;
+  uint64_t _anti_entropy_interval_ms;
+  uint64_t _next_anti_entropy_ms;
 
   std::string _self;
+
+  // The most sub-streams to split the tap of a single server into.
+  int _tap_fanout;
+
+  // Whether to tap all of a vbucket's replicas at once and merge them.
+  bool _merge_replicas;
+
+  // The size of each vbucket in bytes, and the throughput of each server in
+  // bytes per second, as measured by earlier taps.
+  std::map<uint16_t, uint64_t> _bucket_bytes;
+  std::map<std::string, double> _server_throughput;
+
+  // Connections to the local memcached, shared by the control thread and the
+  // tap threads.
+  Memcached::ClientConnectionPool* _local_conn_pool;
 };
 
 #endif
@@ -17,6 +17,7 @@
 
 #include <atomic>
 #include <stdint.h>
+#include <vector>
 
 // Macro for defining different statistics within a StatRecorder.
 //
@@ -57,6 +58,49 @@
     std::atomic_uint_fast32_t _##NAME##_raw;                                    \
     uint32_t _##NAME
 
+// Counts of the keys and bytes resynced, updated by a single thread.
+//
+// Every tap thread updates the resync statistics for every key it streams, so
+// rather than sharing counters (and a lock), each thread updates its own.  As
+// there is only one writer the updates don't need atomic read-modify-write
+// operations, and they don't trigger any reporting - the owning statistics
+// object adds the counters up on its reporting thread's regular tick.  The
+// counters are padded out to a cache line on each side, so that threads
+// updating neighbouring counters don't contend.
+class ResyncCounters
+{
+public:
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  ResyncCounters() : _keys(0), _bytes(0) {}
+
+  // Only the owning thread may call this.
+  void increment(uint32_t keys, uint32_t bytes)
+  {
+    _keys.store(_keys.load(std::memory_order_relaxed) + keys,
+                std::memory_order_relaxed);
+    _bytes.store(_bytes.load(std::memory_order_relaxed) + bytes,
+                 std::memory_order_relaxed);
+  }
+
+  // Zero the counters.  This must not be called while the owning thread
+  // could be updating them.
+  void reset()
+  {
+    _keys.store(0, std::memory_order_relaxed);
+    _bytes.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t keys() const { return _keys.load(std::memory_order_relaxed); }
+  uint64_t bytes() const { return _bytes.load(std::memory_order_relaxed); }
+
+private:
+  char _pad_before[CACHE_LINE_SIZE];
+  std::atomic_uint_fast64_t _keys;
+  std::atomic_uint_fast64_t _bytes;
+  char _pad_after[CACHE_LINE_SIZE - 2 * sizeof(std::atomic_uint_fast64_t)];
+};
+
 class AstaireGlobalStatistics : public StatRecorder
 {
 public:
@@ -65,6 +109,12 @@ public:
     StatRecorder(period_us),
     _refresh_mutex(PTHREAD_MUTEX_INITIALIZER),
     _terminated(false),
+    _counters_lock(PTHREAD_MUTEX_INITIALIZER),
+    _counters(),
+    _removed_keys(0),
+    _removed_bytes(0),
+    _last_bytes(0),
+    _bandwidth(0),
     _statistic("astaire_global", lvc)
   {
     pthread_condattr_t cond_attr;
@@ -83,6 +133,11 @@ public:
       TRC_ERROR("Stats will only be reported on change");
     }
 
+    // These describe the state of the concurrency controller rather than the
+    // current resync, so aren't zeroed by `reset`.
+    _concurrency_window.store(0);
+    _local_latency_us.store(0);
+
     reset();
   };
 
@@ -108,11 +163,21 @@ public:
   // Zero all global statistics and report that change.
   void reset();
 
+  // Create a set of counters for a tap thread to record the keys and bytes
+  // it resyncs in.  These are included in the resynced keys, resynced bytes
+  // and bandwidth statistics until the thread is done with them and passes
+  // them to `remove_counters` (after which its totals still count).
+  ResyncCounters* add_counters();
+  void remove_counters(ResyncCounters* counters);
+
   GAUGE_STAT(total_buckets);
   COUNTER_STAT(resynced_bucket_count);
-  COUNTER_STAT(resynced_keys_count);
-  COUNTER_STAT(resynced_bytes_count);
-  COLLATED_STAT(bandwidth);
+
+  // The resync concurrency controller's window (the most requests the tap
+  // threads may have in flight to the local memcached) and its latest
+  // measurement of the local memcached's 99th percentile latency.
+  COUNTER_STAT(concurrency_window);
+  COUNTER_STAT(local_latency_us);
 
 private:
   // Standard StatReporter API functions.
@@ -120,11 +185,25 @@ private:
   void refreshed();
   void read(uint_fast64_t period_us);
 
+  // Add up the resynced keys and bytes over every set of counters.
+  void total_counters(uint64_t& keys, uint64_t& bytes);
+
   pthread_t _refresh_thread;
   pthread_cond_t _refresh_cond;
   pthread_mutex_t _refresh_mutex;
   bool _terminated;
   std::atomic_uint_fast64_t _timestamp_us;
+
+  // The counters of the running tap threads, and the totals from the
+  // counters that have been removed.  The last byte count is used to work
+  // out the bandwidth over each period.
+  pthread_mutex_t _counters_lock;
+  std::vector<ResyncCounters*> _counters;
+  uint64_t _removed_keys;
+  uint64_t _removed_bytes;
+  uint64_t _last_bytes;
+  uint32_t _bandwidth;
+
   Statistic _statistic;
 };
 
@@ -136,20 +215,55 @@ public:
     StatRecorder(period_us),
     _lock(PTHREAD_MUTEX_INITIALIZER),
     _period_us(period_us),
+    _refresh_mutex(PTHREAD_MUTEX_INITIALIZER),
+    _terminated(false),
     _statistic("astaire_connections", lvc)
   {
     lock();
     reset();
     unlock();
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_refresh_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    // The tap threads update their statistics without reporting them, so
+    // this thread reports them periodically.
+    int rc = pthread_create(&_refresh_thread,
+                            NULL,
+                            AstairePerConnectionStatistics::thread_func,
+                            this);
+    if (rc != 0)
+    {
+      TRC_ERROR("Stats reporter thread creation failed (%d)", rc);
+      TRC_ERROR("Per-bucket stats will only be reported on change");
+    }
   }
 
   virtual ~AstairePerConnectionStatistics()
   {
+    pthread_mutex_lock(&_refresh_mutex);
+    _terminated = true;
+    pthread_cond_signal(&_refresh_cond);
+    pthread_mutex_unlock(&_refresh_mutex);
+    pthread_join(_refresh_thread, NULL);
+
     lock();
     reset();
     unlock();
   }
 
+  // Entry point to run the reporting thread.  The `void*` argument must be a
+  // pointer to the owning AstairePerConnectionStatistics object.
+  static void* thread_func(void* arg)
+  {
+    ((AstairePerConnectionStatistics*)arg)->thread_func();
+    return NULL;
+  }
+  void thread_func();
+
   // A record representing the stats for a single bucket.
   class ConnectionRecord;
   class BucketRecord : public StatRecorder
@@ -160,14 +274,18 @@ public:
                  uint_fast64_t period_us) :
       StatRecorder(period_us),
       bucket_id(bucket_id),
-      _parent(parent)
+      _parent(parent),
+      _counters(),
+      _last_bytes(0),
+      _bandwidth(0)
     {};
     virtual ~BucketRecord() {};
 
     uint16_t bucket_id;
 
     // All access to this object must be done while the parent ConnectionRecord (or
-    // grandparent PerConnectionStatistics object) are locked.
+    // grandparent PerConnectionStatistics object) are locked, apart from
+    // `record_resynced_key`.
 
     // Standard StatReporter API functions.
     void refresh(bool force);
@@ -178,12 +296,19 @@ public:
     // Write the stats for this BucketRecord to the given vector.
     void write_out(std::vector<std::string>& vec);
 
-    COUNTER_STAT(resynced_keys_count);
-    COUNTER_STAT(resynced_bytes_count);
-    COLLATED_STAT(bandwidth);
+    // Record a key resynced into this bucket.  This is only called by the
+    // tap thread for the parent connection, and doesn't need any locks.  The
+    // change is reported on the next tick of the reporting thread.
+    void record_resynced_key(uint32_t bytes) { _counters.increment(1, bytes); }
 
 private:
     ConnectionRecord* _parent;
+    ResyncCounters _counters;
+
+    // The byte count at the start of the current period, and the bandwidth
+    // over the last period.
+    uint64_t _last_bytes;
+    uint32_t _bandwidth;
   };
 
   // A record representing the stats for a single TAP connection.
@@ -260,6 +385,19 @@ private:
       return _bucket_map[bucket];
     }
 
+    // Record a key resynced into the given bucket.  Only the tap thread for
+    // this connection may call this, and it does not need to lock the
+    // ConnectionRecord (the set of buckets never changes once the record has
+    // been created).
+    void record_resynced_key(uint16_t bucket, uint32_t bytes)
+    {
+      std::map<uint16_t, BucketRecord*>::iterator it = _bucket_map.find(bucket);
+      if (it != _bucket_map.end())
+      {
+        it->second->record_resynced_key(bytes);
+      }
+    }
+
     // Lock or unlock this stats object and the parent stats object.  Locking
     // is required around most public functions.
     void lock() { pthread_mutex_lock(_lock); };
@@ -300,6 +438,12 @@ private:
   uint_fast64_t _period_us;
   std::vector<ConnectionRecord*> _connections;
   std::atomic_uint_fast64_t _timestamp_us;
+
+  pthread_t _refresh_thread;
+  pthread_cond_t _refresh_cond;
+  pthread_mutex_t _refresh_mutex;
+  bool _terminated;
+
   Statistic _statistic;
 };
 
@@ -15,6 +15,7 @@
 
 #include <pthread.h>
 
+#include <map>
 #include <sstream>
 #include <vector>
 
@@ -54,6 +55,16 @@ public:
                                   std::string& data,
                                   uint64_t& cas);
 
+  /// Gets the data for a set of keys, fetching the keys that share a replica
+  /// in a single batch.  Keys missing from their first replica are fetched
+  /// from their next replica in another batch, and so on.  `statuses`, `data`
+  /// and `cas` are filled in with the result for each key, in the same order
+  /// as `keys`.
+  void read_data_multi(const std::vector<std::string>& keys,
+                       std::vector<Memcached::ResultCode>& statuses,
+                       std::vector<std::string>& data,
+                       std::vector<uint64_t>& cas);
+
   /// Sets the data for the specified key.
   Memcached::ResultCode write_data(Memcached::OpCode operation,
                                    const std::string& key,
@@ -93,6 +104,17 @@ private:
                                       std::string& data,
                                       uint64_t& cas);
 
+  // Perform a multi-get of a batch of keys (given by their indexes into
+  // `keys`) from a single replica.  `found`, `data` and `cas` are filled in
+  // for the keys the replica has.  Returns success if the replica answered
+  // for every key, or the error that stopped it.
+  memcached_return_t get_batch_from_replica(memcached_st* replica,
+                                            const std::vector<std::string>& keys,
+                                            const std::vector<size_t>& indexes,
+                                            std::vector<bool>& found,
+                                            std::vector<std::string>& data,
+                                            std::vector<uint64_t>& cas);
+
   // Utility function to turn a return code from libmemcached back into a status
   // code that can be used in the binary protocol.
   //
@@ -0,0 +1,151 @@
+/**
+ * @file memcached_event_loop.hpp - event loops for memcached connections.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MEMCACHED_EVENT_LOOP_H__
+#define MEMCACHED_EVENT_LOOP_H__
+
+#include "memcached_tap_client.hpp"
+
+#include <map>
+#include <vector>
+
+namespace Memcached
+{
+  // Multiplexes many non-blocking connections onto a single thread.
+  //
+  // Connections are registered with a Handler, which the loop calls when the
+  // connection is ready for it to do something.  The loop only ever calls
+  // handlers from the thread running `poll` or `run`, and all methods other
+  // than `stop` must be called from that thread too.
+  //
+  // A handler does not have to drain its connection each time it is called.
+  // A single call to `recv_batch` returns every complete message that has
+  // arrived, and the loop calls the handler again when there is more.  The
+  // messages remain valid until the handler returns.
+  class EventLoop
+  {
+  public:
+    class Handler
+    {
+    public:
+      virtual ~Handler() {}
+
+      // Called when there is data to read on the connection, or the peer has
+      // closed it.  The handler should call `recv_batch` (which won't block)
+      // and act on the result.
+      virtual void on_readable(Connection* conn) = 0;
+
+      // Called when a connection started with `connect_async` has finished
+      // connecting.  `rc` is 0 on success, or the error that caused the
+      // connection to fail - in which case the handler should remove the
+      // connection from the loop.
+      virtual void on_connected(ClientConnection* conn, int rc) {}
+
+      // Called when the loop has finished sending output that had been queued
+      // on the connection.
+      virtual void on_writable(Connection* conn) {}
+
+      // Called when sending queued output fails.  The connection has been
+      // closed and the handler should remove it from the loop.
+      virtual void on_error(Connection* conn, Status status) {}
+    };
+
+    virtual ~EventLoop() {}
+
+    // Create the most efficient event loop this system supports.  This is
+    // io_uring-based if io_uring support was built in and the kernel supports
+    // everything the loop needs, and epoll-based otherwise.  The loop has
+    // already been initialized.  Returns NULL on failure.
+    static EventLoop* create();
+
+    // Set up the loop.  Returns false if the kernel resources the loop needs
+    // couldn't be allocated.
+    virtual bool init() = 0;
+
+    // Start watching a connection.  The connection must already be connected
+    // (or connecting) and in non-blocking mode.  The loop does not take
+    // ownership of either the connection or the handler.
+    virtual bool add(Connection* conn, Handler* handler) = 0;
+
+    // Stop watching a connection.  This is safe to call from a handler,
+    // including for a connection other than the one the handler was called
+    // for.
+    virtual void remove(Connection* conn) = 0;
+
+    // Tell the loop that the connection has queued output.  There is no need
+    // to call this from the connection's own handler, as the loop checks when
+    // the handler returns.
+    virtual void update(Connection* conn) = 0;
+
+    // Wait up to `timeout_ms` milliseconds (or forever, if -1) for events and
+    // call the handlers for them.  Returns the number of events handled, or
+    // -1 on error.
+    virtual int poll(int timeout_ms) = 0;
+
+    // Call `poll` repeatedly until `stop` is called.
+    void run();
+
+    // Make `run` return.  Unlike all other methods this may be called from
+    // any thread.
+    virtual void stop() = 0;
+
+  protected:
+    EventLoop() : _stopped(false) {}
+
+    // Set by `poll` when it sees that `stop` has been called.
+    bool _stopped;
+  };
+
+  // Event loop based on level-triggered epoll.  The loop waits for EPOLLOUT
+  // only while a connection is connecting or has queued output.
+  class EpollEventLoop : public EventLoop
+  {
+  public:
+    EpollEventLoop();
+    virtual ~EpollEventLoop();
+
+    virtual bool init();
+    virtual bool add(Connection* conn, Handler* handler);
+    virtual void remove(Connection* conn);
+    virtual void update(Connection* conn);
+    virtual int poll(int timeout_ms);
+    virtual void stop();
+
+  private:
+    struct Registration
+    {
+      Connection* conn;
+      Handler* handler;
+      int fd;
+      uint32_t events;
+      bool removed;
+    };
+
+    // Work out which events we need to wait for on the connection, and update
+    // epoll if that has changed.
+    void update_events(Registration* reg);
+    void dispatch(Registration* reg, uint32_t events);
+
+    static const int MAX_EVENTS = 64;
+
+    int _epoll_fd;
+    int _stop_fd;
+
+    std::map<Connection*, Registration*> _registrations;
+
+    // Registrations that have been removed but may still be referred to by
+    // events from the current call to epoll_wait.  These are freed at the end
+    // of each poll.
+    std::vector<Registration*> _removed;
+  };
+}
+
+#endif
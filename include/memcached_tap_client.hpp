@@ -14,9 +14,16 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <utility>
 #include <cstdint>
+#include <cstring>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <pthread.h>
 #include <boost/detail/endian.hpp>
+#include <boost/utility/string_ref.hpp>
 #include <log.h>
 
 // Simple Object Definitions
@@ -56,6 +63,15 @@ namespace Memcached
       T network_value = host_to_network(value);
       str.append(reinterpret_cast<const char*>(&network_value), sizeof(T));
     }
+
+    // Write a value in network byte order to a raw buffer, returning a
+    // pointer to the byte after the value.
+    template<class T> char* write(const T& value, char* buf)
+    {
+      T network_value = host_to_network(value);
+      memcpy(buf, &network_value, sizeof(T));
+      return buf + sizeof(T);
+    }
   }
 
   enum struct OpCode
@@ -66,13 +82,27 @@ namespace Memcached
     REPLACE = 0x03,
     DELETE = 0x04,
     QUIT = 0x07,
+    GETQ = 0x09,
+    NOOP = 0x0a,
     VERSION = 0x0b,
     GETK = 0x0c,
+    GETKQ = 0x0d,
+    SETQ = 0x11,
+    ADDQ = 0x12,
+    REPLACEQ = 0x13,
+    DELETEQ = 0x14,
+    QUITQ = 0x17,
     TAP_CONNECT = 0x40,
     TAP_MUTATE = 0x41,
     SET_VBUCKET = 0x3d
   };
 
+  // Quiet commands only get a response if something goes wrong (or, for
+  // GETQ/GETKQ, if the key is found).  Otherwise they behave exactly like
+  // their normal counterparts, which `unquiet` maps them to.
+  bool is_quiet(uint8_t op_code);
+  uint8_t unquiet(uint8_t op_code);
+
   enum struct ResultCode
   {
     NO_ERROR = 0X0000,
@@ -106,6 +136,7 @@ namespace Memcached
     OK,
     DISCONNECTED,
     ERROR,
+    WOULD_BLOCK, // Only returned by connections in non-blocking mode
   };
 
   /* Binary structure of the fixed-length header for Memcached messages */
@@ -122,6 +153,96 @@ namespace Memcached
     uint64_t cas;
   };
 
+  /* A view onto a single complete message in a receive buffer.
+   *
+   * The header fields are decoded into host byte order, but the variable
+   * length sections are left where they are - the spans point straight into
+   * the buffer that the message was parsed from.  This means decoding a view
+   * never allocates or copies, but the view is only valid for as long as the
+   * underlying buffer is unchanged. */
+  struct MsgView
+  {
+    bool request;
+    uint8_t op_code;
+    uint16_t vbucket_or_status;
+    uint32_t opaque;
+    uint64_t cas;
+
+    // The whole message (header included) and its three body sections.
+    boost::string_ref frame;
+    boost::string_ref extra;
+    boost::string_ref key;
+    boost::string_ref value;
+
+    // Get the Nth 32-bit word of the extras section, in host byte order.
+    // Returns 0 if the extras section is too short to contain that word.
+    uint32_t extra_word(size_t index) const;
+  };
+
+  /* Buffer used to accumulate data read off a socket.
+   *
+   * Messages are consumed from the front of the buffer by advancing an
+   * offset, rather than by copying the rest of the buffer down, so consuming
+   * a message is O(1) regardless of how much data is queued behind it.  The
+   * unconsumed tail (normally at most one partial message) is only moved to
+   * the front of the buffer when more space is needed.
+   *
+   * The data is kept in a block that can be held by messages received into
+   * it, so that they stay valid after they have been consumed.  While the
+   * block is held nothing in it is moved or overwritten - once it fills up,
+   * the unconsumed tail is moved to a new block instead, and the old one is
+   * freed when the last message holding it is released. */
+  class RecvBuffer
+  {
+  public:
+    typedef std::shared_ptr<std::vector<char>> Block;
+
+    RecvBuffer() : _buf(std::make_shared<std::vector<char>>()), _start(0), _end(0) {}
+
+    const char* data() const { return _buf->data() + _start; }
+    size_t length() const { return _end - _start; }
+
+    // Get a pointer to at least `size` bytes of free space at the end of the
+    // buffer.  Data should be written there and then `commit`ted.  This may
+    // move the unconsumed data, invalidating any views into the buffer.
+    char* reserve(size_t size);
+    void commit(size_t size) { _end += size; }
+
+    // Discard `size` bytes from the front of the buffer.
+    void consume(size_t size);
+
+    // Discard everything in the buffer.
+    void clear();
+
+    // Keep the data already in the buffer valid for as long as the returned
+    // block is held.
+    Block hold() const { return _buf; }
+
+  private:
+    bool held() const { return _buf.use_count() > 1; }
+
+    Block _buf;
+    size_t _start;
+    size_t _end;
+  };
+
+  /* The serialized form of a message, ready to be sent with writev.
+   *
+   * The header and extras are written into a fixed buffer held in this
+   * object, while the key and value are referenced in place - so a WireMsg
+   * must not outlive the message it was built from. */
+  struct WireMsg
+  {
+    // The longest extras section of any message we send (TAP_MUTATE has
+    // 16 bytes of extras).
+    static const size_t MAX_EXTRA_LENGTH = 32;
+
+    char header[sizeof(MsgHdr) + MAX_EXTRA_LENGTH];
+    struct iovec iov[3];
+    int iov_count;
+    size_t length;
+  };
+
   /* This abstract base class represents a generic Memcached message.
    *
    * This class is mostly used for defining common utilities and specifying a
@@ -131,12 +252,12 @@ namespace Memcached
   public:
     BaseMessage(uint8_t op_code, std::string key, uint32_t opaque, uint64_t cas) :
       _op_code(op_code),
-      _key(key),
+      _key(std::move(key)),
       _opaque(opaque),
       _cas(cas)
     {
     }
-    BaseMessage(const std::string& msg);
+    BaseMessage(const MsgView& msg);
     virtual ~BaseMessage() {};
 
     virtual bool is_request() const = 0;
@@ -146,11 +267,19 @@ namespace Memcached
     inline uint32_t opaque() const { return _opaque; };
     inline uint64_t cas() const { return _cas; };
 
+    // Serialize the message into a header buffer plus an iovec list that
+    // points at the key and value held in this object.
+    void to_wire(WireMsg& wire) const;
+
+    // Serialize the message into a single string.  This copies the key and
+    // value, so prefer the WireMsg form on performance-sensitive paths.
     std::string to_wire() const;
 
   protected:
-    virtual std::string generate_extra() const{ return ""; };
-    virtual std::string generate_value() const { return ""; };
+    // Write the extras section into `buf` (which has room for
+    // WireMsg::MAX_EXTRA_LENGTH bytes), returning its length.
+    virtual size_t generate_extra(char* /*buf*/) const { return 0; };
+    virtual boost::string_ref generate_value() const { return boost::string_ref(); };
     virtual uint16_t generate_vbucket_or_status() const = 0;
 
     uint8_t _op_code;
@@ -167,11 +296,11 @@ namespace Memcached
             uint16_t vbucket,
             uint32_t opaque,
             uint64_t cas) :
-      BaseMessage(command, key, opaque, cas),
+      BaseMessage(command, std::move(key), opaque, cas),
       _vbucket(vbucket)
     {
     }
-    BaseReq(const std::string& msg);
+    BaseReq(const MsgView& msg);
 
     bool is_request() const { return true; }
     bool is_response() const { return false; }
@@ -191,11 +320,11 @@ namespace Memcached
             uint16_t status,
             uint32_t opaque,
             uint64_t cas) :
-      BaseMessage(command, key, opaque, cas),
+      BaseMessage(command, std::move(key), opaque, cas),
       _status(status)
     {
     }
-    BaseRsp(const std::string& msg);
+    BaseRsp(const MsgView& msg);
 
     bool is_request() const { return false; }
     bool is_response() const { return true; }
@@ -210,13 +339,10 @@ namespace Memcached
   class GetReq : public BaseReq
   {
   public:
-    GetReq(const std::string& msg) : BaseReq(msg) {}
+    GetReq(const MsgView& msg) : BaseReq(msg) {}
 
-    // This constructor explicitly takes an opaque parameter to distinguish it
-    // from the previous constructor (which initializes a GET request from a
-    // message buffer).
     GetReq(std::string key, uint32_t opaque) :
-      BaseReq((uint8_t)OpCode::GET, key, 0, opaque, 0)
+      BaseReq((uint8_t)OpCode::GET, std::move(key), 0, opaque, 0)
     {}
 
     bool response_needs_key() const;
@@ -225,20 +351,23 @@ namespace Memcached
   class GetRsp : public BaseRsp
   {
   public:
-    GetRsp(const std::string& msg);
+    GetRsp(const MsgView& msg);
     GetRsp(uint16_t status,
            uint32_t opaque,
            uint64_t cas,
-           const std::string& value,
+           std::string value,
            uint32_t flags,
            const std::string& key = "");
 
-    std::string value() const { return _value; };
+    const std::string& value() const { return _value; };
     uint32_t flags() const { return _flags; };
 
+    // Turn this into the response to a GETQ (or GETKQ, if it has a key).
+    void make_quiet();
+
   private:
-    virtual std::string generate_extra() const;
-    virtual std::string generate_value() const;
+    virtual size_t generate_extra(char* buf) const;
+    virtual boost::string_ref generate_value() const { return _value; };
 
     std::string _value;
     uint32_t _flags;
@@ -247,43 +376,61 @@ namespace Memcached
   class DeleteReq : public BaseReq
   {
   public:
-    DeleteReq(const std::string& msg) : BaseReq(msg) {}
+    DeleteReq(const MsgView& msg) : BaseReq(msg) {}
 
-    // This constructor explicitly takes an opaque parameter to distinguish it
-    // from the previous constructor (which initializes a GET request from a
-    // message buffer).
     DeleteReq(std::string key, uint32_t opaque) :
-      BaseReq((uint8_t)OpCode::DELETE, key, 0, opaque, 0)
+      BaseReq((uint8_t)OpCode::DELETE, std::move(key), 0, opaque, 0)
     {}
   };
 
   class DeleteRsp : public BaseRsp
   {
   public:
-    DeleteRsp(const std::string& msg);
-    DeleteRsp(uint8_t status, uint32_t opaque) :
-      BaseRsp((uint8_t)OpCode::DELETE, "", status, opaque, 0)
+    DeleteRsp(const MsgView& msg) : BaseRsp(msg) {}
+    DeleteRsp(uint8_t status,
+              uint32_t opaque,
+              uint8_t command = (uint8_t)OpCode::DELETE) :
+      BaseRsp(command, "", status, opaque, 0)
+    {}
+  };
+
+  class NoopReq : public BaseReq
+  {
+  public:
+    NoopReq(const MsgView& msg) : BaseReq(msg) {}
+    NoopReq(uint32_t opaque) :
+      BaseReq((uint8_t)OpCode::NOOP, "", 0, opaque, 0)
+    {}
+  };
+
+  class NoopRsp : public BaseRsp
+  {
+  public:
+    NoopRsp(const MsgView& msg) : BaseRsp(msg) {}
+    NoopRsp(uint32_t opaque) :
+      BaseRsp((uint8_t)OpCode::NOOP, "", (uint16_t)ResultCode::NO_ERROR, opaque, 0)
     {}
   };
 
   class SetAddReplaceReq : public BaseReq
   {
   public:
-    SetAddReplaceReq(const std::string& msg);
+    SetAddReplaceReq(const MsgView& msg);
     SetAddReplaceReq(uint8_t command,
                      std::string key,
                      uint16_t vbucket,
                      std::string value,
                      uint64_t cas,
                      uint32_t flags,
-                     uint32_t expiry);
+                     uint32_t expiry,
+                     uint32_t opaque = 0);
 
     uint32_t expiry() const { return _expiry; }
-    std::string value() const { return _value; }
+    const std::string& value() const { return _value; }
 
   protected:
-    std::string generate_extra() const;
-    std::string generate_value() const;
+    size_t generate_extra(char* buf) const;
+    boost::string_ref generate_value() const { return _value; }
 
   private:
     std::string _value;
@@ -294,7 +441,7 @@ namespace Memcached
   class SetAddReplaceRsp : public BaseRsp
   {
   public:
-    SetAddReplaceRsp(const std::string& msg) : BaseRsp(msg) {};
+    SetAddReplaceRsp(const MsgView& msg) : BaseRsp(msg) {};
 
     SetAddReplaceRsp(uint8_t command,
                      uint8_t status,
@@ -307,14 +454,15 @@ namespace Memcached
   class SetReq : public SetAddReplaceReq
   {
   public:
-    SetReq(const std::string& msg) : SetAddReplaceReq(msg) {}
+    SetReq(const MsgView& msg) : SetAddReplaceReq(msg) {}
 
     SetReq(std::string key,
            uint16_t vbucket,
            std::string value,
            uint32_t flags,
-           uint32_t expiry) :
-      SetAddReplaceReq((uint8_t)OpCode::SET, key, vbucket, value, 0, flags, expiry)
+           uint32_t expiry,
+           uint32_t opaque = 0) :
+      SetAddReplaceReq((uint8_t)OpCode::SET, std::move(key), vbucket, std::move(value), 0, flags, expiry, opaque)
     {}
   };
 
@@ -323,14 +471,15 @@ namespace Memcached
   class AddReq : public SetAddReplaceReq
   {
   public:
-    AddReq(const std::string& msg): SetAddReplaceReq(msg) {}
+    AddReq(const MsgView& msg): SetAddReplaceReq(msg) {}
 
     AddReq(std::string key,
            uint16_t vbucket,
            std::string value,
            uint32_t flags,
-           uint32_t expiry) :
-      SetAddReplaceReq((uint8_t)OpCode::ADD, key, vbucket, value, 0, flags, expiry)
+           uint32_t expiry,
+           uint32_t opaque = 0) :
+      SetAddReplaceReq((uint8_t)OpCode::ADD, std::move(key), vbucket, std::move(value), 0, flags, expiry, opaque)
     {}
   };
 
@@ -339,37 +488,50 @@ namespace Memcached
   class ReplaceReq : public SetAddReplaceReq
   {
   public:
-    ReplaceReq(const std::string& msg): SetAddReplaceReq(msg) {}
+    ReplaceReq(const MsgView& msg): SetAddReplaceReq(msg) {}
 
     ReplaceReq(std::string key,
                uint16_t vbucket,
                std::string value,
                uint64_t cas,
                uint32_t flags,
-               uint32_t expiry) :
-      SetAddReplaceReq((uint8_t)OpCode::REPLACE, key, vbucket, value, cas, flags, expiry)
+               uint32_t expiry,
+               uint32_t opaque = 0) :
+      SetAddReplaceReq((uint8_t)OpCode::REPLACE, std::move(key), vbucket, std::move(value), cas, flags, expiry, opaque)
     {}
   };
 
   typedef SetAddReplaceRsp ReplaceRsp;
 
+  // Asks for a dump of the given vbuckets (or all of them, if the list is
+  // empty).  If `backfill_date` is non-zero, only records that have changed
+  // since that time (in seconds since the epoch) are asked for.  If
+  // `keys_only` is set, the server is asked to leave out the records'
+  // values.
   class TapConnectReq : public BaseReq
   {
   public:
-    TapConnectReq(const VBucketList& buckets);
+    TapConnectReq(const VBucketList& buckets,
+                  uint64_t backfill_date = 0,
+                  bool keys_only = false);
 
   protected:
-    std::string generate_extra() const;
-    std::string generate_value() const;
+    size_t generate_extra(char* buf) const;
+    boost::string_ref generate_value() const { return _value; }
 
   private:
     std::vector<uint16_t> _buckets;
+    uint64_t _backfill_date;
+    bool _keys_only;
+
+    // The bucket list in wire format, built when the request is constructed.
+    std::string _value;
   };
 
   class VersionReq : public BaseReq
   {
   public:
-    VersionReq(const std::string& msg) : BaseReq(msg) {}
+    VersionReq(const MsgView& msg) : BaseReq(msg) {}
   };
 
   class VersionRsp : public BaseRsp
@@ -379,7 +541,7 @@ namespace Memcached
                uint32_t opaque,
                const std::string& version);
 
-    std::string generate_value() const;
+    boost::string_ref generate_value() const { return _version; }
 
   private:
     std::string _version;
@@ -388,9 +550,9 @@ namespace Memcached
   class TapMutateReq : public BaseReq
   {
   public:
-    TapMutateReq(const std::string& msg);
+    TapMutateReq(const MsgView& msg);
 
-    std::string value() const { return _value; };
+    const std::string& value() const { return _value; };
     uint32_t flags() const { return _flags; };
     uint32_t expiry() const { return _expiry; };
 
@@ -413,12 +575,104 @@ namespace Memcached
     {
     }
 
-    std::string generate_extra() const;
+    size_t generate_extra(char* buf) const;
 
   private:
     VBucketStatus _status;
   };
 
+  /* A received message.
+   *
+   * Unlike the BaseMessage hierarchy this is a single concrete type - the op
+   * code (and whether the message is a request or a response) determines
+   * which of the accessors are meaningful.  The key, extras and value are
+   * spans that normally point into the receive buffer of the connection the
+   * message arrived on, so receiving one doesn't allocate or copy.  If the
+   * message needs to outlive that buffer, `detach` copies it into storage
+   * owned by the message, while Connection::hold keeps it valid in the
+   * receive buffer instead.
+   *
+   * Messages are handed out by Connection::recv from a per-connection pool,
+   * and must be given back with Connection::release once the caller has
+   * dispatched them.  A released message keeps its storage, so in the steady
+   * state neither receiving nor detaching a message allocates. */
+  class Message
+  {
+  public:
+    bool is_request() const { return _view.request; }
+    bool is_response() const { return !_view.request; }
+    uint8_t op_code() const { return _view.op_code; }
+    uint16_t vbucket() const { return _view.vbucket_or_status; }
+    uint16_t result_code() const { return _view.vbucket_or_status; }
+    uint32_t opaque() const { return _view.opaque; }
+    uint64_t cas() const { return _view.cas; }
+
+    boost::string_ref frame() const { return _view.frame; }
+    boost::string_ref extra() const { return _view.extra; }
+    boost::string_ref key() const { return _view.key; }
+    boost::string_ref value() const { return _view.value; }
+
+    // The flags and expiry fields from the extras.  Where these are depends
+    // on the op code - they are only present on TAP_MUTATE and
+    // SET/ADD/REPLACE requests (and, for flags, successful GET responses).
+    uint32_t flags() const;
+    uint32_t expiry() const;
+
+    // Whether a response to this (GET or GETK) request should carry the key.
+    bool response_needs_key() const;
+
+    // Copy the message into storage owned by this object, so that it remains
+    // valid after the buffer it was received into has changed.
+    void detach();
+
+    // Rewrite a detached or held TAP_MUTATE in place into a request (SET, ADD
+    // or REPLACE) to store the same record, and return the request's frame,
+    // ready to send.  The request's flags, expiry, key and value are the
+    // mutate's, left where they are - only a new header is written, over the
+    // start of the mutate's frame - so the value is never copied.  The
+    // accessors still describe the TAP_MUTATE afterwards, and the message can
+    // be rewritten again (for example with a different CAS).
+    //
+    // Returns an empty frame if the message isn't a detached or held
+    // TAP_MUTATE with the usual extras.
+    boost::string_ref rewrite_as_store(uint8_t op_code,
+                                       uint16_t vbucket,
+                                       uint32_t opaque,
+                                       uint64_t cas);
+
+  private:
+    friend class Connection;
+    friend class MessagePool;
+
+    MsgView _view;
+    std::string _storage;
+
+    // The receive buffer block the message is held in, if any.
+    RecvBuffer::Block _block;
+  };
+
+  /* A free list of Message objects.  This is not thread-safe - each
+   * connection has its own pool, and a connection is only ever used by one
+   * thread at a time. */
+  class MessagePool
+  {
+  public:
+    MessagePool() : _free() {}
+    ~MessagePool();
+
+    Message* get();
+    void put(Message* msg);
+
+  private:
+    // Disallow copying, as the pool owns the messages on its free list.
+    MessagePool(const MessagePool&);
+    MessagePool& operator=(const MessagePool&);
+
+    std::vector<Message*> _free;
+  };
+
+  class UringEventLoop;
+
   class Connection
   {
   public:
@@ -427,22 +681,190 @@ namespace Memcached
     bool send(const BaseMessage& msg);
     Status recv(BaseMessage** msg);
 
+    // Send a message that is already in wire format.
+    bool send_frame(boost::string_ref frame);
+
+    // Send a SET, ADD or REPLACE request for a record whose key and value
+    // are held elsewhere.  They are sent from where they are, rather than
+    // being copied into a request object first.
+    bool send_store(uint8_t op_code,
+                    boost::string_ref key,
+                    uint16_t vbucket,
+                    boost::string_ref value,
+                    uint32_t flags,
+                    uint32_t expiry);
+
+    // Receive a single message from the connection's pool.  Unless the caller
+    // detaches it, the message's contents remain valid until the next call to
+    // `recv` on this connection.  The message must be passed to `release`
+    // once the caller has finished with it.
+    Status recv(Message*& msg);
+    void release(Message* msg) { if (msg != NULL) { _pool.put(msg); } }
+
+    // Keep a message received on this connection valid after later receives,
+    // until it is released, by holding on to the part of the receive buffer
+    // it is in.  Unlike `detach` this doesn't copy the message, but the
+    // buffer can't reuse its space while the message is held, so this is for
+    // messages that are released again soon.
+    void hold(Message* msg);
+
+    // Receive every complete message that is available, appending them to
+    // `msgs`.  If no complete messages are buffered this blocks until at
+    // least one arrives, and then decodes every complete message in the
+    // buffer, leaving only a trailing partial message behind.  The messages
+    // come from the connection's pool, as for `recv`, and must each be
+    // released.
+    Status recv_batch(std::vector<Message*>& msgs);
+
+    // Receive a single message without copying it out of the connection's
+    // receive buffer.  The view remains valid until the next call to `recv`
+    // on this connection.
+    Status recv(MsgView& msg);
+
+    // Whether `recv` would return straight away, with a message or an error,
+    // rather than waiting for data.  This reads whatever has already arrived
+    // on the socket, so like `recv` it invalidates the messages handed out by
+    // the previous `recv`.
+    bool recv_ready();
+
     std::string address() { return _address; }
+    int fd() const { return _sock; }
+
+    // Switch the connection into non-blocking mode, for use with an
+    // EventLoop.  In this mode `recv` and `recv_batch` return WOULD_BLOCK
+    // rather than waiting for data, and `send` queues whatever the socket
+    // won't take straight away.  The queued data is sent by calling `flush`
+    // when the socket becomes writable.
+    bool set_nonblocking();
+    bool is_nonblocking() const { return _nonblocking; }
+
+    // Whether the connection is still being established (see
+    // `ClientConnection::connect_async`).
+    virtual bool is_connecting() const { return false; }
+
+    // Send as much queued output as the socket will take.  Returns OK once
+    // the queue is empty, or WOULD_BLOCK if there is still data queued.
+    Status flush();
+    bool has_queued_output() const { return _send_offset < _send_queue.length(); }
 
   protected:
     Connection();
     virtual ~Connection();
 
+    // Send the whole of the given buffers, retrying after partial writes.
+    bool send(struct iovec* iov, int iov_count);
+
+    // Close the socket and throw away everything buffered in either
+    // direction, ready for the connection to be re-established.
+    void reset();
+
+    // Discard the messages handed out by the previous `recv`, then do a single
+    // read from the socket into the receive buffer.
+    void consume_delivered();
+    Status read_more(int flags = 0);
+
+    // Hooks for event loops that do the connection's socket I/O themselves
+    // (see UringEventLoop).  While external I/O is enabled, `recv` only
+    // decodes data that the loop has appended with `append_received`, and
+    // `send` always queues its output for the loop to collect with
+    // `take_queued_output`.  The loop reports the socket closing or failing
+    // with `set_external_status`, which `recv` then returns.
+    friend class UringEventLoop;
+    void set_external_io(bool external) { _external_io = external; }
+    void append_received(const char* data, size_t length);
+    void take_queued_output(std::string& output);
+    void set_external_status(Status status) { _external_status = status; }
+
     std::string _address;
     int _sock;
-    std::string _buffer;
+    RecvBuffer _buffer;
+
+    // The length of the messages handed out by the last `recv`.  These are
+    // left in the buffer (so that views onto them stay valid) until the next
+    // `recv`.
+    size_t _delivered_length;
+
+    MessagePool _pool;
+
+    // Output that a non-blocking socket hasn't accepted yet.  Data before
+    // `_send_offset` has already been sent.
+    bool _nonblocking;
+    std::string _send_queue;
+    size_t _send_offset;
+
+    bool _external_io;
+    Status _external_status;
   };
 
   class ClientConnection : public Connection
   {
   public:
     ClientConnection(const std::string& address);
+    virtual ~ClientConnection();
+
+    // Connect to the server, blocking until the connection is established.
+    // Returns 0 on success.  If the connection was already connected, it is
+    // closed and re-established.  The server's address is only resolved on
+    // the first connect (or after a connect fails), so reconnecting is cheap.
     int connect();
+
+    // Start connecting to the server without waiting for the connection to
+    // be established.  The connection is left in non-blocking mode.  Returns
+    // 0 on success, in which case `is_connecting` says whether the connection
+    // is still in progress - if so, the caller should wait for the socket to
+    // become writable and then call `complete_connect`.
+    int connect_async();
+    virtual bool is_connecting() const { return _connecting; }
+
+    // Find out whether an in-progress connection attempt succeeded.  Returns 0
+    // if it did, or the error that caused it to fail.
+    int complete_connect();
+
+  private:
+    // Resolve the server's address (if we haven't already) and create a
+    // socket to connect to it.
+    int create_socket();
+
+    // Forget the server's resolved address, so that it is looked up again
+    // next time we connect.
+    void forget_address();
+
+    bool _connecting;
+    struct ::addrinfo* _addr_info;
+  };
+
+  // A pool of blocking connections to a single server, for callers that
+  // want to reuse connections rather than set one up for every request.
+  // Connections are created on demand and reconnected if they have been
+  // closed.  This is thread-safe, but each connection is only used by one
+  // caller at a time.
+  class ClientConnectionPool
+  {
+  public:
+    ClientConnectionPool(const std::string& address, size_t max_idle);
+    ~ClientConnectionPool();
+
+    // Get a connected connection from the pool.  Returns NULL if we can't
+    // connect to the server.
+    ClientConnection* get();
+
+    // Return a connection to the pool.  The caller should say if it has left
+    // the connection in an unknown state (for example, with a response still
+    // to be read), in which case it is closed and reconnected next time.
+    void put(ClientConnection* conn, bool healthy = true);
+
+    const std::string& address() const { return _address; }
+
+  private:
+    // Disallow copying, as the pool owns its idle connections.
+    ClientConnectionPool(const ClientConnectionPool&);
+    ClientConnectionPool& operator=(const ClientConnectionPool&);
+
+    std::string _address;
+    size_t _max_idle;
+
+    pthread_mutex_t _lock;
+    std::vector<ClientConnection*> _idle;
   };
 
   class ServerConnection : public Connection
@@ -460,12 +882,27 @@ namespace Memcached
   // @param output - A pointer to store the parsed message.
   bool from_wire(std::string& binary, BaseMessage*& output);
 
+  // Build an owned message object from a view of a complete message.  This
+  // copies the key and value out of the view's underlying buffer.
+  BaseMessage* from_wire(const MsgView& msg);
+
+  // Decode the message at the front of a buffer into a view, without copying
+  // any of it.
+  //
+  // @returns  True if the buffer starts with a complete message.
+  bool parse(const char* data, size_t length, MsgView& output);
+
   // Parsing utility fuctions.
   bool is_msg_complete(const std::string& msg,
                        bool& request,
                        uint32_t& body_length,
                        uint8_t& op_code);
-  template <class T> BaseMessage* from_wire_int(const std::string& msg)
+  bool is_msg_complete(const char* data,
+                       size_t length,
+                       bool& request,
+                       uint32_t& body_length,
+                       uint8_t& op_code);
+  template <class T> BaseMessage* from_wire_int(const MsgView& msg)
   {
     return new T(msg);
   }
@@ -0,0 +1,199 @@
+/**
+ * @file memcached_uring_event_loop.hpp - io_uring-based event loop for
+ * memcached connections.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MEMCACHED_URING_EVENT_LOOP_H__
+#define MEMCACHED_URING_EVENT_LOOP_H__
+
+#ifdef HAVE_IO_URING
+
+#include "memcached_event_loop.hpp"
+
+#include <linux/io_uring.h>
+
+namespace Memcached
+{
+  // Event loop that does the socket I/O for its connections through io_uring,
+  // rather than waiting for readiness and leaving the connections to make
+  // their own system calls.
+  //
+  // -  Each connection has a multishot receive outstanding, which fills
+  //    buffers from a ring of provided buffers shared by every connection.
+  //    The data is appended to the connection's receive buffer and the buffer
+  //    is handed straight back to the kernel.
+  // -  Output that handlers send is queued on the connection, and the loop
+  //    submits it once the handler returns.
+  // -  All of the work queued while handling one batch of completions is
+  //    submitted, and the next batch waited for, in a single system call.
+  //
+  // The loop talks to the kernel's io_uring interface directly, so doesn't
+  // need liburing.  It needs multishot receive and provided buffer rings
+  // (Linux 6.0 or later) - use `EventLoop::create` to fall back to epoll on
+  // kernels without them.
+  class UringEventLoop : public EventLoop
+  {
+  public:
+    UringEventLoop();
+    virtual ~UringEventLoop();
+
+    // Whether the running kernel supports everything this loop needs.
+    static bool is_supported();
+
+    virtual bool init();
+    virtual bool add(Connection* conn, Handler* handler);
+    virtual void remove(Connection* conn);
+    virtual void update(Connection* conn);
+    virtual int poll(int timeout_ms);
+    virtual void stop();
+
+    // The number of times the loop has entered the kernel.
+    uint64_t ring_enters() const { return _ring_enters; }
+
+  private:
+    // A submission and completion queue pair mapped from the kernel, plus an
+    // optional ring of provided receive buffers.
+    class Ring
+    {
+    public:
+      Ring();
+      ~Ring();
+
+      // Create the ring with room for `entries` submissions.  Returns 0 on
+      // success or a negative errno.
+      int init(unsigned entries);
+
+      // Tear the ring down, cancelling everything still outstanding on it.
+      void exit();
+
+      // Get a zeroed submission queue entry, or NULL if the queue is full.
+      struct io_uring_sqe* get_sqe();
+
+      // Submit the queued entries, and wait for at least `wait_nr`
+      // completions or until the timeout (if any) passes.  Returns the number
+      // submitted or a negative errno.
+      int submit_and_wait(unsigned wait_nr, const struct __kernel_timespec* ts);
+
+      // Get the next completion without consuming it, or NULL if there isn't
+      // one.  `advance` consumes completions once they have been handled.
+      struct io_uring_cqe* peek_cqe(unsigned index);
+      void advance(unsigned count);
+
+      // Whether the kernel supports the given operation.
+      bool op_supported(uint8_t op);
+
+      // Register a ring of `entries` provided buffers (a power of two) as
+      // buffer group `group`.  Buffers are then handed to the kernel with
+      // `add_buffer` and `commit_buffers`.  Returns 0 or a negative errno.
+      int register_buffers(unsigned entries, uint16_t group);
+      void add_buffer(char* addr, unsigned length, uint16_t bid, unsigned offset);
+      void commit_buffers(unsigned count);
+
+    private:
+      int _fd;
+      unsigned _features;
+
+      void* _sq_map;
+      size_t _sq_map_size;
+      void* _cq_map;
+      size_t _cq_map_size;
+      struct io_uring_sqe* _sqes;
+      size_t _sqes_size;
+
+      unsigned* _sq_head;
+      unsigned* _sq_tail;
+      unsigned _sq_mask;
+      unsigned _sq_entries;
+      unsigned _sq_local_tail;
+      unsigned _sq_submitted;
+
+      unsigned* _cq_head;
+      unsigned* _cq_tail;
+      unsigned _cq_mask;
+      struct io_uring_cqe* _cqes;
+
+      struct io_uring_buf_ring* _buf_ring;
+      size_t _buf_ring_size;
+      unsigned _buf_ring_mask;
+    };
+
+    struct Registration;
+
+    enum OpType { RECV, SEND, CONNECT, STOP };
+
+    // Identifies the operation that a completion is for.
+    struct Op
+    {
+      Registration* reg;
+      OpType type;
+    };
+
+    struct Registration
+    {
+      Connection* conn;
+      Handler* handler;
+      int fd;
+      bool removed;
+
+      Op recv_op;
+      Op send_op;
+      Op connect_op;
+      bool recv_armed;
+      bool send_in_flight;
+      bool connect_in_flight;
+
+      // The output currently being sent, and how much of it has been sent.
+      // This is owned by the loop rather than the connection so that it
+      // stays put while the kernel is sending it.
+      std::string sending;
+      size_t sent;
+    };
+
+    struct io_uring_sqe* get_sqe();
+    void arm_recv(Registration* reg);
+    void arm_connect(Registration* reg);
+    void arm_stop();
+    void cancel(Op* op);
+    void start_send(Registration* reg);
+    void submit_send(Registration* reg);
+
+    void handle_recv(Registration* reg, struct io_uring_cqe* cqe);
+    void handle_send(Registration* reg, struct io_uring_cqe* cqe);
+    void handle_connect(Registration* reg, struct io_uring_cqe* cqe);
+
+    // Start sending anything the handler queued on its connection.
+    void after_handler(Registration* reg);
+
+    static const unsigned RING_ENTRIES = 256;
+    static const unsigned NUM_BUFFERS = 256;
+    static const unsigned BUFFER_SIZE = 16 * 1024;
+    static const uint16_t BUFFER_GROUP = 0;
+    static const unsigned MAX_CQES = 64;
+
+    Ring _ring;
+    char* _buffers;
+
+    int _stop_fd;
+    uint64_t _stop_value;
+    Op _stop_op;
+
+    uint64_t _ring_enters;
+
+    std::map<Connection*, Registration*> _registrations;
+
+    // Registrations that have been removed but may still have operations in
+    // flight.  These are freed by `poll` once all their operations complete.
+    std::vector<Registration*> _removed;
+  };
+}
+
+#endif
+
+#endif
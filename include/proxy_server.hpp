@@ -14,6 +14,9 @@
 
 #include "memcached_backend.hpp"
 
+#include <string>
+#include <vector>
+
 class ProxyServer
 {
 public:
@@ -39,32 +42,67 @@ private:
   static void* connection_thread_entry_point(void* params);
   void connection_thread_fn(Memcached::ServerConnection* connection);
 
+  /// A GETQ/GETKQ request that is waiting to be fetched along with the rest
+  /// of the client's pipelined multi-get.
+  struct QuietGet
+  {
+    std::string key;
+    uint32_t opaque;
+    bool response_needs_key;
+  };
+  typedef std::vector<QuietGet> QuietGetList;
+
+  /// The most quiet GETs to collect before fetching them, even if the client
+  /// hasn't finished its multi-get.
+  static const size_t MAX_QUIET_GETS = 1000;
+
+  /// Handle a single message from the client, sending a response if
+  /// appropriate.
+  ///
+  /// @param msg        - The received message.
+  /// @param connection - The connection the message was received on and
+  ///                     should be used for sending a response.
+  /// @param quiet_gets - Quiet GETs received on this connection that have
+  ///                     not been handled yet.  These are handled before any
+  ///                     other request, so responses stay in order.
+  /// @return           - Whether the connection should be kept open.
+  bool handle_message(const Memcached::Message& msg,
+                      Memcached::ServerConnection* connection,
+                      QuietGetList& quiet_gets);
+
+  /// Fetch a batch of quiet GETs from the backend in one go, and send
+  /// responses for those that were found.
+  ///
+  /// @param quiet_gets - The requests to handle.  This is cleared once they
+  ///                     have been handled.
+  /// @param connection - The connection the requests were received on and
+  ///                     should be used for sending responses.
+  void handle_quiet_gets(QuietGetList& quiet_gets,
+                         Memcached::ServerConnection* connection);
+
   /// Handle a GET request from the client and send an appropriate response.
   ///
-  /// @param get_req    - The received request. This function does not take
-  ///                     ownership.
+  /// @param get_req    - The received request.
   /// @param connection - The connection the request was received one and
   ///                     should be used for sending a response.
-  void handle_get(Memcached::GetReq* get_req,
+  void handle_get(const Memcached::Message& get_req,
                   Memcached::ServerConnection* connection);
 
   /// Handle a SET/ADD/REPLACE request from the client and send an appropriate
   /// response.
   ///
-  /// @param sar_req    - The received request. This function does not take
-  ///                     ownership.
+  /// @param sar_req    - The received request.
   /// @param connection - The connection the request was received one and
   ///                     should be used for sending a response.
-  void handle_set_add_replace(Memcached::SetAddReplaceReq* sar_req,
+  void handle_set_add_replace(const Memcached::Message& sar_req,
                               Memcached::ServerConnection* connection);
 
   /// Handle a DELETE request from the client and send an appropriate response.
   ///
-  /// @param delete_req - The received request. This function does not take
-  ///                     ownership.
+  /// @param delete_req - The received request.
   /// @param connection - The connection the request was received one and
   ///                     should be used for sending a response.
-  void handle_delete(Memcached::DeleteReq* delete_req,
+  void handle_delete(const Memcached::Message& delete_req,
                      Memcached::ServerConnection* connection);
 
 
@@ -0,0 +1,77 @@
+/**
+ * @file resync_checkpoint.hpp - Records the progress of a resync on disk
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RESYNC_CHECKPOINT_H__
+#define RESYNC_CHECKPOINT_H__
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Records which vbuckets a resync has finished streaming from which source
+// replicas, so that if Astaire restarts part way through a resync it can pick
+// up where it left off rather than starting again.
+//
+// The checkpoint is a small text file.  It starts with an ID for the work the
+// resync is doing (so a checkpoint is ignored once the cluster view changes)
+// and a random ID for the resync itself, followed by a line for each
+// (vbucket, replica) pair that has been streamed, which is synced to disk as
+// each tap completes.
+//
+// A checkpoint is only any use if the local memcached still has the records
+// streamed so far, so Astaire also writes the resync ID to the local memcached
+// and only resumes if it is still there.
+class ResyncCheckpoint
+{
+public:
+  typedef std::map<uint16_t, std::vector<std::string>> WorkList;
+  typedef std::set<std::pair<uint16_t, std::string>> CompletedSet;
+
+  ResyncCheckpoint(const std::string& filename);
+  ~ResyncCheckpoint();
+
+  // Work out an ID for the work in the given worklist.
+  static std::string view_id(const WorkList& owl, bool full_resync);
+
+  // Generate a random ID.
+  static std::string generate_id();
+
+  // Read the checkpoint on disk.  Returns false if there isn't one for the
+  // given view, and otherwise returns the resync ID and the (vbucket, replica)
+  // pairs already streamed.
+  bool load(const std::string& view_id,
+            std::string& resync_id,
+            CompletedSet& completed);
+
+  // Carry on recording progress in the checkpoint that has just been loaded.
+  void resume();
+
+  // Replace the checkpoint with an empty one for the given view, and return
+  // the new resync ID.
+  std::string start(const std::string& view_id);
+
+  // Record that the given vbuckets have been streamed from a replica.
+  void record(const std::vector<uint16_t>& buckets, const std::string& server);
+
+  // Throw the checkpoint away.
+  void clear();
+
+private:
+  void close_file();
+
+  std::string _filename;
+  int _fd;
+};
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * @file resync_concurrency_controller.hpp - Adapts how hard Astaire resyncs
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RESYNC_CONCURRENCY_CONTROLLER_H__
+#define RESYNC_CONCURRENCY_CONTROLLER_H__
+
+#include "astaire_statistics.hpp"
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+// Adapts the number of requests the tap threads have in flight to the local
+// memcached to how well it is coping, as the node's own clients share it.
+//
+// The tap threads report how long each of their GETs, ADDs and REPLACEs took.
+// After every batch of reports the controller works out the 99th percentile
+// latency and adjusts a window - the total number of requests in flight across
+// all tap threads - using AIMD.  If the latency is over the target the window
+// is halved, and otherwise it grows by a few requests.
+//
+// The window is shared between the running taps to give each its pipeline
+// depth, and also limits how many taps may run at once, so that each tap
+// gets a worthwhile pipeline.
+class ResyncConcurrencyController
+{
+public:
+  // The window never drops below one request, or grows beyond
+  // `max_window`.
+  ResyncConcurrencyController(AstaireGlobalStatistics* global_stats,
+                              uint32_t target_latency_us,
+                              uint32_t initial_window,
+                              uint32_t max_window);
+  ~ResyncConcurrencyController();
+
+  // Record the latencies of some local requests, in microseconds.
+  void record_latencies(const std::vector<uint32_t>& latencies_us);
+
+  // Called by the tap threads as they start and finish.
+  void stream_started();
+  void stream_finished();
+
+  // How many requests each running tap may have in flight, which is at most
+  // `max_depth`.
+  uint32_t pipeline_depth(uint32_t max_depth) const;
+
+  // Whether another tap may start now.  A tap may always start if no others
+  // are running.
+  bool may_start_stream() const;
+
+  uint32_t window() const { return _window.load(); }
+
+private:
+  void adjust_window(uint32_t p99_latency_us);
+
+  AstaireGlobalStatistics* _global_stats;
+  uint32_t _target_latency_us;
+  uint32_t _max_window;
+
+  std::atomic_uint_fast32_t _window;
+  std::atomic_uint_fast32_t _streams;
+
+  // Protects the samples collected since the window was last adjusted.
+  pthread_mutex_t _lock;
+  std::vector<uint32_t> _samples;
+};
+
+#endif
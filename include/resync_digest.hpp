@@ -0,0 +1,67 @@
+/**
+ * @file resync_digest.hpp - Digests of the records in each vbucket
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RESYNC_DIGEST_H__
+#define RESYNC_DIGEST_H__
+
+#include <boost/utility/string_ref.hpp>
+#include <map>
+#include <stdint.h>
+
+// Digests of the records one node holds in each vbucket, so that Astaire can
+// tell whether the local node already has exactly the records a replica has
+// without streaming them.
+//
+// Each vbucket's digest is a small tree.  The records are split into a fixed
+// number of key ranges (by a hash of the key), and each range's digest
+// combines a hash of the key and timestamp (the flags) of every record in it.
+// The hashes are summed, so the digest doesn't depend on the order the
+// records are streamed in.  Records are compared by timestamp when they are
+// resynced, so two nodes with the same keys and timestamps in a vbucket have
+// nothing to resync between them, even if the values differ.
+class ResyncDigest
+{
+public:
+  // The number of key ranges in each vbucket's digest.
+  static const size_t RANGES = 16;
+
+  ResyncDigest() : _trees() {}
+
+  // Add a record to the digest of its vbucket.
+  void add(uint16_t vbucket, boost::string_ref key, uint32_t flags);
+
+  // Whether any records have been added for the vbucket.
+  bool empty(uint16_t vbucket) const;
+
+  // Compare a vbucket's digest with another node's.  Returns the number of
+  // key ranges that differ, so 0 if the nodes have the same records.
+  size_t compare(uint16_t vbucket, const ResyncDigest& other) const;
+
+private:
+  struct Tree
+  {
+    Tree() : records(0), root(0)
+    {
+      for (size_t ii = 0; ii < RANGES; ++ii)
+      {
+        ranges[ii] = 0;
+      }
+    }
+
+    uint64_t records;
+    uint64_t root;
+    uint64_t ranges[RANGES];
+  };
+
+  std::map<uint16_t, Tree> _trees;
+};
+
+#endif
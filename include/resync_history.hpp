@@ -0,0 +1,59 @@
+/**
+ * @file resync_history.hpp - Records when vbuckets were last resynced
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RESYNC_HISTORY_H__
+#define RESYNC_HISTORY_H__
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Records when each vbucket was last fully streamed from each replica, so
+// that a later resync can ask the replica for just the records that have
+// changed since (a TAP backfill) rather than for all of them.
+//
+// The history is only valid for as long as the local memcached still has the
+// records it describes.  It is stored in a small text file along with the ID
+// of the local memcached's data (which Astaire keeps in the local memcached,
+// so it is lost if the local memcached restarts), and is discarded if that
+// ID changes.
+class ResyncHistory
+{
+public:
+  ResyncHistory(const std::string& filename);
+  ~ResyncHistory();
+
+  // Read the history from disk, discarding it if it isn't for the given data
+  // ID, and rewrite the file without any out of date entries.  If the data ID
+  // is empty the history is discarded and nothing more is recorded.
+  void load(const std::string& data_id);
+
+  // When the given vbucket was last fully streamed from the given replica, in
+  // seconds since the epoch, or 0 if it never has been.
+  uint64_t last_synced(uint16_t vbucket, const std::string& server) const;
+
+  // Record that the given vbuckets have been fully streamed from a replica,
+  // by a tap that started at `time`.
+  void record(const std::vector<uint16_t>& buckets,
+              const std::string& server,
+              uint64_t time);
+
+private:
+  void close_file();
+
+  std::string _filename;
+  int _fd;
+  std::map<std::pair<uint16_t, std::string>, uint64_t> _last_synced;
+};
+
+#endif
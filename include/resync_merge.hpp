@@ -0,0 +1,124 @@
+/**
+ * @file resync_merge.hpp - Merges the records streamed from several replicas
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RESYNC_MERGE_H__
+#define RESYNC_MERGE_H__
+
+#include "memcached_tap_client.hpp"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Merges the records streamed for some vbuckets by taps of all their replicas
+// at once, keeping only the newest copy of each record (judged by the
+// timestamp in its flags), so that the local node is written to once per
+// record with the newest copy.  Each tap has the rank of its replica in the
+// vbuckets' replica list, and where copies have the same timestamp the one
+// from the lowest rank (the primary, if it has a copy) wins.
+//
+// The taps offer their records as they arrive.  Once every tap has finished,
+// the last one to do so takes the surviving records and writes them to the
+// local node.  To bound the memory used, a tap that fills the table writes
+// out what it holds so far.  Those records may later be superseded by newer
+// copies from another replica, but the records are written using the usual
+// comparison with the local copy, so the newest copy still wins.  That
+// comparison keeps the local copy on a tie though, so a record is only
+// written early if it came from the lowest ranked tap still running (or a
+// lower rank), as no tap can then offer a tied copy that should beat it.
+// Records from higher ranks are held until the taps ranked above them have
+// finished, and taps of those higher ranks wait for room while the table is
+// full of them.  The taps are queued in rank order, so the lowest ranked tap
+// still running never waits.  Writes are serialized, so two copies of a
+// record are never being written at once.
+class ResyncMerge
+{
+public:
+  typedef std::vector<std::pair<Memcached::Message*, uint16_t>> RecordList;
+
+  ResyncMerge(const std::vector<uint16_t>& buckets, int taps, size_t max_bytes);
+  ~ResyncMerge();
+
+  const std::vector<uint16_t>& buckets() const { return _buckets; }
+
+  // Offer a detached TAP_MUTATE, for the given vbucket, from the tap of rank
+  // `rank` to the merge.  This takes ownership of the message, and returns
+  // whichever of it and any copy of the record already held has lost (or
+  // NULL if there wasn't one), which the caller must release.
+  Memcached::Message* offer(Memcached::Message* mutate,
+                            uint16_t vbucket,
+                            int rank);
+
+  // Whether the records that can be written out now have reached the size
+  // limit, and should be written out.
+  bool full();
+
+  // Wait, as the tap of rank `rank`, while the table is full of records that
+  // can't be written out until a lower ranked tap has finished.
+  void wait_for_room(int rank);
+
+  // Take every record held that can be written out now, to write to the
+  // local node.  This waits for any other write to finish, and `end_write`
+  // must be called once the records have been written (or have failed to
+  // be).
+  void start_write(RecordList& records);
+  void end_write(bool success);
+
+  // Called by each tap when it finishes, giving its rank.  Returns true for
+  // the last of them, which must then write out the records.
+  bool tap_finished(int rank);
+
+  // Whether every write so far has succeeded.
+  bool write_succeeded();
+
+  // Used by the control thread to track the taps it is still waiting for, and
+  // the (replica, tap start time) pairs that have been successfully streamed.
+  int taps_outstanding;
+  std::vector<std::pair<std::string, uint64_t>> sources;
+
+private:
+  struct Record
+  {
+    Memcached::Message* mutate;
+    uint16_t vbucket;
+    int rank;
+  };
+
+  size_t writable_bytes() const;
+
+  std::vector<uint16_t> _buckets;
+  size_t _max_bytes;
+
+  // Protects the records held and the state of the taps.
+  pthread_mutex_t _lock;
+  std::unordered_map<std::string, Record> _records;
+  size_t _bytes;
+
+  // The bytes of the records held from each rank's tap, whether each tap
+  // has finished, and the lowest rank whose tap hasn't.  Records from that
+  // rank or below can be written out.
+  std::vector<size_t> _rank_bytes;
+  std::vector<bool> _finished;
+  int _taps_running;
+  int _lowest_running;
+
+  // Signalled when records are taken to be written, or a tap finishes.
+  pthread_cond_t _room_cv;
+
+  // Held while records are being written to the local node.
+  pthread_mutex_t _write_lock;
+  bool _write_succeeded;
+};
+
+#endif
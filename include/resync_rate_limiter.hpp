@@ -0,0 +1,90 @@
+/**
+ * @file resync_rate_limiter.hpp - Limits the rate at which Astaire resyncs
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RESYNC_RATE_LIMITER_H__
+#define RESYNC_RATE_LIMITER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+// Limits the rate at which the tap threads apply records, so that resyncing
+// doesn't take too much CPU or network from the rest of the node.
+//
+// There are two limits, each enforced with a token bucket shared by all the
+// tap threads:
+//
+// -  Keys per second.  This is worked out from the share of the node's CPU
+//    Astaire may use (`astaire_cpu_limit_percentage`) and the CPU time the
+//    tap threads have recently been taking per key.
+// -  Bytes per second (`astaire_bandwidth_limit_mbps`), counting the whole of
+//    each TAP_MUTATE.
+//
+// The limits are read from the Clearwater config file, and are re-read when
+// `reload_config` is called (on SIGHUP).
+class ResyncRateLimiter
+{
+public:
+  ResyncRateLimiter(const std::string& config_file);
+  ~ResyncRateLimiter();
+
+  // Re-read the limits from the config file.
+  void reload_config();
+
+  // Set the limits directly.  A CPU percentage of 0 (or 100 or more), or a
+  // bandwidth of 0, means no limit.
+  void set_limits(int cpu_limit_percentage, uint64_t bandwidth_limit_bps);
+
+  // Called by a tap thread after it has handled some records, with the CPU
+  // time it took to do so.  This takes the records from the token buckets,
+  // and blocks until the thread may carry on.
+  void throttle(uint64_t keys, uint64_t bytes, uint64_t cpu_ns);
+
+private:
+  class TokenBucket
+  {
+  public:
+    TokenBucket() : _rate(0), _tokens(0) {}
+
+    // Set the rate at which tokens are added, per second.  0 means there is
+    // no limit.
+    void set_rate(double rate);
+    void refill(double seconds);
+    void consume(double tokens);
+
+    // How long until the bucket is out of debt.
+    double wait_seconds() const;
+
+  private:
+    double _rate;
+    double _tokens;
+  };
+
+  static uint64_t monotonic_ns();
+  void update_key_rate();
+
+  std::string _config_file;
+
+  // Protects everything below.
+  pthread_mutex_t _lock;
+
+  int _cpu_limit_percentage;
+  int _num_cpus;
+
+  // Exponentially weighted moving average of the CPU time taken per key.
+  double _cpu_ns_per_key;
+
+  TokenBucket _keys;
+  TokenBucket _bytes;
+  uint64_t _last_refill_ns;
+};
+
+#endif
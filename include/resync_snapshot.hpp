@@ -0,0 +1,97 @@
+/**
+ * @file resync_snapshot.hpp - A copy on disk of the local memcached's records
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RESYNC_SNAPSHOT_H__
+#define RESYNC_SNAPSHOT_H__
+
+#include <boost/utility/string_ref.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// A snapshot of the records in some vbuckets of the local memcached, so that
+// if the local memcached restarts Astaire can reload the records from disk
+// and only needs the records that have changed since from the other replicas.
+//
+// The snapshot is a binary file, written by appending each record in turn.
+// It starts with a header giving the time the snapshot was started and the
+// vbuckets it covers, followed by each record (its vbucket, flags, expiry,
+// key and value) and an end marker.  A new snapshot is written alongside the
+// old one and renamed over it once complete, so there is always a whole
+// snapshot on disk.  To reload it, the file is mapped into memory and the
+// records are read straight out of the mapping.
+class ResyncSnapshot
+{
+public:
+  struct Record
+  {
+    uint16_t vbucket;
+    uint32_t flags;
+
+    // Stored as given, so should be absolute (or 0 for none), as a relative
+    // expiry would be wrong by the time the snapshot is reloaded.
+    uint32_t expiry;
+    boost::string_ref key;
+    boost::string_ref value;
+  };
+
+  ResyncSnapshot(const std::string& filename);
+  ~ResyncSnapshot();
+
+  // Start writing a new snapshot of the given vbuckets, taken at `time` (in
+  // seconds since the epoch).  The records are then passed to `add`, and the
+  // snapshot replaces the one on disk when `commit` is called.  `abort`
+  // throws it away instead.
+  bool start(uint64_t time, const std::vector<uint16_t>& buckets);
+  bool add(const Record& record);
+  bool commit();
+  void abort();
+
+  // Map the snapshot on disk into memory, ready to read its records with
+  // `next`.  Returns false if there isn't a valid snapshot.
+  bool open();
+
+  // Read the next record.  The key and value point into the mapping, so are
+  // only valid until the snapshot is closed.  Returns false once there are no
+  // more records.
+  bool next(Record& record);
+
+  // Whether `next` got all the way to the end of the snapshot (rather than
+  // stopping at a corrupt record).
+  bool complete() const { return _complete; }
+
+  void close();
+
+  // The time the open snapshot was taken, and the vbuckets it covers.
+  uint64_t time() const { return _time; }
+  const std::vector<uint16_t>& buckets() const { return _buckets; }
+
+private:
+  bool flush();
+
+  std::string _filename;
+
+  // The snapshot being written, and the records not yet written to it.
+  int _fd;
+  std::string _buffer;
+  uint64_t _records;
+
+  // The snapshot being read, and how far through it we are.
+  const char* _map;
+  size_t _map_size;
+  size_t _offset;
+  bool _complete;
+
+  uint64_t _time;
+  std::vector<uint16_t> _buckets;
+};
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * @file vbucket_hash.hpp - Hashing of keys onto vbuckets
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef VBUCKET_HASH_H__
+#define VBUCKET_HASH_H__
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+// Keys are assigned to vbuckets using libmemcached's MD5 hash (the first four
+// bytes of the key's MD5 digest, read as a little-endian integer), masked down
+// to the number of vbuckets.  These functions produce exactly the same hashes
+// as memcached_generate_hash_value(..., MEMCACHED_HASH_MD5), so every node and
+// every client agrees on where a key lives.
+//
+// Where a number of keys are available at once (such as the messages from a
+// single read of a TAP stream, or a multi-get) the batch functions hash them
+// together, computing several MD5 digests in parallel in the lanes of a SIMD
+// register.
+namespace VBucketHash
+{
+  // The ways of hashing a batch of keys.  AVX2 and SSE2 hash 8 and 4 keys at
+  // a time respectively, and are only available on x86-64 (and AVX2 only on
+  // CPUs that support it).
+  enum struct Implementation
+  {
+    SCALAR,
+    SSE2,
+    AVX2
+  };
+
+  // The fastest implementation the running CPU supports.  This is what the
+  // batch functions use unless told otherwise.
+  Implementation best_implementation();
+
+  // Whether the running CPU supports the given implementation.
+  bool is_supported(Implementation impl);
+
+  const char* implementation_name(Implementation impl);
+
+  // Hash a single key.
+  uint32_t hash(const char* key, size_t length);
+  inline uint32_t hash(const std::string& key)
+  {
+    return hash(key.data(), key.length());
+  }
+
+  // Hash `count` keys, writing the hash of each to the corresponding entry of
+  // `hashes`.
+  void hash_batch(const boost::string_ref* keys,
+                  size_t count,
+                  uint32_t* hashes);
+  void hash_batch(const boost::string_ref* keys,
+                  size_t count,
+                  uint32_t* hashes,
+                  Implementation impl);
+
+  // Convert a hash to a vbucket.  The number of vbuckets must be a power of
+  // two.
+  inline int vbucket_for_hash(uint32_t hash, int num_vbuckets)
+  {
+    return hash & (num_vbuckets - 1);
+  }
+
+  inline int vbucket_for_key(const std::string& key, int num_vbuckets)
+  {
+    return vbucket_for_hash(hash(key), num_vbuckets);
+  }
+
+  // Work out the vbucket for each of a set of keys.
+  void vbuckets_for_keys(const std::vector<std::string>& keys,
+                         int num_vbuckets,
+                         std::vector<int>& vbuckets);
+}
+
+#endif
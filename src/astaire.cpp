@@ -12,13 +12,77 @@
 #include "memcached_tap_client.hpp"
 #include "astaire.hpp"
 #include "astaire_pd_definitions.hpp"
+#include "vbucket_hash.hpp"
 #include <algorithm>
+#include <cmath>
 #include <set>
 
 const std::string ASTAIRE_KEY_PREFIX = "astaire\\\\";
 const std::string ASTAIRE_TAG_KEY = ASTAIRE_KEY_PREFIX + "tag";
 const std::string ASTAIRE_TAG_VALUE = "{}";
 
+// The record in the local memcached holding the ID of the resync in progress,
+// which tells a restarted Astaire whether the local memcached still has the
+// records streamed so far.
+const std::string ASTAIRE_RESYNC_MARKER_KEY = ASTAIRE_KEY_PREFIX + "resync";
+
+// The record in the local memcached holding the ID of its data, which tells
+// Astaire whether the resync history still describes the local memcached.
+const std::string ASTAIRE_DATA_MARKER_KEY = ASTAIRE_KEY_PREFIX + "data";
+
+// How far before the start of the last tap of a vbucket to backfill from, to
+// allow for the clocks on different nodes not quite matching.
+const uint64_t BACKFILL_MARGIN_S = 60;
+
+// The most TAP_MUTATE bytes a merge of several replicas' taps holds before
+// writing them to the local memcached.
+const size_t MAX_MERGE_BYTES = 64 * 1024 * 1024;
+
+// Memcached treats expiry times longer than this as absolute times (in
+// seconds since the epoch) rather than relative ones.
+const uint32_t MEMCACHED_MAX_RELATIVE_EXPIRY = 60 * 60 * 24 * 30;
+
+// How much weight each new measurement of a server's throughput gets.
+const double THROUGHPUT_SMOOTHING = 0.5;
+
+// The most TAP_MUTATEs each tap thread has in flight to the local memcached,
+// and the most value bytes they can hold between them.  The byte limit stops
+// the GET responses for large records filling the socket buffers while the
+// thread is still sending requests.  The concurrency controller (if there is
+// one) may allow fewer mutates than this.
+const size_t MAX_PIPELINED_MUTATES = 64;
+const size_t MAX_PIPELINED_BYTES = 256 * 1024;
+
+// The CPU time used by the calling thread, in nanoseconds.
+static uint64_t thread_cpu_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The current time, in microseconds, from the monotonic clock.
+static uint64_t monotonic_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The current time, in milliseconds, from the monotonic clock.
+static uint64_t monotonic_ms()
+{
+  return monotonic_us() / 1000;
+}
+
+// How many request latencies each tap thread collects before passing them to
+// the concurrency controller.
+const size_t LATENCY_REPORT_BATCH = 64;
+
+// How often tap workers that are waiting for the concurrency controller to
+// allow another tap check whether it has.
+const long TAP_WORKER_RECHECK_NS = 100 * 1000 * 1000;
+
 // Utility function to search a vector.
 template<class T>
 inline bool is_in_vector(const std::vector<T>& vec, const T& item)
@@ -26,6 +90,53 @@ inline bool is_in_vector(const std::vector<T>& vec, const T& item)
   return (!(std::find(vec.begin(), vec.end(), item) == vec.end()));
 }
 
+// Writes the records tapped from the local memcached to a snapshot taken at
+// `time`.  Relative expiries are made absolute, as the snapshot may be
+// reloaded long after it was taken.
+class SnapshotRecordHandler : public Astaire::RecordHandler
+{
+public:
+  SnapshotRecordHandler(ResyncSnapshot* snapshot, uint64_t time) :
+    _snapshot(snapshot),
+    _time(time)
+  {}
+
+  bool record(const Memcached::Message& mutate, uint16_t vbucket)
+  {
+    ResyncSnapshot::Record record;
+    record.vbucket = vbucket;
+    record.flags = mutate.flags();
+    record.expiry = mutate.expiry();
+    if ((record.expiry != 0) && (record.expiry <= MEMCACHED_MAX_RELATIVE_EXPIRY))
+    {
+      record.expiry += _time;
+    }
+    record.key = mutate.key();
+    record.value = mutate.value();
+    return _snapshot->add(record);
+  }
+
+private:
+  ResyncSnapshot* _snapshot;
+  uint64_t _time;
+};
+
+// Adds the records tapped from a server to a digest.
+class DigestRecordHandler : public Astaire::RecordHandler
+{
+public:
+  DigestRecordHandler(ResyncDigest& digest) : _digest(digest) {}
+
+  bool record(const Memcached::Message& mutate, uint16_t vbucket)
+  {
+    _digest.add(vbucket, mutate.key(), mutate.flags());
+    return true;
+  }
+
+private:
+  ResyncDigest& _digest;
+};
+
 /*****************************************************************************/
 /* Public functions                                                          */
 /*****************************************************************************/
@@ -35,7 +146,18 @@ Astaire::Astaire(MemcachedStoreView* view,
                  Alarm* alarm,
                  AstaireGlobalStatistics* global_stats,
                  AstairePerConnectionStatistics* per_conn_stats,
-                 std::string self) :
+                 ResyncRateLimiter* rate_limiter,
+                 std::string self,
+                 int tap_fanout,
+                 int tap_workers,
+                 int target_latency_us,
+                 const std::string& checkpoint_file,
+                 const std::string& history_file,
+                 bool merge_replicas,
+                 const std::string& snapshot_file,
+                 int snapshot_interval_s,
+                 bool anti_entropy,
+                 int anti_entropy_interval_s) :
   _terminated(false),
   _view_updated(false),
   _view(view),
@@ -44,15 +166,67 @@ Astaire::Astaire(MemcachedStoreView* view,
   _alarm(alarm),
   _global_stats(global_stats),
   _per_conn_stats(per_conn_stats),
-  _self(self)
+  _rate_limiter(rate_limiter),
+  _concurrency_controller(NULL),
+  _checkpoint(checkpoint_file.empty() ? NULL : new ResyncCheckpoint(checkpoint_file)),
+  _history(history_file.empty() ? NULL : new ResyncHistory(history_file)),
+  _snapshot(snapshot_file.empty() ? NULL : new ResyncSnapshot(snapshot_file)),
+  _snapshot_interval_ms((uint64_t)std::max(snapshot_interval_s, 1) * 1000),
+  _next_snapshot_ms(0),
+  _anti_entropy(anti_entropy),
+  _anti_entropy_interval_ms((uint64_t)std::max(anti_entropy_interval_s, 0) * 1000),
+  _next_anti_entropy_ms(monotonic_ms() + _anti_entropy_interval_ms),
+  _self(self),
+  _tap_fanout(std::max(tap_fanout, 1)),
+  _merge_replicas(merge_replicas),
+  // The most connections to the local memcached to keep open when they're
+  // not in use is one for the control thread, plus one for each tap worker.
+  _local_conn_pool(new Memcached::ClientConnectionPool(self,
+                                                       std::max(tap_workers, 1) + 1))
 {
   pthread_mutex_init(&_lock, NULL);
+  pthread_mutex_init(&_tap_lock, NULL);
+  pthread_cond_init(&_tap_cv, NULL);
+  pthread_cond_init(&_tap_worker_cv, NULL);
   pthread_condattr_t cond_attr;
   pthread_condattr_init(&cond_attr);
   pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
   pthread_cond_init(&_cv, &cond_attr);
   pthread_condattr_destroy(&cond_attr);
 
+  if (target_latency_us > 0)
+  {
+    // Start off with each tap able to fill its pipeline, and only grow the
+    // window to the point where every worker can.
+    _concurrency_controller =
+      new ResyncConcurrencyController(global_stats,
+                                      target_latency_us,
+                                      MAX_PIPELINED_MUTATES,
+                                      std::max(tap_workers, 1) * MAX_PIPELINED_MUTATES);
+  }
+
+  // Start the tap workers before the controller thread, as it might start a
+  // resync straight away.
+  _tap_workers_terminated = false;
+  for (int ii = 0; ii < std::max(tap_workers, 1); ++ii)
+  {
+    pthread_t handle;
+    int rc = pthread_create(&handle, NULL, tap_worker_thread_fn, this);
+    if (rc != 0)
+    {
+      TRC_ERROR("Failed to create tap worker thread (%d)", rc);
+      break;
+    }
+    _tap_worker_hdls.push_back(handle);
+  }
+
+  if (_tap_worker_hdls.empty())
+  {
+    // Without any workers no resync can ever complete.
+    TRC_ERROR("No tap worker threads, exiting");
+    exit(2);
+  }
+
   // Start the controller thread.
   pthread_create(&_control_thread_hdl, NULL, control_thread_fn, this);
 
@@ -83,8 +257,31 @@ Astaire::~Astaire()
   // Now wait for the controller to exit.
   pthread_join(_control_thread_hdl, NULL);
 
+  // The controller waits for all its taps to finish, so the workers are idle
+  // and can be stopped.
+  pthread_mutex_lock(&_tap_lock);
+  _tap_workers_terminated = true;
+  pthread_cond_broadcast(&_tap_worker_cv);
+  pthread_mutex_unlock(&_tap_lock);
+
+  for (std::vector<pthread_t>::iterator it = _tap_worker_hdls.begin();
+       it != _tap_worker_hdls.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  delete _local_conn_pool; _local_conn_pool = NULL;
+  delete _concurrency_controller; _concurrency_controller = NULL;
+  delete _checkpoint; _checkpoint = NULL;
+  delete _history; _history = NULL;
+  delete _snapshot; _snapshot = NULL;
+
   pthread_cond_destroy(&_cv);
   pthread_mutex_destroy(&_lock);
+  pthread_cond_destroy(&_tap_worker_cv);
+  pthread_cond_destroy(&_tap_cv);
+  pthread_mutex_destroy(&_tap_lock);
 }
 
 void Astaire::reload_config()
@@ -148,6 +345,14 @@ void Astaire::control_thread()
       // Mark the local memcached as out-of-date. This means if we crash during
       // the resync we will restart it when we come back.
       untag_local_memcached();
+
+      // The user wants everything resynced again, so forget what earlier
+      // resyncs (and any snapshot reload) have done.
+      if (_checkpoint != NULL)
+      {
+        _checkpoint->clear();
+      }
+      _restored_buckets.clear();
     }
 
     PollResult res = poll_local_memcached();
@@ -156,6 +361,23 @@ void Astaire::control_thread()
       TRC_DEBUG("Local memcached is not up-to-date - full resync required");
       resync = true;
       full_resync = true;
+
+      // If the local memcached has lost its data (rather than just its tag),
+      // reload what it had from the snapshot.
+      std::string data_id;
+      if ((_snapshot != NULL) &&
+          (!read_local_marker(ASTAIRE_DATA_MARKER_KEY, data_id)))
+      {
+        restore_snapshot();
+
+        // Deal with anything that arrived while the snapshot was reloaded
+        // first.  The local memcached is still marked as out-of-date, so the
+        // full resync follows.
+        if (trigger_pending())
+        {
+          continue;
+        }
+      }
     }
 
     if (resync)
@@ -167,24 +389,62 @@ void Astaire::control_thread()
       // some vbuckets are down which means the bucket's data has been lost and
       // there is no point in trying to resync it again.
       tag_local_memcached();
+
+      // Snapshot the newly resynced data as soon as we're idle.
+      _next_snapshot_ms = 0;
     }
     else
     {
       // Explicitly clear the resync alarm, in case it is still in unknown state.
       _alarm->clear();
+
+      // Refresh the snapshot if it's due.  This must only be done while the
+      // local memcached is up-to-date, as reloading the snapshot relies on it
+      // having been.
+      if ((_snapshot != NULL) &&
+          (res == UP_TO_DATE) &&
+          (monotonic_ms() >= _next_snapshot_ms))
+      {
+        take_snapshot();
+        _next_snapshot_ms = monotonic_ms() + _snapshot_interval_ms;
+      }
+
+      // Check for the local node having silently diverged from the other
+      // replicas if that's due.
+      if ((_anti_entropy_interval_ms > 0) &&
+          (res == UP_TO_DATE) &&
+          (!trigger_pending()) &&
+          (monotonic_ms() >= _next_anti_entropy_ms))
+      {
+        check_for_divergence();
+        _next_anti_entropy_ms = monotonic_ms() + _anti_entropy_interval_ms;
+      }
+
       // Wait 10s for the next resync trigger. If we don't get one in that time
-      // we wake up and poll memcached again.
-      TRC_DEBUG("Wait for resync trigger");
-      struct timespec ts;
-      clock_gettime(CLOCK_MONOTONIC, &ts);
-      ts.tv_sec += 10;
-      pthread_cond_timedwait(&_cv, &_lock, &ts);
+      // we wake up and poll memcached again.  The snapshot and the divergence
+      // check release the lock, so a trigger may have arrived while they ran,
+      // in which case there's no need to wait.
+      if (!trigger_pending())
+      {
+        TRC_DEBUG("Wait for resync trigger");
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += 10;
+        pthread_cond_timedwait(&_cv, &_lock, &ts);
+      }
     }
   }
 
   pthread_mutex_unlock(&_lock);
 }
 
+// Whether the control thread has been asked to resync, or to terminate, since
+// it last checked.  Must be called with `_lock` held.
+bool Astaire::trigger_pending() const
+{
+  return (_view_updated) || (_full_resync_requested) || (_terminated);
+}
+
 /*****************************************************************************/
 /* Static functions                                                          */
 /*****************************************************************************/
@@ -196,6 +456,73 @@ void* Astaire::control_thread_fn(void* data)
   return NULL;
 }
 
+void* Astaire::tap_worker_thread_fn(void* data)
+{
+  ((Astaire*)data)->tap_worker_thread();
+  return NULL;
+}
+
+// Each tap worker runs queued taps one after another, handing each back to
+// the control thread when it has finished, until Astaire is destroyed.  If
+// the concurrency controller doesn't currently allow another tap, queued taps
+// wait for one to finish or for the controller's window to grow.
+void Astaire::tap_worker_thread()
+{
+  pthread_mutex_lock(&_tap_lock);
+  while (!_tap_workers_terminated)
+  {
+    if (_pending_taps.empty())
+    {
+      pthread_cond_wait(&_tap_worker_cv, &_tap_lock);
+      continue;
+    }
+
+    if ((_concurrency_controller != NULL) &&
+        (!_concurrency_controller->may_start_stream()))
+    {
+      struct timespec recheck;
+      clock_gettime(CLOCK_REALTIME, &recheck);
+      recheck.tv_nsec += TAP_WORKER_RECHECK_NS;
+      if (recheck.tv_nsec >= 1000 * 1000 * 1000)
+      {
+        recheck.tv_sec += 1;
+        recheck.tv_nsec -= 1000 * 1000 * 1000;
+      }
+      pthread_cond_timedwait(&_tap_worker_cv, &_tap_lock, &recheck);
+      continue;
+    }
+
+    TapJob* job = _pending_taps.front();
+    _pending_taps.pop_front();
+    if (_concurrency_controller != NULL)
+    {
+      _concurrency_controller->stream_started();
+    }
+    pthread_mutex_unlock(&_tap_lock);
+
+    job->start_time_ms = monotonic_ms();
+    tap_buckets_thread(job->thread_data);
+
+    // The last tap feeding a merge writes out the merged records.
+    ResyncMerge* merge = job->thread_data->merge;
+    if ((merge != NULL) && (merge->tap_finished(job->thread_data->merge_rank)))
+    {
+      write_merged_records(job->thread_data);
+    }
+
+    pthread_mutex_lock(&_tap_lock);
+    if (_concurrency_controller != NULL)
+    {
+      // Another tap may now be able to start.
+      _concurrency_controller->stream_finished();
+      pthread_cond_broadcast(&_tap_worker_cv);
+    }
+    _completed_taps.push_back(job);
+    pthread_cond_signal(&_tap_cv);
+  }
+  pthread_mutex_unlock(&_tap_lock);
+}
+
 // This thread simply performs the TAP specified in the passed object and
 // updates the success flag appropriately.
 void* Astaire::tap_buckets_thread(void *data)
@@ -211,37 +538,49 @@ void* Astaire::tap_buckets_thread(void *data)
   Astaire::TapBucketsThreadData* tap_data =
     (Astaire::TapBucketsThreadData*)data;
 
-  Memcached::ClientConnection local_conn(tap_data->local_server);
-  int rc = local_conn.connect();
-  if (rc != 0)
+  Memcached::ClientConnection* local_conn = tap_data->local_conn_pool->get();
+  if (local_conn == NULL)
   {
-    TRC_ERROR("Failed to connect to local server %s, error was (%d)",
-              tap_data->local_server.c_str(),
-              rc);
+    TRC_ERROR("Failed to connect to local server %s",
+              tap_data->local_server.c_str());
     return data;
   }
 
   Memcached::ClientConnection tap_conn(tap_data->tap_server);
-  rc = tap_conn.connect();
+  int rc = tap_conn.connect();
   if (rc != 0)
   {
     TRC_ERROR("Failed to connect to remote server %s, error was (%d)",
               tap_data->tap_server.c_str(),
               rc);
+    tap_data->local_conn_pool->put(local_conn);
     return data;
   }
 
   // Assume we're going to succeed if we've got this far.
   tap_data->success = true;
 
-  Memcached::TapConnectReq tap(tap_data->buckets);
+  // Note when the tap started, which is as up to date as the local node will
+  // be with these vbuckets if it succeeds.
+  tap_data->start_time = time(NULL);
+  Memcached::TapConnectReq tap(tap_data->buckets, tap_data->backfill_date);
   tap_conn.send(tap);
 
+  MutateApplier applier(tap_data, &tap_conn, local_conn);
+  std::vector<Memcached::Message*> msgs;
+  std::vector<boost::string_ref> keys;
+  std::vector<uint32_t> hashes;
+  uint64_t cpu_ns = thread_cpu_ns();
   bool finished = false;
   do
   {
-    Memcached::BaseMessage* msg = NULL;
-    Memcached::Status status = tap_conn.recv(&msg);
+    // Handle the local responses that have already arrived before waiting on
+    // the tap, so that the latencies measured for them don't include the
+    // wait.
+    applier.poll();
+
+    // Pick up every message the tap has sent us so far.
+    Memcached::Status status = tap_conn.recv_batch(msgs);
     if (status == Memcached::Status::ERROR)
     {
       TRC_ERROR("Error while tapping %s", tap_data->tap_server.c_str());
@@ -253,179 +592,125 @@ void* Astaire::tap_buckets_thread(void *data)
       TRC_INFO("Tap of %s completed", tap_data->tap_server.c_str());
       finished = true;
     }
-    else if (msg->is_response())
+
+    // Work out the vbuckets for the whole batch of mutates at once.  This can
+    // be removed once memcached returns vbuckets on TAP_MUTATE requests.
+    keys.clear();
+    for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+         it != msgs.end();
+         ++it)
     {
-      Memcached::BaseRsp* rsp = (Memcached::BaseRsp*)msg;
-      if (rsp->op_code() == (uint8_t)Memcached::OpCode::TAP_CONNECT)
-      {
-        // TAP_CONNECT should not be replied to, if it has, it is to
-        // say that the message was not understood.
-        TRC_ERROR("Cannot tap %s as the TAP protocol was not supported",
-                  tap_data->tap_server.c_str());
-        tap_data->success = false;
-        finished = true;
-      }
-      else
-      {
-        TRC_ERROR("Unexpected response from %s of type %d to TAP_MUTATE request",
-                  tap_data->tap_server.c_str(),
-                  rsp->op_code());
-        tap_data->success = false;
-        finished = true;
-      }
+      keys.push_back((*it)->key());
     }
-    else
+    hashes.resize(keys.size());
+    VBucketHash::hash_batch(keys.data(), keys.size(), hashes.data());
+
+    uint64_t batch_keys = 0;
+    uint64_t batch_bytes = 0;
+    for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+         (!finished) && (it != msgs.end());
+         ++it)
     {
-      Memcached::BaseReq* req = (Memcached::BaseReq*)msg;
+      Memcached::Message* msg = *it;
 
-      if (req->op_code() == (uint8_t)Memcached::OpCode::TAP_MUTATE)
+      if (msg->is_response())
       {
-        Memcached::TapMutateReq* mutate = (Memcached::TapMutateReq*)req;
-
-        // Ths can be removed once memcached returns vbuckets on
-        // TAP_MUTATE requests
-        uint16_t vbucket = vbucket_for_key(mutate->key());
-        TRC_DEBUG("Received TAP_MUTATE for key %s from bucket %d",
-                  mutate->key().c_str(),
-                  vbucket);
-
-        std::vector<uint16_t>::iterator iter =
-          std::find(tap_data->buckets.begin(),
-                    tap_data->buckets.end(),
-                    vbucket);
-        if (iter == tap_data->buckets.end())
-        {
-          TRC_DEBUG("Disarding TAP_MUTATE for incorrect vBucket");
-        }
-        else if (mutate->key().find(ASTAIRE_KEY_PREFIX) == 0)
+        if (msg->op_code() == (uint8_t)Memcached::OpCode::TAP_CONNECT)
         {
-          TRC_DEBUG("Disarding TAP_MUTATE for Astaire tag record");
-        }
-        else
-        {
-          TRC_DEBUG("GETing record from local memcached");
-          Memcached::GetReq get(mutate->key(), 0);
-          local_conn.send(get);
-
-          Memcached::BaseMessage* base_msg;
-          Memcached::Status status = local_conn.recv(&base_msg);
-          if (status != Memcached::Status::OK)
-          {
-            TRC_ERROR("Lost connection with local memcached instance");
-            tap_data->success = false;
-            continue;
-          }
-
-          // Check this is a Get response and cast it if so.
-          if ((!base_msg->is_response()) ||
-              (base_msg->op_code() != (uint8_t)Memcached::OpCode::GET))
-          {
-            TRC_ERROR("Received unexpected message from local memcached instance (%x)", base_msg->op_code());
-            tap_data->success = false;
-            delete base_msg; base_msg = NULL;
-            continue;
-          }
-          Memcached::GetRsp* get_rsp = (Memcached::GetRsp*)base_msg;
-          base_msg = NULL;
-
-          // Examine Get response to determine whether to Add or Replace the key.
-          bool do_add = false;
-          bool do_replace = false;
-          uint64_t cas = 0;
-          if (get_rsp->result_code() == (uint8_t)Memcached::ResultCode::NO_ERROR)
-          {
-            // The flags field encodes a timestamp.  Calculate the difference.
-            // If the timestamp in the Get response is earlier than that in the
-            // Mutate, replace the value stored in the local memcached.
-            if (((int32_t)get_rsp->flags()) - ((int32_t)mutate->flags()) < 0)
-            {
-              do_replace = true;
-              cas = get_rsp->cas();
-            }
-          }
-          else if (get_rsp->result_code() == (uint8_t)Memcached::ResultCode::KEY_NOT_FOUND)
+          // TAP_CONNECT should not be replied to, if it has, it is to
+          // say that the message was not understood.  If we asked for a
+          // backfill that may be all that wasn't understood, so the control
+          // thread tries again with a plain dump.
+          if (tap_data->backfill_date != 0)
           {
-            do_add = true;
+            TRC_WARNING("Cannot backfill from %s, will fall back to a full dump",
+                        tap_data->tap_server.c_str());
+            tap_data->backfill_rejected = true;
           }
           else
           {
-            TRC_STATUS("Received unexpected Get response result code %x", get_rsp->result_code());
-            tap_data->success = false;
-            delete get_rsp; get_rsp = NULL;
-            continue;
+            TRC_ERROR("Cannot tap %s as the TAP protocol was not supported",
+                      tap_data->tap_server.c_str());
           }
-          delete get_rsp; get_rsp = NULL;
+          tap_data->success = false;
+          finished = true;
+        }
+        else
+        {
+          TRC_ERROR("Unexpected response from %s of type %d to TAP_MUTATE request",
+                    tap_data->tap_server.c_str(),
+                    msg->op_code());
+          tap_data->success = false;
+          finished = true;
+        }
+      }
+      else if (msg->op_code() == (uint8_t)Memcached::OpCode::TAP_MUTATE)
+      {
+        uint16_t vbucket = vbucket_for_hash(hashes[it - msgs.begin()]);
+        batch_keys++;
+        batch_bytes += msg->frame().size();
+        if (vbucket >= tap_data->bucket_bytes.size())
+        {
+          tap_data->bucket_bytes.resize(vbucket + 1, 0);
+        }
+        tap_data->bucket_bytes[vbucket] += msg->frame().size();
 
-          // Now actually do the Add or Replace (if required).
-          if (do_add)
-          {
-            Memcached::AddReq add(mutate->key(),
-                                  vbucket,
-                                  mutate->value(),
-                                  mutate->flags(),
-                                  mutate->expiry());
-            local_conn.send(add);
-
-            Memcached::BaseMessage* add_rsp;
-            Memcached::Status status = local_conn.recv(&add_rsp);
-            if (status != Memcached::Status::OK)
-            {
-              TRC_ERROR("Lost connection with local memcached instance");
-              tap_data->success = false;
-              continue;
-            }
-            delete add_rsp;
-          }
-          else if (do_replace)
+        if (tap_data->merge != NULL)
+        {
+          // The merge now owns the message, and holds on to it until the
+          // other replicas' copies have been seen.
+          msg->detach();
+          tap_conn.release(tap_data->merge->offer(msg, vbucket, tap_data->merge_rank));
+          if (tap_data->merge->full())
           {
-            Memcached::ReplaceReq replace(mutate->key(),
-                                          vbucket,
-                                          mutate->value(),
-                                          cas,
-                                          mutate->flags(),
-                                          mutate->expiry());
-            local_conn.send(replace);
-
-            Memcached::BaseMessage* replace_rsp;
-            Memcached::Status status = local_conn.recv(&replace_rsp);
-            if (status != Memcached::Status::OK)
-            {
-              TRC_ERROR("Lost connection with local memcached instance");
-              tap_data->success = false;
-              continue;
-            }
-            delete replace_rsp;
+            write_merged_records(tap_data);
           }
-
-          // Update global and local stats
-          tap_data->global_stats->increment_resynced_keys_count(1);
-          uint32_t bytes = mutate->to_wire().size();
-          tap_data->global_stats->increment_resynced_bytes_count(bytes);
-          tap_data->global_stats->increment_bandwidth(bytes);
-
-          tap_data->conn_stats->lock();
-          AstairePerConnectionStatistics::BucketRecord* bucket_stats =
-            tap_data->conn_stats->get_bucket_stats(vbucket);
-          bucket_stats->increment_resynced_keys_count(1);
-          bucket_stats->increment_resynced_bytes_count(bytes);
-          bucket_stats->increment_bandwidth(bytes);
-          tap_data->conn_stats->unlock();
+          tap_data->merge->wait_for_room(tap_data->merge_rank);
+        }
+        else
+        {
+          // The applier now owns the message.
+          applier.apply(msg, vbucket);
         }
+        *it = NULL;
       }
       else
       {
         TRC_ERROR("Unexpected request from %s of type %d during TAP stream",
                   tap_data->tap_server.c_str(),
-                  req->op_code());
+                  msg->op_code());
         tap_data->success = false;
         finished = true;
       }
     }
 
-    delete msg; msg = NULL;
+    for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+         it != msgs.end();
+         ++it)
+    {
+      tap_conn.release(*it);
+    }
+    msgs.clear();
+
+    // Hold off before reading any more of the tap if we're using more than
+    // our share of the node.  The tap server just sees us reading slowly.
+    if ((tap_data->rate_limiter != NULL) && (batch_keys > 0))
+    {
+      applier.poll();
+      uint64_t now_cpu_ns = thread_cpu_ns();
+      tap_data->rate_limiter->throttle(batch_keys, batch_bytes, now_cpu_ns - cpu_ns);
+      cpu_ns = now_cpu_ns;
+    }
   }
   while (!finished);
 
+  // Wait for the mutates that are still being applied.
+  applier.drain();
+  if (!applier.success())
+  {
+    tap_data->success = false;
+  }
+
   if (tap_data->success)
   {
     tap_data->global_stats->increment_resynced_bucket_count(tap_data->buckets.size());
@@ -434,8 +719,9 @@ void* Astaire::tap_buckets_thread(void *data)
     tap_data->conn_stats->unlock();
   }
 
-  // Tidy up
-  local_conn.disconnect();
+  // Tidy up.  If anything went wrong the local connection may be part way
+  // through a request, so only reuse it if it didn't.
+  tap_data->local_conn_pool->put(local_conn, tap_data->success);
   tap_conn.disconnect();
 
   return (void*)tap_data;
@@ -445,40 +731,1061 @@ void* Astaire::tap_buckets_thread(void *data)
 /* Private functions                                                         */
 /*****************************************************************************/
 
-// Handles the resynchronisation required given the view of the cluster. Astaire
-// will automatically calculate the TAPs required and process them to completion
-// or failure.
-//
-// @param full_resync - Whether to do a full-resync or a minimal-resync.
-void Astaire::do_resync(bool full_resync)
+// Write the records a merge holds to the local memcached, on a connection of
+// their own.  The tap's thread data gives the vbuckets and stats to use, which
+// are the same for every tap feeding the merge.
+void Astaire::write_merged_records(TapBucketsThreadData* tap_data)
 {
-  TRC_DEBUG("Start resync operation");
+  ResyncMerge::RecordList records;
+  tap_data->merge->start_write(records);
 
-  OutstandingWorkList owl = calculate_worklist(full_resync);
-  if (owl.empty())
+  Memcached::ClientConnection* local_conn = tap_data->local_conn_pool->get();
+  if (local_conn == NULL)
   {
-    TRC_INFO("No resyncing required");
+    TRC_ERROR("Failed to connect to local server %s",
+              tap_data->local_server.c_str());
+    for (ResyncMerge::RecordList::iterator it = records.begin();
+         it != records.end();
+         ++it)
+    {
+      delete it->first;
+    }
+    tap_data->merge->end_write(false);
     return;
   }
 
-  _global_stats->set_total_buckets(owl_total_buckets(owl));
+  MutateApplier applier(tap_data, NULL, local_conn);
+  for (ResyncMerge::RecordList::iterator it = records.begin();
+       it != records.end();
+       ++it)
+  {
+    applier.apply(it->first, it->second);
+  }
+  applier.drain();
 
-  CL_ASTAIRE_START_RESYNC.log();
-  if (_alarm)
+  tap_data->local_conn_pool->put(local_conn, applier.success());
+  tap_data->merge->end_write(applier.success());
+}
+
+Astaire::MutateApplier::MutateApplier(TapBucketsThreadData* tap_data,
+                                      Memcached::ClientConnection* tap_conn,
+                                      Memcached::ClientConnection* local_conn) :
+  _tap_data(tap_data),
+  _tap_conn(tap_conn),
+  _local_conn(local_conn),
+  _counters(tap_data->global_stats->add_counters()),
+  _success(true),
+  _local_conn_ok(true),
+  _in_flight(),
+  _in_flight_bytes(0),
+  _next_opaque(0),
+  _latencies_us()
+{
+}
+
+Astaire::MutateApplier::~MutateApplier()
+{
+  // Anything still in flight at this point has failed.
+  for (std::map<uint32_t, PendingMutate>::iterator it = _in_flight.begin();
+       it != _in_flight.end();
+       ++it)
   {
-    _alarm->set();
+    release(it->second.mutate);
   }
 
-  process_worklist(owl);
+  report_latencies();
+  _tap_data->global_stats->remove_counters(_counters); _counters = NULL;
+}
 
-  if (_alarm)
+void Astaire::MutateApplier::apply(Memcached::Message* mutate,
+                                   uint16_t vbucket)
+{
+  boost::string_ref key = mutate->key();
+  TRC_DEBUG("Received TAP_MUTATE for key %.*s from bucket %d",
+            (int)key.length(),
+            key.data(),
+            vbucket);
+
+  std::vector<uint16_t>::iterator iter =
+    std::find(_tap_data->buckets.begin(),
+              _tap_data->buckets.end(),
+              vbucket);
+  if (iter == _tap_data->buckets.end())
   {
-    _alarm->clear();
+    TRC_DEBUG("Disarding TAP_MUTATE for incorrect vBucket");
+    release(mutate);
+    return;
   }
-  CL_ASTAIRE_COMPLETE_RESYNC.log();
+  else if (key.starts_with(ASTAIRE_KEY_PREFIX))
+  {
+    TRC_DEBUG("Disarding TAP_MUTATE for Astaire tag record");
+    release(mutate);
+    return;
+  }
+
+  // Wait for room in the window.  There is always room for one mutate,
+  // however big it is.
+  size_t bytes = mutate->value().length();
+  while ((_local_conn_ok) &&
+         (!_in_flight.empty()) &&
+         ((_in_flight.size() >= max_in_flight()) ||
+          (_in_flight_bytes + bytes > MAX_PIPELINED_BYTES)))
+  {
+    handle_local_rsp();
+  }
+
+  if (!_local_conn_ok)
+  {
+    _success = false;
+    release(mutate);
+    return;
+  }
+
+  // The mutate is going to be held on to while the tap connection receives
+  // more data, so keep that connection's buffer from reusing its space.
+  // Merged records are already detached.
+  if (_tap_conn != NULL)
+  {
+    _tap_conn->hold(mutate);
+  }
+  _in_flight_bytes += bytes;
+
+  PendingMutate pending;
+  pending.mutate = mutate;
+  pending.vbucket = vbucket;
+
+  if (_tap_data->blind_add)
+  {
+    TRC_DEBUG("ADDing record to local memcached");
+    pending.stage = PendingMutate::BLIND_ADD;
+    send_store((uint8_t)Memcached::OpCode::ADD, 0, pending);
+  }
+  else
+  {
+    TRC_DEBUG("GETing record from local memcached");
+    pending.stage = PendingMutate::GET;
+    send_local(Memcached::GetReq(key.to_string(), _next_opaque), pending);
+  }
+}
+
+void Astaire::MutateApplier::poll()
+{
+  while ((_local_conn_ok) &&
+         (!_in_flight.empty()) &&
+         (_local_conn->recv_ready()))
+  {
+    handle_local_rsp();
+  }
+}
+
+void Astaire::MutateApplier::drain()
+{
+  while ((_local_conn_ok) && (!_in_flight.empty()))
+  {
+    handle_local_rsp();
+  }
+}
+
+// Send a request for a mutate to the local memcached, and record the mutate
+// as waiting for the response.  The request must have been built with
+// `_next_opaque` as its opaque.
+void Astaire::MutateApplier::send_local(const Memcached::BaseReq& req,
+                                        PendingMutate& pending)
+{
+  track_request(pending);
+
+  if (!_local_conn->send(req))
+  {
+    local_conn_failed();
+  }
+}
+
+// Send an ADD or REPLACE of a mutate's record to the local memcached.  This
+// rewrites the TAP_MUTATE into the request in place, so the value is sent
+// straight from the buffer it was received into rather than being copied
+// into a new request.
+void Astaire::MutateApplier::send_store(uint8_t op_code,
+                                        uint64_t cas,
+                                        PendingMutate& pending)
+{
+  Memcached::Message* mutate = pending.mutate;
+  boost::string_ref frame = mutate->rewrite_as_store(op_code,
+                                                     pending.vbucket,
+                                                     _next_opaque,
+                                                     cas);
+  if (frame.empty())
+  {
+    // The mutate can't be rewritten (memcached must have sent extras we
+    // don't expect), so build the request from scratch.
+    send_local(Memcached::SetAddReplaceReq(op_code,
+                                           mutate->key().to_string(),
+                                           pending.vbucket,
+                                           mutate->value().to_string(),
+                                           cas,
+                                           mutate->flags(),
+                                           mutate->expiry(),
+                                           _next_opaque),
+               pending);
+    return;
+  }
+
+  track_request(pending);
+
+  if (!_local_conn->send_frame(frame))
+  {
+    local_conn_failed();
+  }
+}
+
+// Record a mutate as waiting for the response to the request about to be
+// sent for it, which must have `_next_opaque` as its opaque.
+void Astaire::MutateApplier::track_request(PendingMutate& pending)
+{
+  pending.sent_time_us = monotonic_us();
+  _in_flight[_next_opaque] = pending;
+  _next_opaque++;
+}
+
+// Wait for the next response from the local memcached and move on the mutate
+// that it is for.  A GET response determines whether to add or replace the
+// record (judged by the timestamp in the flags), while an ADD or REPLACE
+// response completes the mutate.  A blind ADD also completes the mutate,
+// unless it failed because the record exists, in which case the local copy
+// is fetched and compared as usual.
+void Astaire::MutateApplier::handle_local_rsp()
+{
+  Memcached::Message* rsp;
+  Memcached::Status status = _local_conn->recv(rsp);
+  if (status != Memcached::Status::OK)
+  {
+    TRC_ERROR("Lost connection with local memcached instance");
+    local_conn_failed();
+    return;
+  }
+
+  std::map<uint32_t, PendingMutate>::iterator it = _in_flight.find(rsp->opaque());
+  if ((!rsp->is_response()) || (it == _in_flight.end()))
+  {
+    TRC_ERROR("Received unexpected message from local memcached instance (%x)", rsp->op_code());
+    _local_conn->release(rsp); rsp = NULL;
+    local_conn_failed();
+    return;
+  }
+
+  PendingMutate pending = it->second;
+  _in_flight.erase(it);
+
+  if (_tap_data->concurrency_controller != NULL)
+  {
+    _latencies_us.push_back(monotonic_us() - pending.sent_time_us);
+    if (_latencies_us.size() >= LATENCY_REPORT_BATCH)
+    {
+      report_latencies();
+    }
+  }
+
+  if ((pending.stage == PendingMutate::BLIND_ADD) &&
+      (rsp->result_code() == (uint8_t)Memcached::ResultCode::KEY_EXISTS))
+  {
+    TRC_DEBUG("Record already exists - GETing it from local memcached");
+    _local_conn->release(rsp); rsp = NULL;
+    pending.stage = PendingMutate::GET;
+    send_local(Memcached::GetReq(pending.mutate->key().to_string(), _next_opaque),
+               pending);
+    return;
+  }
+
+  if (pending.stage != PendingMutate::GET)
+  {
+    // The result of the ADD or REPLACE doesn't matter - if it failed the
+    // local node has been updated by someone else in the meantime.
+    _local_conn->release(rsp); rsp = NULL;
+    complete(pending);
+    return;
+  }
+
+  // Check this is a Get response.
+  if (rsp->op_code() != (uint8_t)Memcached::OpCode::GET)
+  {
+    TRC_ERROR("Received unexpected message from local memcached instance (%x)", rsp->op_code());
+    _local_conn->release(rsp); rsp = NULL;
+    local_conn_failed();
+    release(pending.mutate);
+    return;
+  }
+
+  // Examine Get response to determine whether to Add or Replace the key.
+  const Memcached::Message& mutate = *pending.mutate;
+  bool do_add = false;
+  bool do_replace = false;
+  uint64_t cas = 0;
+  if (rsp->result_code() == (uint8_t)Memcached::ResultCode::NO_ERROR)
+  {
+    // The flags field encodes a timestamp.  Calculate the difference.
+    // If the timestamp in the Get response is earlier than that in the
+    // Mutate, replace the value stored in the local memcached.
+    if (((int32_t)rsp->flags()) - ((int32_t)mutate.flags()) < 0)
+    {
+      do_replace = true;
+      cas = rsp->cas();
+    }
+  }
+  else if (rsp->result_code() == (uint8_t)Memcached::ResultCode::KEY_NOT_FOUND)
+  {
+    do_add = true;
+  }
+  else
+  {
+    TRC_STATUS("Received unexpected Get response result code %x", rsp->result_code());
+    _local_conn->release(rsp); rsp = NULL;
+    _success = false;
+    _in_flight_bytes -= mutate.value().length();
+    release(pending.mutate);
+    return;
+  }
+  _local_conn->release(rsp); rsp = NULL;
+
+  // Now actually do the Add or Replace (if required).
+  if (do_add)
+  {
+    pending.stage = PendingMutate::ADD;
+    send_store((uint8_t)Memcached::OpCode::ADD, 0, pending);
+  }
+  else if (do_replace)
+  {
+    pending.stage = PendingMutate::REPLACE;
+    send_store((uint8_t)Memcached::OpCode::REPLACE, cas, pending);
+  }
+  else
+  {
+    complete(pending);
+  }
+}
+
+// Finish off a mutate that has been applied, updating the stats.
+void Astaire::MutateApplier::complete(PendingMutate& pending)
+{
+  // Update global and local stats.  This counts the bytes of the TAP_MUTATE
+  // as it was received.  Both sets of counters belong to this thread, so this
+  // doesn't need any locks.
+  uint32_t bytes = pending.mutate->frame().length();
+  _counters->increment(1, bytes);
+  _tap_data->conn_stats->record_resynced_key(pending.vbucket, bytes);
+
+  _in_flight_bytes -= pending.mutate->value().length();
+  release(pending.mutate); pending.mutate = NULL;
+}
+
+// Give a message back to the tap connection it came from, or delete it if
+// the applier is writing merged records.
+void Astaire::MutateApplier::release(Memcached::Message* mutate)
+{
+  if (_tap_conn != NULL)
+  {
+    _tap_conn->release(mutate);
+  }
+  else
+  {
+    delete mutate;
+  }
+}
+
+// The most mutates to have in flight, as allowed by the concurrency
+// controller if there is one.
+size_t Astaire::MutateApplier::max_in_flight() const
+{
+  if (_tap_data->concurrency_controller == NULL)
+  {
+    return MAX_PIPELINED_MUTATES;
+  }
+
+  return _tap_data->concurrency_controller->pipeline_depth(MAX_PIPELINED_MUTATES);
+}
+
+// Pass the latencies measured so far to the concurrency controller.
+void Astaire::MutateApplier::report_latencies()
+{
+  if ((_tap_data->concurrency_controller != NULL) && (!_latencies_us.empty()))
+  {
+    _tap_data->concurrency_controller->record_latencies(_latencies_us);
+    _latencies_us.clear();
+  }
+}
+
+// The local connection has failed, so none of the mutates in flight on it
+// will complete.  Throw them away, and fail any further mutates.
+void Astaire::MutateApplier::local_conn_failed()
+{
+  _local_conn_ok = false;
+  _success = false;
+
+  for (std::map<uint32_t, PendingMutate>::iterator it = _in_flight.begin();
+       it != _in_flight.end();
+       ++it)
+  {
+    release(it->second.mutate);
+  }
+  _in_flight.clear();
+  _in_flight_bytes = 0;
+}
+
+// Handles the resynchronisation required given the view of the cluster. Astaire
+// will automatically calculate the TAPs required and process them to completion
+// or failure.
+//
+// @param full_resync - Whether to do a full-resync or a minimal-resync.
+void Astaire::do_resync(bool full_resync)
+{
+  TRC_DEBUG("Start resync operation");
+
+  OutstandingWorkList owl = calculate_worklist(full_resync);
+
+  if (_history != NULL)
+  {
+    load_history();
+  }
+
+  if (_checkpoint != NULL)
+  {
+    apply_checkpoint(owl, full_resync);
+  }
+
+  // A full resync streams every vbucket the local node owns, but if it still
+  // has most of its data, most of them probably don't need it.
+  if ((_anti_entropy) && (full_resync))
+  {
+    compare_digests(owl);
+  }
+
+  // In a minimal resync the local node owns none of the vbuckets being
+  // streamed, so records can be ADDed without checking for them first.  It
+  // may still have most of the records from when it last owned them though,
+  // in which case it only needs those that have changed since.  A full resync
+  // dumps everything, apart from any vbuckets that have just been reloaded
+  // from the snapshot.
+  resync_worklist(owl,
+                  !full_resync,
+                  ((_history != NULL) && (!full_resync)) ||
+                  (!_restored_buckets.empty()));
+}
+
+// Stream the vbuckets in an OWL from their replicas, raising the resync alarm
+// while doing so, and clear the checkpoint once done.  The checkpoint must
+// already have been applied to the OWL.
+void Astaire::resync_worklist(OutstandingWorkList& owl,
+                              bool blind_add,
+                              bool delta)
+{
+  if (owl.empty())
+  {
+    TRC_INFO("No resyncing required");
+    if (_checkpoint != NULL)
+    {
+      _checkpoint->clear();
+    }
+    _restored_buckets.clear();
+    return;
+  }
+
+  _global_stats->set_total_buckets(owl_total_buckets(owl));
+
+  CL_ASTAIRE_START_RESYNC.log();
+  if (_alarm)
+  {
+    _alarm->set();
+  }
+
+  process_worklist(owl, blind_add, delta);
+  _restored_buckets.clear();
+
+  if (_alarm)
+  {
+    _alarm->clear();
+  }
+  CL_ASTAIRE_COMPLETE_RESYNC.log();
+
+  if (_checkpoint != NULL)
+  {
+    _checkpoint->clear();
+  }
+
+  _global_stats->reset();
+  _per_conn_stats->reset();
+}
+
+// Remove the work already done from the OWL, if there is a checkpoint from an
+// earlier attempt at the same resync, or otherwise start a new checkpoint.
+//
+// Each vbucket is streamed from its replicas in order, so the replicas it has
+// been streamed from are at the front of its replica list.
+void Astaire::apply_checkpoint(OutstandingWorkList& owl, bool full_resync)
+{
+  std::string view_id = ResyncCheckpoint::view_id(owl, full_resync);
+  std::string resync_id;
+  std::string marker;
+  ResyncCheckpoint::CompletedSet completed;
+
+  if ((_checkpoint->load(view_id, resync_id, completed)) &&
+      (read_local_marker(ASTAIRE_RESYNC_MARKER_KEY, marker)) &&
+      (marker == resync_id))
+  {
+    TRC_STATUS("Resuming resync %s, %d (vbucket, replica) pairs already done",
+               resync_id.c_str(), completed.size());
+    _checkpoint->resume();
+
+    for (OutstandingWorkList::iterator it = owl.begin(); it != owl.end(); )
+    {
+      std::vector<std::string>& replica_list = it->second;
+      while ((!replica_list.empty()) &&
+             (completed.find(std::make_pair(it->first, replica_list[0])) != completed.end()))
+      {
+        replica_list.erase(replica_list.begin());
+      }
+
+      if (replica_list.empty())
+      {
+        owl.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+  else if (!owl.empty())
+  {
+    resync_id = _checkpoint->start(view_id);
+    TRC_INFO("Starting resync %s", resync_id.c_str());
+    write_local_marker(ASTAIRE_RESYNC_MARKER_KEY, resync_id);
+  }
+}
+
+// Load the resync history for the data in the local memcached.
+void Astaire::load_history()
+{
+  _history->load(local_data_id());
+}
+
+// The ID of the data in the local memcached, first giving the data an ID if
+// it doesn't have one (because the local memcached has restarted, or this is
+// the first time it's been needed).
+// @return - The ID, or an empty string if it couldn't be written, in which
+//           case it can't be trusted next time.
+std::string Astaire::local_data_id()
+{
+  std::string data_id;
+  if (!read_local_marker(ASTAIRE_DATA_MARKER_KEY, data_id))
+  {
+    data_id = ResyncCheckpoint::generate_id();
+    if (!write_local_marker(ASTAIRE_DATA_MARKER_KEY, data_id))
+    {
+      TRC_WARNING("Failed to write data ID to local memcached");
+      data_id = "";
+    }
+  }
+
+  return data_id;
+}
+
+// The vbuckets the local node should own, once any resize has completed.
+std::vector<uint16_t> Astaire::owned_buckets()
+{
+  std::map<int, MemcachedStoreView::ReplicaList> replicas = _view->new_replicas();
+  if (replicas.empty())
+  {
+    replicas = _view->current_replicas();
+  }
+
+  std::vector<uint16_t> buckets;
+  for (std::map<int, MemcachedStoreView::ReplicaList>::const_iterator it =
+         replicas.begin();
+       it != replicas.end();
+       ++it)
+  {
+    if (is_in_vector(it->second, _self))
+    {
+      buckets.push_back(it->first);
+    }
+  }
+
+  return buckets;
+}
+
+// Replace the snapshot on disk with the records the local memcached has now,
+// by tapping it for the vbuckets it owns.
+//
+// Called on the control thread with `_lock` held.  The lock is released while
+// the local memcached is tapped.
+void Astaire::take_snapshot()
+{
+  // Make sure the local data has an ID, so that if it is lost we can tell
+  // that the local memcached needs the snapshot reloading.
+  if (local_data_id().empty())
+  {
+    return;
+  }
+
+  std::vector<uint16_t> buckets = owned_buckets();
+  if (buckets.empty())
+  {
+    return;
+  }
+
+  uint64_t start_time_ms = monotonic_ms();
+  uint64_t snapshot_time = time(NULL);
+  if (!_snapshot->start(snapshot_time, buckets))
+  {
+    return;
+  }
+
+  SnapshotRecordHandler handler(_snapshot, snapshot_time);
+  pthread_mutex_unlock(&_lock);
+  bool success = tap_records(_self, buckets, false, &handler);
+  pthread_mutex_lock(&_lock);
+
+  if (trigger_pending())
+  {
+    // The snapshot may no longer match the vbuckets the local node owns, or
+    // the data it is about to have, so throw it away.  A new one is taken as
+    // soon as the resync is done.
+    TRC_INFO("Resync triggered while taking a snapshot, discarding it");
+    _snapshot->abort();
+  }
+  else if ((success) && (_snapshot->commit()))
+  {
+    TRC_INFO("Snapshot of %d buckets took %lu ms",
+             buckets.size(), monotonic_ms() - start_time_ms);
+  }
+  else
+  {
+    TRC_WARNING("Failed to snapshot local server %s", _self.c_str());
+    _snapshot->abort();
+  }
+}
+
+// Check whether the local node has the same records as the other replicas of
+// the vbuckets it owns, and resync any that have diverged.  This is a full
+// resync apart from only streaming the vbuckets whose digests differ, so it
+// is run in the background rather than the local memcached being marked as
+// out-of-date.
+//
+// Called on the control thread with `_lock` held.  The lock is released while
+// the digests are built.  Any diverged vbuckets are then resynced just as
+// `do_resync` would, with the lock held.
+void Astaire::check_for_divergence()
+{
+  OutstandingWorkList owl = calculate_worklist(true);
+  if (owl.empty())
+  {
+    return;
+  }
+
+  TRC_INFO("Checking %d buckets for divergence from the other replicas",
+           owl.size());
+  pthread_mutex_unlock(&_lock);
+  compare_digests(owl);
+  pthread_mutex_lock(&_lock);
+
+  if (trigger_pending())
+  {
+    // The OWL may be out of date now, so leave any divergence to the resync
+    // or the next check.
+    TRC_INFO("Resync triggered while checking for divergence, abandoning the check");
+    return;
+  }
+
+  if (owl.empty())
+  {
+    TRC_INFO("No buckets have diverged");
+    return;
+  }
+
+  TRC_WARNING("%d buckets have diverged from the other replicas, resyncing them",
+              owl.size());
+  if (_history != NULL)
+  {
+    load_history();
+  }
+
+  if (_checkpoint != NULL)
+  {
+    apply_checkpoint(owl, true);
+  }
+
+  resync_worklist(owl, false, false);
+}
+
+// Remove each (vbucket, replica) pair from the OWL where the local node
+// already has the same records as the replica, judged by comparing digests of
+// the vbucket on each, so that only the vbuckets that have diverged are
+// streamed.
+//
+// The digests are built from taps of just the keys (and flags) in the
+// vbuckets, one server at a time.  Vbuckets that the local node has no
+// records in clearly need streaming, so aren't compared, nor are any just
+// reloaded from the snapshot, as they will only be backfilled.
+void Astaire::compare_digests(OutstandingWorkList& owl)
+{
+  std::vector<uint16_t> buckets;
+  for (OutstandingWorkList::const_iterator it = owl.begin(); it != owl.end(); ++it)
+  {
+    if (_restored_buckets.find(it->first) == _restored_buckets.end())
+    {
+      buckets.push_back(it->first);
+    }
+  }
+
+  if (buckets.empty())
+  {
+    return;
+  }
+
+  uint64_t start_time_ms = monotonic_ms();
+  ResyncDigest local_digest;
+  DigestRecordHandler local_handler(local_digest);
+  if (!tap_records(_self, buckets, true, &local_handler))
+  {
+    TRC_WARNING("Failed to build digests for local server %s", _self.c_str());
+    return;
+  }
+
+  std::map<std::string, std::vector<uint16_t>> replica_buckets;
+  for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+       it != buckets.end();
+       ++it)
+  {
+    if (!local_digest.empty(*it))
+    {
+      const std::vector<std::string>& replicas = owl[*it];
+      for (std::vector<std::string>::const_iterator replica = replicas.begin();
+           replica != replicas.end();
+           ++replica)
+      {
+        replica_buckets[*replica].push_back(*it);
+      }
+    }
+  }
+
+  int matched = 0;
+  int diverged = 0;
+  for (std::map<std::string, std::vector<uint16_t>>::const_iterator it =
+         replica_buckets.begin();
+       it != replica_buckets.end();
+       ++it)
+  {
+    const std::string& replica = it->first;
+    ResyncDigest replica_digest;
+    DigestRecordHandler handler(replica_digest);
+    if (!tap_records(replica, it->second, true, &handler))
+    {
+      TRC_WARNING("Failed to build digests for %s", replica.c_str());
+      diverged += it->second.size();
+      continue;
+    }
+
+    for (std::vector<uint16_t>::const_iterator bucket_it = it->second.begin();
+         bucket_it != it->second.end();
+         ++bucket_it)
+    {
+      size_t ranges = local_digest.compare(*bucket_it, replica_digest);
+      if (ranges == 0)
+      {
+        std::vector<std::string>& replicas = owl[*bucket_it];
+        replicas.erase(std::find(replicas.begin(), replicas.end(), replica));
+        if (replicas.empty())
+        {
+          owl.erase(*bucket_it);
+        }
+        matched++;
+      }
+      else
+      {
+        TRC_DEBUG("Bucket %d differs from %s in %d of %d key ranges",
+                  *bucket_it, replica.c_str(), ranges, ResyncDigest::RANGES);
+        diverged++;
+      }
+    }
+  }
+
+  TRC_INFO("Compared digests in %lu ms: %d (bucket, replica) pairs match, %d differ",
+           monotonic_ms() - start_time_ms, matched, diverged);
+}
+
+// Tap a server for the given vbuckets, passing each of their records (apart
+// from Astaire's own) to the handler.  The server is serving clients too, so
+// the tap is throttled by the rate limiter.  If `keys_only` is set the server
+// is asked to leave out the values, falling back to a full dump if it can't.
+// @return - Whether every record was streamed and handled.
+bool Astaire::tap_records(const std::string& server,
+                          const std::vector<uint16_t>& buckets,
+                          bool keys_only,
+                          RecordHandler* handler)
+{
+  std::vector<bool> in_tap;
+  for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+       it != buckets.end();
+       ++it)
+  {
+    if (*it >= in_tap.size())
+    {
+      in_tap.resize(*it + 1, false);
+    }
+    in_tap[*it] = true;
+  }
+
+  Memcached::ClientConnection tap_conn(server);
+  int rc = tap_conn.connect();
+  if (rc != 0)
+  {
+    TRC_WARNING("Failed to connect to %s, error was (%d)", server.c_str(), rc);
+    return false;
+  }
+
+  Memcached::TapConnectReq tap(buckets, 0, keys_only);
+  tap_conn.send(tap);
+
+  std::vector<Memcached::Message*> msgs;
+  uint64_t cpu_ns = thread_cpu_ns();
+  bool success = true;
+  bool rejected = false;
+  bool finished = false;
+  do
+  {
+    Memcached::Status status = tap_conn.recv_batch(msgs);
+    if (status == Memcached::Status::ERROR)
+    {
+      TRC_WARNING("Error while tapping %s", server.c_str());
+      success = false;
+      finished = true;
+    }
+    else if (status == Memcached::Status::DISCONNECTED)
+    {
+      finished = true;
+    }
+
+    uint64_t batch_keys = 0;
+    uint64_t batch_bytes = 0;
+    for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+         (success) && (it != msgs.end());
+         ++it)
+    {
+      Memcached::Message* msg = *it;
+
+      if ((msg->is_response()) &&
+          (msg->op_code() == (uint8_t)Memcached::OpCode::TAP_CONNECT))
+      {
+        // The server didn't understand the TAP_CONNECT.  If we asked for
+        // just keys, that may be all it didn't understand.
+        TRC_WARNING("%s rejected the tap", server.c_str());
+        rejected = keys_only;
+        success = false;
+        finished = true;
+        break;
+      }
+      else if ((!msg->is_request()) ||
+               (msg->op_code() != (uint8_t)Memcached::OpCode::TAP_MUTATE))
+      {
+        TRC_WARNING("Unexpected message of type %d while tapping %s",
+                    msg->op_code(), server.c_str());
+        success = false;
+        finished = true;
+        break;
+      }
+
+      boost::string_ref key = msg->key();
+      uint16_t vbucket = vbucket_for_hash(VBucketHash::hash(key.data(), key.size()));
+      if ((vbucket >= in_tap.size()) ||
+          (!in_tap[vbucket]) ||
+          (key.starts_with(ASTAIRE_KEY_PREFIX)))
+      {
+        continue;
+      }
+
+      batch_keys++;
+      batch_bytes += msg->frame().size();
+
+      if (!handler->record(*msg, vbucket))
+      {
+        success = false;
+        finished = true;
+      }
+    }
+
+    for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+         it != msgs.end();
+         ++it)
+    {
+      tap_conn.release(*it);
+    }
+    msgs.clear();
+
+    if ((_rate_limiter != NULL) && (batch_keys > 0))
+    {
+      uint64_t now_cpu_ns = thread_cpu_ns();
+      _rate_limiter->throttle(batch_keys, batch_bytes, now_cpu_ns - cpu_ns);
+      cpu_ns = now_cpu_ns;
+    }
+  }
+  while (!finished);
+
+  tap_conn.disconnect();
+
+  if (rejected)
+  {
+    TRC_INFO("Tapping all of %s instead of just keys", server.c_str());
+    return tap_records(server, buckets, false, handler);
+  }
+
+  return success;
+}
+
+// Reload the snapshot on disk into the local memcached, which has lost its
+// data.  The records are ADDed, pipelined on a single connection, so that any
+// that clients have written since the local memcached restarted are kept.
+// Their keys and values are sent straight from the snapshot's mapping.
+//
+// If the whole snapshot is reloaded, the vbuckets it covers are recorded in
+// `_restored_buckets`, so the resync that follows only backfills them.
+//
+// Called on the control thread with `_lock` held.  The lock is released while
+// the records are reloaded.
+void Astaire::restore_snapshot()
+{
+  _restored_buckets.clear();
+
+  if (!_snapshot->open())
+  {
+    return;
+  }
+
+  // Only reload the vbuckets the local node still owns.
+  std::vector<uint16_t> owned = owned_buckets();
+  std::vector<uint16_t> buckets;
+  std::vector<bool> restore;
+  for (std::vector<uint16_t>::const_iterator it = _snapshot->buckets().begin();
+       it != _snapshot->buckets().end();
+       ++it)
+  {
+    if (is_in_vector(owned, *it))
+    {
+      buckets.push_back(*it);
+      if (*it >= restore.size())
+      {
+        restore.resize(*it + 1, false);
+      }
+      restore[*it] = true;
+    }
+  }
+
+  if (buckets.empty())
+  {
+    TRC_INFO("Snapshot has none of the buckets the local node owns");
+    _snapshot->close();
+    return;
+  }
+
+  Memcached::ClientConnection* local_conn = _local_conn_pool->get();
+  if (local_conn == NULL)
+  {
+    TRC_WARNING("Failed to connect to local server %s to reload the snapshot",
+                _self.c_str());
+    _snapshot->close();
+    return;
+  }
+
+  TRC_STATUS("Reloading %d buckets into the local memcached from a snapshot taken at %lu",
+             buckets.size(), _snapshot->time());
+  pthread_mutex_unlock(&_lock);
+
+  uint64_t start_time_ms = monotonic_ms();
+  uint64_t now = time(NULL);
+  uint64_t restored = 0;
+  size_t in_flight = 0;
+  bool more = true;
+  bool success = true;
+  ResyncSnapshot::Record record;
+  std::vector<Memcached::Message*> rsps;
+
+  while ((success) && ((more) || (in_flight > 0)))
+  {
+    if ((more) && (in_flight < MAX_PIPELINED_MUTATES))
+    {
+      more = _snapshot->next(record);
+
+      // Skip records that have expired since the snapshot was taken.  Their
+      // expiry times were made absolute when it was written.
+      if ((!more) ||
+          (record.vbucket >= restore.size()) ||
+          (!restore[record.vbucket]) ||
+          ((record.expiry > MEMCACHED_MAX_RELATIVE_EXPIRY) &&
+           (record.expiry <= now)))
+      {
+        continue;
+      }
+
+      success = local_conn->send_store((uint8_t)Memcached::OpCode::ADD,
+                                       record.key,
+                                       record.vbucket,
+                                       record.value,
+                                       record.flags,
+                                       record.expiry);
+      in_flight++;
+      restored++;
+    }
+    else
+    {
+      // The window is full (or the snapshot has all been read), so collect
+      // whatever responses have arrived.  Whether the ADDs succeeded doesn't
+      // matter.
+      if (local_conn->recv_batch(rsps) != Memcached::Status::OK)
+      {
+        success = false;
+      }
+
+      for (std::vector<Memcached::Message*>::iterator it = rsps.begin();
+           it != rsps.end();
+           ++it)
+      {
+        if ((!(*it)->is_response()) ||
+            ((*it)->op_code() != (uint8_t)Memcached::OpCode::ADD))
+        {
+          success = false;
+        }
+        local_conn->release(*it);
+      }
+      in_flight -= std::min(in_flight, rsps.size());
+      rsps.clear();
+    }
+  }
+
+  _local_conn_pool->put(local_conn, success);
+  pthread_mutex_lock(&_lock);
+
+  if (!success)
+  {
+    TRC_WARNING("Lost connection to local memcached while reloading the snapshot");
+  }
+  else if (!_snapshot->complete())
+  {
+    TRC_WARNING("Snapshot was incomplete, %lu records reloaded", restored);
+  }
+  else
+  {
+    TRC_STATUS("Reloaded %lu records from the snapshot in %lu ms",
+               restored, monotonic_ms() - start_time_ms);
+    for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+         it != buckets.end();
+         ++it)
+    {
+      _restored_buckets[*it] = _snapshot->time();
+    }
+  }
+
+  _snapshot->close();
 
-  _global_stats->reset();
-  _per_conn_stats->reset();
+  // Give the reloaded data an ID, so a later full resync doesn't reload it
+  // again.
+  local_data_id();
 }
 
 // Calculate the OWL for a resync operation.
@@ -551,7 +1858,20 @@ Astaire::OutstandingWorkList Astaire::calculate_worklist(bool full_resync)
 // loss if one of the replicas has recently restarted (and is missing some
 // records), and processing each replica in turn avoids race conditions that
 // could cause the local node to end up with old data.
-void Astaire::process_worklist(OutstandingWorkList& owl)
+//
+// Each vbucket moves on to its next replica as soon as its tap from the
+// previous one completes, regardless of how the taps for other vbuckets are
+// getting on.  A vbucket is "busy" while a tap for it is in progress, and busy
+// vbuckets are left alone when working out the next taps to start.
+//
+// @param blind_add - Whether the taps should ADD records without first
+//                    checking whether the local node has them.
+// @param delta     - Whether the taps should only ask for the records that
+//                    have changed since each vbucket was last streamed from
+//                    each replica (where that is known).
+void Astaire::process_worklist(OutstandingWorkList& owl,
+                               bool blind_add,
+                               bool delta)
 {
   // Create a set of vbuckets that have not be successfully streamed yet. If
   // this set is not empty at the end of the method, then something has gone
@@ -564,43 +1884,216 @@ void Astaire::process_worklist(OutstandingWorkList& owl)
     unstreamed_buckets.insert(it->first);
   }
 
-  while (!owl_empty(owl))
+  std::set<uint16_t> busy_buckets;
+  int running_taps = 0;
+  SourceLoads loads;
+
+  // Servers that have turned out not to support backfills.
+  std::set<std::string> no_backfill_servers;
+
+  // To report how much time this saves, track how many taps have been started
+  // for each vbucket (so the replica each tap is for), and the longest tap
+  // for each replica.  Waiting for all the taps for each replica before moving
+  // on to the next would take roughly the sum of the longest taps.
+  std::map<uint16_t, size_t> bucket_passes;
+  std::vector<uint64_t> longest_tap_ms;
+  uint64_t start_time_ms = monotonic_ms();
+
+  while (true)
   {
-    // Calculate the taps to establish. This modifies the OWL in place.
-    TapList taps = calculate_taps(owl);
+    // If merging replicas, start taps of every replica at once for all the
+    // vbuckets that are waiting.  This modifies the OWL in place.
+    MergeList merges;
+    if (_merge_replicas)
+    {
+      merges = calculate_merges(owl, busy_buckets);
+    }
+
+    for (MergeList::iterator merges_it = merges.begin();
+         merges_it != merges.end();
+         ++merges_it)
+    {
+      const std::vector<std::string>& replicas = merges_it->first;
+      const std::vector<uint16_t>& buckets = merges_it->second;
+      ResyncMerge* merge = new ResyncMerge(buckets, replicas.size(), MAX_MERGE_BYTES);
+
+      for (std::vector<std::string>::const_iterator replica_it = replicas.begin();
+           replica_it != replicas.end();
+           ++replica_it)
+      {
+        // Every tap feeding a merge is for the same vbuckets, so can only
+        // backfill if all of them can.
+        bool server_delta = (delta) &&
+          (no_backfill_servers.find(*replica_it) == no_backfill_servers.end());
+        BackfillList backfills = calculate_backfills(*replica_it, buckets, server_delta);
+        uint64_t backfill_date = (backfills.size() == 1) ? backfills.begin()->first : 0;
+
+        perform_single_tap(*replica_it,
+                           buckets,
+                           blind_add,
+                           backfill_date,
+                           merge,
+                           replica_it - replicas.begin());
+        running_taps++;
+      }
+
+      for (std::vector<uint16_t>::const_iterator bucket_it = buckets.begin();
+           bucket_it != buckets.end();
+           ++bucket_it)
+      {
+        busy_buckets.insert(*bucket_it);
+        bucket_passes[*bucket_it]++;
+      }
+    }
+
+    // Otherwise start taps for all the vbuckets that are waiting for their
+    // next replica.  This modifies the OWL in place.
+    TapList taps = calculate_taps(owl, busy_buckets, loads);
+    std::vector<PlannedTap> planned;
 
-    std::vector<pthread_t> tap_handles;
-    tap_handles.reserve(taps.size());
     for (TapList::iterator taps_it = taps.begin();
          taps_it != taps.end();
          ++taps_it)
     {
-      // Kick off a TAP on this server.
-      pthread_t handle;
-      bool rc = perform_single_tap(taps_it->first, taps_it->second, &handle);
-      if (rc)
+      // Plan the TAPs on this server, one for each sub-stream of each
+      // backfill date.  The more work the server has, the more sub-streams
+      // it gets.
+      bool server_delta = (delta) &&
+        (no_backfill_servers.find(taps_it->first) == no_backfill_servers.end());
+      BackfillList backfills = calculate_backfills(taps_it->first,
+                                                   taps_it->second,
+                                                   server_delta);
+      size_t fanout = server_fanout(taps_it->first, loads);
+
+      for (BackfillList::const_iterator backfill_it = backfills.begin();
+           backfill_it != backfills.end();
+           ++backfill_it)
+      {
+        std::vector<std::vector<uint16_t>> sub_taps =
+          split_tap(backfill_it->second, fanout, loads);
+
+        for (std::vector<std::vector<uint16_t>>::const_iterator sub_it = sub_taps.begin();
+             sub_it != sub_taps.end();
+             ++sub_it)
+        {
+          PlannedTap tap;
+          tap.server = taps_it->first;
+          tap.backfill_date = backfill_it->first;
+          tap.buckets = *sub_it;
+          tap.chain_seconds = 0;
+          for (std::vector<uint16_t>::const_iterator bucket_it = sub_it->begin();
+               bucket_it != sub_it->end();
+               ++bucket_it)
+          {
+            tap.chain_seconds += loads.bucket_seconds[*bucket_it] *
+                                 (owl[*bucket_it].size() + 1);
+          }
+          planned.push_back(tap);
+        }
+      }
+    }
+
+    // Kick off the TAPs that start the most work first, as the tap workers
+    // take them in order.
+    std::vector<std::pair<double, size_t>> queue_order;
+    for (size_t ii = 0; ii < planned.size(); ++ii)
+    {
+      queue_order.push_back(std::make_pair(-planned[ii].chain_seconds, ii));
+    }
+    std::sort(queue_order.begin(), queue_order.end());
+
+    for (std::vector<std::pair<double, size_t>>::const_iterator order_it =
+           queue_order.begin();
+         order_it != queue_order.end();
+         ++order_it)
+    {
+      const PlannedTap& tap = planned[order_it->second];
+      perform_single_tap(tap.server, tap.buckets, blind_add, tap.backfill_date, NULL, 0);
+      running_taps++;
+      for (std::vector<uint16_t>::const_iterator bucket_it = tap.buckets.begin();
+           bucket_it != tap.buckets.end();
+           ++bucket_it)
       {
-        tap_handles.push_back(handle);
+        busy_buckets.insert(*bucket_it);
+        bucket_passes[*bucket_it]++;
       }
     }
 
-    for (std::vector<pthread_t>::iterator handle_it = tap_handles.begin();
-         handle_it != tap_handles.end();
-         ++handle_it)
+    if (running_taps == 0)
     {
+      // Nothing is running and nothing more can be started, so we're done.
+      break;
+    }
+
+    // Wait for a tap to finish, which frees up its vbuckets to move on to
+    // their next replica.  Pick up any others that have also finished, so
+    // that their vbuckets can share taps.
+    std::vector<TapJob*> jobs;
+    wait_for_taps(jobs);
+
+    for (std::vector<TapJob*>::iterator job_it = jobs.begin();
+         job_it != jobs.end();
+         ++job_it)
+    {
+      running_taps--;
+
+      uint64_t duration_ms = monotonic_ms() - (*job_it)->start_time_ms;
+      uint64_t tap_start_time = (*job_it)->thread_data->start_time;
+      bool backfill_rejected = (*job_it)->thread_data->backfill_rejected;
+      ResyncMerge* merge = (*job_it)->thread_data->merge;
+      bool full_dump = ((*job_it)->thread_data->backfill_date == 0);
+      std::vector<uint64_t> bucket_bytes;
+      bucket_bytes.swap((*job_it)->thread_data->bucket_bytes);
       std::string server;
-      bool success = complete_single_tap(*handle_it, server);
+      std::vector<uint16_t> buckets;
+      bool success = complete_single_tap(*job_it, server, buckets);
+
+      // Take the tap off its server's load, and learn from how it went.
+      for (std::vector<uint16_t>::const_iterator bucket_it = buckets.begin();
+           bucket_it != buckets.end();
+           ++bucket_it)
+      {
+        std::map<uint16_t, double>::iterator cost_it = loads.bucket_seconds.find(*bucket_it);
+        if (cost_it != loads.bucket_seconds.end())
+        {
+          loads.busy_seconds[server] -= cost_it->second;
+          loads.bucket_seconds.erase(cost_it);
+        }
+      }
+
+      for (std::vector<uint64_t>::const_iterator bytes_it = bucket_bytes.begin();
+           bytes_it != bucket_bytes.end();
+           ++bytes_it)
+      {
+        loads.actual_bytes[server] += *bytes_it;
+      }
 
       if (success)
       {
-        TRC_VERBOSE("Tap of %s completed successfully", server.c_str());
+        update_estimates(server, bucket_bytes, full_dump, duration_ms);
+      }
+
+      // The replicas the tap's vbuckets have now been streamed from, and when
+      // each tap started.
+      std::vector<std::pair<std::string, uint64_t>> sources;
 
-        // Tap successful. Its buckets have now been successfully streamed.
-        for (std::vector<uint16_t>::const_iterator bucket_it = taps[server].begin();
-             bucket_it != taps[server].end();
+      if (success)
+      {
+        TRC_VERBOSE("Tap of %s (%d buckets) completed successfully",
+                    server.c_str(), buckets.size());
+        sources.push_back(std::make_pair(server, tap_start_time));
+      }
+      else if (backfill_rejected)
+      {
+        // Put the server back on the list for these vbuckets, and dump them
+        // (and any others) from it from now on.
+        TRC_VERBOSE("Tap of %s rejected backfill", server.c_str());
+        no_backfill_servers.insert(server);
+        for (std::vector<uint16_t>::const_iterator bucket_it = buckets.begin();
+             bucket_it != buckets.end();
              ++bucket_it)
         {
-          unstreamed_buckets.erase(*bucket_it);
+          owl[*bucket_it].insert(owl[*bucket_it].begin(), server);
         }
       }
       else
@@ -608,9 +2101,91 @@ void Astaire::process_worklist(OutstandingWorkList& owl)
         TRC_VERBOSE("Tap of %s failed", server.c_str());
         blacklist_server(owl, server);
       }
+
+      if (merge != NULL)
+      {
+        // A merge's vbuckets stay busy until all the taps feeding it have
+        // finished, by which time the merged records have been written.
+        merge->sources.insert(merge->sources.end(), sources.begin(), sources.end());
+        if (--merge->taps_outstanding > 0)
+        {
+          continue;
+        }
+
+        sources.clear();
+        if (merge->write_succeeded())
+        {
+          sources.swap(merge->sources);
+        }
+        else
+        {
+          TRC_VERBOSE("Failed to write merged records for %d buckets",
+                      buckets.size());
+        }
+        delete merge; merge = NULL;
+      }
+
+      for (std::vector<uint16_t>::const_iterator bucket_it = buckets.begin();
+           bucket_it != buckets.end();
+           ++bucket_it)
+      {
+        busy_buckets.erase(*bucket_it);
+
+        size_t pass = bucket_passes[*bucket_it] - 1;
+        if (longest_tap_ms.size() <= pass)
+        {
+          longest_tap_ms.resize(pass + 1, 0);
+        }
+        longest_tap_ms[pass] = std::max(longest_tap_ms[pass], duration_ms);
+      }
+
+      for (std::vector<std::pair<std::string, uint64_t>>::const_iterator source_it =
+             sources.begin();
+           source_it != sources.end();
+           ++source_it)
+      {
+        if (_checkpoint != NULL)
+        {
+          _checkpoint->record(buckets, source_it->first);
+        }
+
+        if (_history != NULL)
+        {
+          _history->record(buckets, source_it->first, source_it->second);
+        }
+      }
+
+      if (!sources.empty())
+      {
+        // The buckets have now been successfully streamed.
+        for (std::vector<uint16_t>::const_iterator bucket_it = buckets.begin();
+             bucket_it != buckets.end();
+             ++bucket_it)
+        {
+          unstreamed_buckets.erase(*bucket_it);
+        }
+      }
     }
   }
 
+  uint64_t round_based_ms = 0;
+  for (std::vector<uint64_t>::const_iterator it = longest_tap_ms.begin();
+       it != longest_tap_ms.end();
+       ++it)
+  {
+    round_based_ms += *it;
+  }
+  TRC_INFO("Resync taps took %lu ms (about %lu ms if tapping one replica at a time)",
+           monotonic_ms() - start_time_ms, round_based_ms);
+
+  for (std::map<std::string, uint64_t>::const_iterator it = loads.expected_bytes.begin();
+       it != loads.expected_bytes.end();
+       ++it)
+  {
+    TRC_INFO("Tapped %lu bytes from %s, expected %lu bytes",
+             loads.actual_bytes[it->first], it->first.c_str(), it->second);
+  }
+
   if (unstreamed_buckets.empty())
   {
     TRC_VERBOSE("Resync suceeded");
@@ -623,8 +2198,13 @@ void Astaire::process_worklist(OutstandingWorkList& owl)
 }
 
 // Convert an OWL into a list of TAPs to perform.  This algorithm choses the
-// first available server for each bucket and removes this server from the OWL.
-Astaire::TapList Astaire::calculate_taps(OutstandingWorkList& owl)
+// first available server for each bucket that is not busy (already being
+// tapped) and removes this server from the OWL.  The work each TAP adds to its
+// server is estimated, so that the TAPs can be balanced (see
+// `server_fanout` and `split_tap`).
+Astaire::TapList Astaire::calculate_taps(OutstandingWorkList& owl,
+                                         const std::set<uint16_t>& busy_buckets,
+                                         SourceLoads& loads)
 {
   TapList tl;
 
@@ -635,11 +2215,18 @@ Astaire::TapList Astaire::calculate_taps(OutstandingWorkList& owl)
     int vbucket = owl_it->first;
     std::vector<std::string>& replica_list = owl_it->second;
 
-    if (!replica_list.empty())
+    if (!replica_list.empty() &&
+        (busy_buckets.find(vbucket) == busy_buckets.end()))
     {
       std::string replica = replica_list[0];
       tl[replica].push_back(vbucket);
 
+      double bytes = estimated_bucket_bytes(vbucket);
+      double seconds = bytes / estimated_throughput(replica);
+      loads.busy_seconds[replica] += seconds;
+      loads.bucket_seconds[vbucket] = seconds;
+      loads.expected_bytes[replica] += (uint64_t)bytes;
+
       // Erase the replica from the OWL. This is safe do do while iterating
       // since we are not adding a new key to the OWL map (guaranteed safe by
       // C++).
@@ -650,60 +2237,313 @@ Astaire::TapList Astaire::calculate_taps(OutstandingWorkList& owl)
   return tl;
 }
 
-// Kick off a tap of a single server for the given vBuckets.
+// The number of sub-streams to split a server's new TAPs into.  The server
+// with the most work queued or running gets the full `_tap_fanout`, and the
+// others a share in proportion to their work, so that the tap workers go to
+// the servers that will take longest.
+size_t Astaire::server_fanout(const std::string& server,
+                              const SourceLoads& loads) const
+{
+  double busiest = 0;
+  for (std::map<std::string, double>::const_iterator it = loads.busy_seconds.begin();
+       it != loads.busy_seconds.end();
+       ++it)
+  {
+    busiest = std::max(busiest, it->second);
+  }
+
+  std::map<std::string, double>::const_iterator it = loads.busy_seconds.find(server);
+  if ((busiest <= 0) || (it == loads.busy_seconds.end()))
+  {
+    return _tap_fanout;
+  }
+
+  size_t fanout = (size_t)ceil(_tap_fanout * it->second / busiest);
+  return std::min(std::max(fanout, (size_t)1), (size_t)_tap_fanout);
+}
+
+// The size of a vbucket, as last measured by a full dump of it, or failing
+// that the average size of the vbuckets that have been measured.
+double Astaire::estimated_bucket_bytes(uint16_t vbucket) const
+{
+  std::map<uint16_t, uint64_t>::const_iterator it = _bucket_bytes.find(vbucket);
+  if (it != _bucket_bytes.end())
+  {
+    return std::max((double)it->second, 1.0);
+  }
+
+  double total = 0;
+  for (it = _bucket_bytes.begin(); it != _bucket_bytes.end(); ++it)
+  {
+    total += it->second;
+  }
+  return _bucket_bytes.empty() ? 1.0 : std::max(total / _bucket_bytes.size(), 1.0);
+}
+
+// The throughput of a server, as measured by earlier taps of it, or failing
+// that the average throughput of the servers that have been measured.
+double Astaire::estimated_throughput(const std::string& server) const
+{
+  std::map<std::string, double>::const_iterator it = _server_throughput.find(server);
+  if (it != _server_throughput.end())
+  {
+    return it->second;
+  }
+
+  double total = 0;
+  for (it = _server_throughput.begin(); it != _server_throughput.end(); ++it)
+  {
+    total += it->second;
+  }
+  return _server_throughput.empty() ? 1.0 : total / _server_throughput.size();
+}
+
+// Update the estimates of the vbucket sizes and server throughput after a
+// successful tap.  A backfill only sends some of the records, so says nothing
+// about the size of the vbuckets.
+void Astaire::update_estimates(const std::string& server,
+                               const std::vector<uint64_t>& bucket_bytes,
+                               bool full_dump,
+                               uint64_t duration_ms)
+{
+  uint64_t total = 0;
+  for (size_t vbucket = 0; vbucket < bucket_bytes.size(); ++vbucket)
+  {
+    total += bucket_bytes[vbucket];
+    if ((full_dump) && (bucket_bytes[vbucket] > 0))
+    {
+      _bucket_bytes[vbucket] = bucket_bytes[vbucket];
+    }
+  }
+
+  if ((total > 0) && (duration_ms > 0))
+  {
+    double throughput = total * 1000.0 / duration_ms;
+    std::map<std::string, double>::iterator it = _server_throughput.find(server);
+    if (it == _server_throughput.end())
+    {
+      _server_throughput[server] = throughput;
+    }
+    else
+    {
+      it->second = (1 - THROUGHPUT_SMOOTHING) * it->second +
+                   THROUGHPUT_SMOOTHING * throughput;
+    }
+  }
+}
+
+// Convert an OWL into a list of merges to perform.  This groups together the
+// vbuckets that are not busy and have the same replicas left, and removes all
+// of those replicas from the OWL.  Vbuckets with only one replica left are
+// left to be tapped as usual, as there is nothing to merge.
+Astaire::MergeList Astaire::calculate_merges(OutstandingWorkList& owl,
+                                             const std::set<uint16_t>& busy_buckets)
+{
+  MergeList ml;
+
+  for (OutstandingWorkList::iterator owl_it = owl.begin();
+       owl_it != owl.end();
+       ++owl_it)
+  {
+    int vbucket = owl_it->first;
+    std::vector<std::string>& replica_list = owl_it->second;
+
+    if ((replica_list.size() > 1) &&
+        (busy_buckets.find(vbucket) == busy_buckets.end()))
+    {
+      ml[replica_list].push_back(vbucket);
+      replica_list.clear();
+    }
+  }
+
+  return ml;
+}
+
+// Split the vBuckets to tap from a single server into at most `num_sub_taps`
+// disjoint lists, to be tapped in parallel.  The vBuckets are dealt out
+// largest first, each to the list with the least estimated work so far, so
+// that the sub-taps finish at about the same time.  Each list is sorted.
+std::vector<std::vector<uint16_t>> Astaire::split_tap(const std::vector<uint16_t>& buckets,
+                                                      size_t num_sub_taps,
+                                                      const SourceLoads& loads)
+{
+  num_sub_taps = std::min(buckets.size(), std::max(num_sub_taps, (size_t)1));
+  std::vector<std::vector<uint16_t>> sub_taps(num_sub_taps);
+  std::vector<double> sub_tap_seconds(num_sub_taps, 0);
+
+  // Sort the buckets by (-seconds, bucket).
+  std::vector<std::pair<double, uint16_t>> order;
+  for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+       it != buckets.end();
+       ++it)
+  {
+    std::map<uint16_t, double>::const_iterator seconds_it = loads.bucket_seconds.find(*it);
+    double seconds = (seconds_it != loads.bucket_seconds.end()) ? seconds_it->second : 0;
+    order.push_back(std::make_pair(-seconds, *it));
+  }
+  std::sort(order.begin(), order.end());
+
+  for (std::vector<std::pair<double, uint16_t>>::const_iterator it = order.begin();
+       it != order.end();
+       ++it)
+  {
+    // Ties go to the earliest list, so with nothing to go on this deals the
+    // buckets out evenly.
+    size_t best = 0;
+    for (size_t ii = 1; ii < num_sub_taps; ++ii)
+    {
+      if ((sub_tap_seconds[ii] < sub_tap_seconds[best]) ||
+          ((sub_tap_seconds[ii] == sub_tap_seconds[best]) &&
+           (sub_taps[ii].size() < sub_taps[best].size())))
+      {
+        best = ii;
+      }
+    }
+    sub_taps[best].push_back(it->second);
+    sub_tap_seconds[best] -= it->first;
+  }
+
+  for (size_t ii = 0; ii < num_sub_taps; ++ii)
+  {
+    std::sort(sub_taps[ii].begin(), sub_taps[ii].end());
+  }
+
+  return sub_taps;
+}
+
+// Work out what to ask a server for when tapping it for the given vBuckets.
+// This returns the vBuckets to dump in full (under a backfill date of 0), and
+// the vBuckets that the local node has streamed from the server before, under
+// the date to backfill them from.  That is a little before the earliest time
+// one of them was last streamed, so that they can share taps.
+Astaire::BackfillList Astaire::calculate_backfills(const std::string& server,
+                                                   const std::vector<uint16_t>& buckets,
+                                                   bool delta)
+{
+  BackfillList backfills;
+  std::vector<uint16_t> dump_buckets;
+  std::vector<uint16_t> delta_buckets;
+  uint64_t backfill_date = 0;
+
+  for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+       it != buckets.end();
+       ++it)
+  {
+    uint64_t last_synced = 0;
+    if (delta)
+    {
+      if (_history != NULL)
+      {
+        last_synced = _history->last_synced(*it, server);
+      }
+
+      // The local memcached had everything up to the time of the snapshot it
+      // has been reloaded from.
+      std::map<uint16_t, uint64_t>::const_iterator restored =
+        _restored_buckets.find(*it);
+      if (restored != _restored_buckets.end())
+      {
+        last_synced = std::max(last_synced, restored->second);
+      }
+    }
+
+    if (last_synced > BACKFILL_MARGIN_S)
+    {
+      delta_buckets.push_back(*it);
+      uint64_t date = last_synced - BACKFILL_MARGIN_S;
+      backfill_date = (backfill_date == 0) ? date : std::min(backfill_date, date);
+    }
+    else
+    {
+      dump_buckets.push_back(*it);
+    }
+  }
+
+  if (!dump_buckets.empty())
+  {
+    backfills[0] = dump_buckets;
+  }
+
+  if (!delta_buckets.empty())
+  {
+    TRC_INFO("Backfill %d buckets from %s since %lu",
+             delta_buckets.size(), server.c_str(), backfill_date);
+    backfills[backfill_date] = delta_buckets;
+  }
+
+  return backfills;
+}
+
+// Queue a tap of a single server for the given vBuckets, to be run by the
+// next free tap worker.  If `backfill_date` is non-zero, the tap is just for
+// the records that have changed since then.  If `merge` is non-NULL, the tap
+// offers its records to that merge, as the replica ranked `merge_rank` in
+// the merged vbuckets' replica list.
 //
-// On success, returns the handle of the thread being used to process the
-// tap.  Calling code can wait for this thread to complete by calling
-// `complete_single_tap`.
-bool Astaire::perform_single_tap(const std::string& server,
+// Calling code can wait for taps to complete by calling `wait_for_taps`, and
+// must then pass each of them to `complete_single_tap`.
+void Astaire::perform_single_tap(const std::string& server,
                                  const std::vector<uint16_t>& buckets,
-                                 pthread_t* handle)
+                                 bool blind_add,
+                                 uint64_t backfill_date,
+                                 ResyncMerge* merge,
+                                 int merge_rank)
 {
   _per_conn_stats->lock();
   AstairePerConnectionStatistics::ConnectionRecord* conn_stat =
     _per_conn_stats->add_connection(server, buckets);
   _per_conn_stats->unlock();
 
-  TapBucketsThreadData* thread_data = new TapBucketsThreadData(server,
-                                                               _self,
-                                                               buckets,
-                                                               _global_stats,
-                                                               conn_stat);
-  TRC_INFO("Starting TAP of %s", server.c_str());
-  int rc = pthread_create(handle, NULL, tap_buckets_thread, (void*)thread_data);
-  if (rc != 0)
+  TapJob* job = new TapJob();
+  job->thread_data = new TapBucketsThreadData(server,
+                                              _local_conn_pool,
+                                              buckets,
+                                              blind_add,
+                                              _global_stats,
+                                              conn_stat,
+                                              _rate_limiter,
+                                              _concurrency_controller,
+                                              backfill_date,
+                                              merge,
+                                              merge_rank);
+  job->start_time_ms = 0;
+
+  TRC_INFO("Queueing TAP of %s for %d buckets", server.c_str(), buckets.size());
+  pthread_mutex_lock(&_tap_lock);
+  _pending_taps.push_back(job);
+  pthread_cond_signal(&_tap_worker_cv);
+  pthread_mutex_unlock(&_tap_lock);
+}
+
+// Wait for at least one TAP to finish, and return the jobs of all those that
+// have.  There must be at least one TAP running.
+void Astaire::wait_for_taps(std::vector<TapJob*>& jobs)
+{
+  pthread_mutex_lock(&_tap_lock);
+  while (_completed_taps.empty())
   {
-    TRC_ERROR("Failed to create TAP thread (%d)", rc);
-    return false;
+    pthread_cond_wait(&_tap_cv, &_tap_lock);
   }
-  return true;
+  jobs.assign(_completed_taps.begin(), _completed_taps.end());
+  _completed_taps.clear();
+  pthread_mutex_unlock(&_tap_lock);
 }
 
-// Wait for a single TAP to complete.
+// Clean up after a TAP that has finished, and free its job.
 //
 // The return value of this function indicates whether the TAP succeeded or
-// failed.  The `tap_server` parameter is set to the identity of the tapped
-// server if the tap was successful.
-bool Astaire::complete_single_tap(pthread_t thread_id, std::string& tap_server)
+// failed.  The `tap_server` and `tap_buckets` parameters are set to the
+// identity of the tapped server and the vBuckets it was tapped for.
+bool Astaire::complete_single_tap(TapJob* job,
+                                  std::string& tap_server,
+                                  std::vector<uint16_t>& tap_buckets)
 {
-  TapBucketsThreadData* thread_data = NULL;
-  int rc = pthread_join(thread_id, (void**)&thread_data);
-
-  if (rc != 0)
-  {
-    TRC_ERROR("Failed to join TAP thread (%d)", rc);
-    return false;
-  }
-
-  if (thread_data == NULL)
-  {
-    TRC_ERROR("Logical Error: TAP thread returned NULL thread data");
-    exit(2);
-  }
-
+  TapBucketsThreadData* thread_data = job->thread_data;
   tap_server = thread_data->tap_server;
+  tap_buckets = thread_data->buckets;
   bool success = thread_data->success;
   delete thread_data; thread_data = NULL;
+  delete job; job = NULL;
   return success;
 }
 
@@ -766,15 +2606,14 @@ bool Astaire::owl_empty(const OutstandingWorkList& owl)
 // Must match the same function in https://github.com/Metaswitch/cpp-common/blob/master/src/memcachedstore.cpp.
 //
 // Should be removed once memcached can supply vbuckets on the TAP protocol.
-#include "libmemcached/memcached.h"
 uint16_t Astaire::vbucket_for_key(const std::string& key)
 {
-  // Hash the key and convert the hash to a vbucket.
-  int hash = memcached_generate_hash_value(key.data(),
-                                           key.length(),
-                                           MEMCACHED_HASH_MD5);
-  int vbucket = hash & (128 - 1);
-  return vbucket;
+  return vbucket_for_hash(VBucketHash::hash(key));
+}
+
+uint16_t Astaire::vbucket_for_hash(uint32_t hash)
+{
+  return VBucketHash::vbucket_for_hash(hash, 128);
 }
 
 // Poll the local memcached node to check if it is up-to-date or not (whether it
@@ -845,8 +2684,44 @@ bool Astaire::untag_local_memcached()
   return local_req_rsp(&del_req, NULL);
 }
 
+// Read one of the IDs Astaire keeps in the local memcached (the ID of the
+// resync in progress, or of the local data).
+// @return - Whether there is one.
+bool Astaire::read_local_marker(const std::string& key, std::string& id)
+{
+  Memcached::GetReq get_req(key, 0);
+  Memcached::BaseRsp* base_rsp;
+  if (!local_req_rsp(&get_req, &base_rsp))
+  {
+    return false;
+  }
+
+  Memcached::GetRsp* get_rsp = (Memcached::GetRsp*)base_rsp;
+  bool found = (get_rsp->result_code() == (uint8_t)Memcached::ResultCode::NO_ERROR);
+  if (found)
+  {
+    id = get_rsp->value();
+  }
+
+  delete get_rsp; get_rsp = NULL;
+  return found;
+}
+
+// Write one of the IDs Astaire keeps to the local memcached.
+// @return - Whether the write was successful.
+bool Astaire::write_local_marker(const std::string& key, const std::string& id)
+{
+  Memcached::SetReq set_req(key,
+                            vbucket_for_key(key),
+                            id,
+                            0,
+                            0);
+  return local_req_rsp(&set_req, NULL);
+}
+
 // Utility function for doing a request/response cycle to the local memcached
-// node.
+// node.  This uses a pooled connection, so normally costs just the request
+// and response.
 //
 // @param req     - The request to send. The caller retains ownership.
 // @param rsp_ptr - (out) The location to store a pointer to the received
@@ -862,43 +2737,61 @@ bool Astaire::untag_local_memcached()
 bool Astaire::local_req_rsp(Memcached::BaseReq* req,
                             Memcached::BaseRsp** rsp_ptr)
 {
-  // Create a connection to the local memcached.
-  Memcached::ClientConnection local_conn(_self);
-  int rc = local_conn.connect();
-  if (rc != 0)
+  Memcached::ClientConnection* local_conn = NULL;
+  Memcached::BaseMessage* base_msg = NULL;
+
+  // The pooled connection may have been closed by memcached (for example,
+  // because it restarted) since we last used it, so if the request fails try
+  // once more on a new connection.
+  for (int attempt = 0; attempt < 2; ++attempt)
   {
-    TRC_VERBOSE("Failed to connect to local server %s, error was (%d)",
-                _self.c_str(), rc);
-    return false;
-  }
+    local_conn = _local_conn_pool->get();
+    if (local_conn == NULL)
+    {
+      TRC_VERBOSE("Failed to connect to local server %s", _self.c_str());
+      return false;
+    }
 
-  // Send the request on the connection.
-  local_conn.send(*req);
+    // Send the request on the connection.
+    if ((local_conn->send(*req)) &&
+        (local_conn->recv(&base_msg) == Memcached::Status::OK))
+    {
+      break;
+    }
 
-  // Check we get the right response back.
-  Memcached::BaseMessage* base_msg = NULL;
-  Memcached::Status status = local_conn.recv(&base_msg);
-  if (status != Memcached::Status::OK)
-  {
     TRC_VERBOSE("Lost connection with local memcached instance");
     delete base_msg; base_msg = NULL;
+    _local_conn_pool->put(local_conn, false); local_conn = NULL;
+  }
+
+  if (local_conn == NULL)
+  {
     return false;
   }
 
+  // Check we get the right response back.
   if ((!base_msg->is_response()) ||
       (base_msg->op_code() != req->op_code()))
   {
     TRC_VERBOSE("Received unexpected message from local memcached instance (%x)",
                 base_msg->op_code());
     delete base_msg; base_msg = NULL;
+    _local_conn_pool->put(local_conn, false); local_conn = NULL;
     return false;
   }
 
+  _local_conn_pool->put(local_conn); local_conn = NULL;
+
   // If the caller cares about the response, give it to them.
   if (rsp_ptr != NULL)
   {
     *rsp_ptr = (Memcached::BaseRsp*)base_msg;
   }
+  else
+  {
+    delete base_msg; base_msg = NULL;
+  }
+
   return true;
 }
 
@@ -11,17 +11,24 @@
 
 #include "astaire_statistics.hpp"
 
+#include <algorithm>
 #include <vector>
 #include <string>
 
 void AstaireGlobalStatistics::refreshed()
 {
+  uint64_t keys;
+  uint64_t bytes;
+  total_counters(keys, bytes);
+
   std::vector<std::string> values;
   values.push_back(std::to_string(_total_buckets.load()));
   values.push_back(std::to_string(_resynced_bucket_count.load()));
-  values.push_back(std::to_string(_resynced_keys_count.load()));
-  values.push_back(std::to_string(_resynced_bytes_count.load()));
+  values.push_back(std::to_string(keys));
+  values.push_back(std::to_string(bytes));
   values.push_back(std::to_string(_bandwidth));
+  values.push_back(std::to_string(_concurrency_window.load()));
+  values.push_back(std::to_string(_local_latency_us.load()));
   _statistic.report_change(values);
 }
 
@@ -51,8 +58,14 @@ void AstaireGlobalStatistics::refresh(bool force)
 
 void AstaireGlobalStatistics::read(uint_fast64_t period_us)
 {
+  uint64_t keys;
+  uint64_t bytes;
+  total_counters(keys, bytes);
+
   uint_fast64_t period_s = period_us / (1000 * 1000);
-  uint_fast64_t bandwidth_raw = _bandwidth_raw.exchange(0);
+  uint_fast64_t bandwidth_raw = bytes - _last_bytes;
+  _last_bytes = bytes;
+
   if (period_s == 0)
   {
     _bandwidth = 0;
@@ -70,13 +83,61 @@ void AstaireGlobalStatistics::reset()
   // Use store(0) rather than zero_* so we don't call refresh till the end.
   _total_buckets.store(0);
   _resynced_bucket_count.store(0);
-  _resynced_keys_count.store(0);
-  _resynced_bytes_count.store(0);
-  _bandwidth_raw.store(0);
+
+  // The tap threads have all finished by the time the statistics are reset,
+  // so only the totals of the removed counters need zeroing.
+  pthread_mutex_lock(&_counters_lock);
+  _removed_keys = 0;
+  _removed_bytes = 0;
+  pthread_mutex_unlock(&_counters_lock);
+  _last_bytes = 0;
   _bandwidth = 0;
+
   refresh(true);
 }
 
+ResyncCounters* AstaireGlobalStatistics::add_counters()
+{
+  ResyncCounters* counters = new ResyncCounters();
+
+  pthread_mutex_lock(&_counters_lock);
+  _counters.push_back(counters);
+  pthread_mutex_unlock(&_counters_lock);
+
+  return counters;
+}
+
+void AstaireGlobalStatistics::remove_counters(ResyncCounters* counters)
+{
+  pthread_mutex_lock(&_counters_lock);
+  std::vector<ResyncCounters*>::iterator it =
+    std::find(_counters.begin(), _counters.end(), counters);
+  if (it != _counters.end())
+  {
+    _counters.erase(it);
+    _removed_keys += counters->keys();
+    _removed_bytes += counters->bytes();
+  }
+  pthread_mutex_unlock(&_counters_lock);
+
+  delete counters;
+}
+
+void AstaireGlobalStatistics::total_counters(uint64_t& keys, uint64_t& bytes)
+{
+  pthread_mutex_lock(&_counters_lock);
+  keys = _removed_keys;
+  bytes = _removed_bytes;
+  for (std::vector<ResyncCounters*>::const_iterator it = _counters.begin();
+       it != _counters.end();
+       ++it)
+  {
+    keys += (*it)->keys();
+    bytes += (*it)->bytes();
+  }
+  pthread_mutex_unlock(&_counters_lock);
+}
+
 void AstaireGlobalStatistics::thread_func()
 {
   pthread_mutex_lock(&_refresh_mutex);
@@ -91,6 +152,23 @@ void AstaireGlobalStatistics::thread_func()
   pthread_mutex_unlock(&_refresh_mutex);
 }
 
+void AstairePerConnectionStatistics::thread_func()
+{
+  pthread_mutex_lock(&_refresh_mutex);
+  while (!_terminated)
+  {
+    struct timespec next_refresh;
+    clock_gettime(CLOCK_MONOTONIC, &next_refresh);
+    next_refresh.tv_sec += 1;
+    pthread_cond_timedwait(&_refresh_cond, &_refresh_mutex, &next_refresh);
+
+    lock();
+    refresh(true);
+    unlock();
+  }
+  pthread_mutex_unlock(&_refresh_mutex);
+}
+
 void AstairePerConnectionStatistics::refreshed()
 {
   std::vector<std::string> values;
@@ -230,8 +308,11 @@ void AstairePerConnectionStatistics::BucketRecord::refresh(bool force)
 
 void AstairePerConnectionStatistics::BucketRecord::read(uint_fast64_t period_us)
 {
+  uint64_t bytes = _counters.bytes();
   uint_fast64_t period_s = period_us / (1000 * 1000);
-  uint_fast64_t bandwidth_raw = _bandwidth_raw.exchange(0);
+  uint_fast64_t bandwidth_raw = bytes - _last_bytes;
+  _last_bytes = bytes;
+
   if (period_s == 0)
   {
     _bandwidth = 0;
@@ -244,16 +325,17 @@ void AstairePerConnectionStatistics::BucketRecord::read(uint_fast64_t period_us)
 
 void AstairePerConnectionStatistics::BucketRecord::reset()
 {
-  _resynced_keys_count.store(0);
-  _resynced_bytes_count.store(0);
-  _bandwidth_raw.store(0);
+  // This is only called before the tap thread starts, so it can't race with
+  // the tap thread updating the counters.
+  _counters.reset();
+  _last_bytes = 0;
   _bandwidth = 0;
 }
 
 void AstairePerConnectionStatistics::BucketRecord::write_out(std::vector<std::string>& vec)
 {
   vec.push_back(std::to_string(bucket_id));
-  vec.push_back(std::to_string(_resynced_keys_count.load()));
-  vec.push_back(std::to_string(_resynced_bytes_count.load()));
+  vec.push_back(std::to_string(_counters.keys()));
+  vec.push_back(std::to_string(_counters.bytes()));
   vec.push_back(std::to_string(_bandwidth));
 }
@@ -0,0 +1,708 @@
+/**
+ * @file codec_bench.cpp - Microbenchmarks for the memcached binary codec
+ *
+ * Times the encode and decode paths in memcached_tap_client.cpp across a
+ * sweep of key sizes, value sizes and frames per receive buffer, reporting
+ * the time, throughput and heap allocations per operation for each.  The
+ * receive benchmarks run the whole Connection receive path over a local
+ * socket, comparing pooled messages with the original one-object-per-message
+ * path.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "memcached_tap_client.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <getopt.h>
+#include <new>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Allocation counting.  Every heap allocation in the process goes through
+// these, so the benchmarks can report allocations per operation.  The
+// benchmarks are single-threaded, so the counter doesn't need to be atomic.
+static uint64_t allocations = 0;
+
+void* operator new(size_t size)
+{
+  allocations++;
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+// Stop the compiler optimizing away work whose result isn't used.
+template <class T> static void do_not_optimize(const T& value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct Options
+{
+  const char* filter;
+  double min_time;
+};
+
+static Options options = { NULL, 0.2 };
+
+// A single benchmark.  `run` performs `iterations` rounds of the operation
+// being measured, each of which counts as `ops_per_round` operations on
+// `bytes_per_op` bytes.
+class Benchmark
+{
+public:
+  Benchmark(const std::string& name, size_t ops_per_round, size_t bytes_per_op) :
+    _name(name), _ops_per_round(ops_per_round), _bytes_per_op(bytes_per_op)
+  {}
+  virtual ~Benchmark() {}
+
+  virtual void run(size_t iterations) = 0;
+
+  void measure()
+  {
+    if ((options.filter != NULL) &&
+        (_name.find(options.filter) == std::string::npos))
+    {
+      return;
+    }
+
+    // Warm up, then keep doubling the number of rounds until a run takes
+    // long enough to time reliably.
+    run(1);
+
+    size_t iterations = 1;
+    double elapsed = 0;
+    uint64_t allocs = 0;
+
+    while (true)
+    {
+      uint64_t start_allocs = allocations;
+      double start = now();
+      run(iterations);
+      elapsed = now() - start;
+      allocs = allocations - start_allocs;
+
+      if ((elapsed >= options.min_time) || (iterations >= (1ul << 30)))
+      {
+        break;
+      }
+
+      iterations *= 2;
+    }
+
+    double ops = (double)iterations * _ops_per_round;
+    printf("%-48s %12.1f ns/op %10.1f MB/s %8.2f allocs/op\n",
+           _name.c_str(),
+           elapsed * 1e9 / ops,
+           ops * _bytes_per_op / elapsed / 1e6,
+           allocs / ops);
+  }
+
+private:
+  std::string _name;
+  size_t _ops_per_round;
+  size_t _bytes_per_op;
+};
+
+static std::string size_name(size_t size)
+{
+  if (size >= 1024 * 1024)
+  {
+    return std::to_string(size / (1024 * 1024)) + "M";
+  }
+  else if (size >= 1024)
+  {
+    return std::to_string(size / 1024) + "K";
+  }
+  return std::to_string(size);
+}
+
+// Build a TAP_MUTATE frame, as sent to Astaire by the memcached it is tapping.
+static std::string tap_mutate_frame(const std::string& key,
+                                    const std::string& value)
+{
+  const uint8_t extra_length = 16;
+  std::string frame;
+
+  Memcached::Utils::write((uint8_t)0x80, frame);
+  Memcached::Utils::write((uint8_t)Memcached::OpCode::TAP_MUTATE, frame);
+  Memcached::Utils::write((uint16_t)key.length(), frame);
+  Memcached::Utils::write(extra_length, frame);
+  Memcached::Utils::write((uint8_t)0, frame);
+  Memcached::Utils::write((uint16_t)0, frame);
+  Memcached::Utils::write((uint32_t)(extra_length + key.length() + value.length()), frame);
+  Memcached::Utils::write((uint32_t)0, frame);
+  Memcached::Utils::write((uint64_t)1, frame);
+
+  // Engine-specific length, TAP flags, TTL and reserved, then the flags
+  // and expiry.
+  Memcached::Utils::write((uint16_t)0, frame);
+  Memcached::Utils::write((uint16_t)0, frame);
+  Memcached::Utils::write((uint32_t)0, frame);
+  Memcached::Utils::write((uint32_t)12345, frame);
+  Memcached::Utils::write((uint32_t)300, frame);
+
+  frame.append(key);
+  frame.append(value);
+  return frame;
+}
+
+// Decode benchmarks run over a buffer holding a number of back-to-back
+// frames, as a receive buffer would after a large read.
+class DecodeBenchmark : public Benchmark
+{
+public:
+  DecodeBenchmark(const std::string& name,
+                  const std::string& frame,
+                  size_t frames) :
+    Benchmark(name, frames, frame.length()),
+    _buffer()
+  {
+    for (size_t ii = 0; ii < frames; ++ii)
+    {
+      _buffer.append(frame);
+    }
+  }
+
+protected:
+  std::string _buffer;
+};
+
+// Zero-copy decode into a view, as done by Connection::recv_batch.
+class ParseBenchmark : public DecodeBenchmark
+{
+public:
+  using DecodeBenchmark::DecodeBenchmark;
+
+  void run(size_t iterations)
+  {
+    Memcached::MsgView view;
+
+    for (size_t ii = 0; ii < iterations; ++ii)
+    {
+      size_t offset = 0;
+      while (Memcached::parse(_buffer.data() + offset,
+                              _buffer.length() - offset,
+                              view))
+      {
+        do_not_optimize(view);
+        offset += view.frame.length();
+      }
+    }
+  }
+};
+
+class IsMsgCompleteBenchmark : public DecodeBenchmark
+{
+public:
+  using DecodeBenchmark::DecodeBenchmark;
+
+  void run(size_t iterations)
+  {
+    bool request;
+    uint32_t body_length;
+    uint8_t op_code;
+
+    for (size_t ii = 0; ii < iterations; ++ii)
+    {
+      size_t offset = 0;
+      while (Memcached::is_msg_complete(_buffer.data() + offset,
+                                        _buffer.length() - offset,
+                                        request,
+                                        body_length,
+                                        op_code))
+      {
+        do_not_optimize(op_code);
+        offset += sizeof(Memcached::MsgHdr) + body_length;
+      }
+    }
+  }
+};
+
+// Decode into owned message objects.
+class FromWireBenchmark : public DecodeBenchmark
+{
+public:
+  using DecodeBenchmark::DecodeBenchmark;
+
+  void run(size_t iterations)
+  {
+    Memcached::MsgView view;
+
+    for (size_t ii = 0; ii < iterations; ++ii)
+    {
+      size_t offset = 0;
+      while (Memcached::parse(_buffer.data() + offset,
+                              _buffer.length() - offset,
+                              view))
+      {
+        Memcached::BaseMessage* msg = Memcached::from_wire(view);
+        do_not_optimize(msg);
+        delete msg;
+        offset += view.frame.length();
+      }
+    }
+  }
+};
+
+// The original string-consuming interface.  Each round starts from a fresh
+// copy of the buffer, which is included in the time.
+class FromWireStringBenchmark : public DecodeBenchmark
+{
+public:
+  using DecodeBenchmark::DecodeBenchmark;
+
+  void run(size_t iterations)
+  {
+    for (size_t ii = 0; ii < iterations; ++ii)
+    {
+      std::string buffer(_buffer);
+      Memcached::BaseMessage* msg;
+      while (Memcached::from_wire(buffer, msg))
+      {
+        do_not_optimize(msg);
+        delete msg;
+      }
+    }
+  }
+};
+
+// Receive benchmarks feed the frames through a socket from a second thread,
+// which only makes system calls (so doesn't allocate).  Each round is one
+// buffer's worth of frames.
+class ReceiveBenchmark : public DecodeBenchmark
+{
+public:
+  using DecodeBenchmark::DecodeBenchmark;
+
+  void run(size_t iterations)
+  {
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) != 0)
+    {
+      perror("socketpair");
+      exit(1);
+    }
+
+    _write_sock = socks[1];
+    _write_rounds = iterations;
+    pthread_t writer;
+    pthread_create(&writer, NULL, writer_thread, this);
+
+    size_t frames = iterations * (_buffer.length() / frame_length());
+    size_t received = receive(socks[0], frames);
+
+    pthread_join(writer, NULL);
+    ::close(socks[1]);
+
+    if (received != frames)
+    {
+      fprintf(stderr, "Received %lu of %lu frames\n", received, frames);
+      exit(1);
+    }
+  }
+
+protected:
+  // Receive and dispatch frames from the socket until there are no more,
+  // closing it when done.  Returns the number of frames received.
+  virtual size_t receive(int sock, size_t frames) = 0;
+
+private:
+  static void* writer_thread(void* data)
+  {
+    ReceiveBenchmark* benchmark = (ReceiveBenchmark*)data;
+    for (size_t ii = 0; ii < benchmark->_write_rounds; ++ii)
+    {
+      size_t offset = 0;
+      while (offset < benchmark->_buffer.length())
+      {
+        ssize_t sent = ::send(benchmark->_write_sock,
+                              benchmark->_buffer.data() + offset,
+                              benchmark->_buffer.length() - offset,
+                              0);
+        if (sent <= 0)
+        {
+          return NULL;
+        }
+        offset += sent;
+      }
+    }
+    ::shutdown(benchmark->_write_sock, SHUT_WR);
+    return NULL;
+  }
+
+  size_t frame_length() const
+  {
+    Memcached::MsgView view;
+    Memcached::parse(_buffer.data(), _buffer.length(), view);
+    return view.frame.length();
+  }
+
+  int _write_sock;
+  size_t _write_rounds;
+};
+
+// Receive batches of pooled messages, as Rogers and the Astaire tap threads
+// do, giving each back once it has been handled.
+class RecvBatchBenchmark : public ReceiveBenchmark
+{
+public:
+  using ReceiveBenchmark::ReceiveBenchmark;
+
+protected:
+  size_t receive(int sock, size_t frames)
+  {
+    Memcached::ServerConnection conn(sock, "bench");
+    std::vector<Memcached::Message*> msgs;
+    size_t received = 0;
+
+    while (conn.recv_batch(msgs) == Memcached::Status::OK)
+    {
+      for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+           it != msgs.end();
+           ++it)
+      {
+        do_not_optimize((*it)->key());
+        conn.release(*it);
+      }
+      received += msgs.size();
+      msgs.clear();
+    }
+
+    return received;
+  }
+};
+
+// Receive each message into a new object, with the BaseMessage interface
+// that remains on Connection.
+class RecvFromWireBenchmark : public ReceiveBenchmark
+{
+public:
+  using ReceiveBenchmark::ReceiveBenchmark;
+
+protected:
+  size_t receive(int sock, size_t frames)
+  {
+    Memcached::ServerConnection conn(sock, "bench");
+    Memcached::BaseMessage* msg;
+    size_t received = 0;
+
+    while (conn.recv(&msg) == Memcached::Status::OK)
+    {
+      do_not_optimize(msg);
+      delete msg;
+      received++;
+    }
+
+    return received;
+  }
+};
+
+// The original receive loop - reads appended to a string buffer, and each
+// message decoded into a new object by the string-consuming `from_wire`,
+// which erases it from the front of the buffer.
+class RecvFromWireStringBenchmark : public ReceiveBenchmark
+{
+public:
+  using ReceiveBenchmark::ReceiveBenchmark;
+
+protected:
+  size_t receive(int sock, size_t frames)
+  {
+    static const int BUFLEN = 16 * 1024;
+    char buf[BUFLEN];
+    std::string buffer;
+    size_t received = 0;
+
+    while (true)
+    {
+      Memcached::BaseMessage* msg;
+      if (Memcached::from_wire(buffer, msg))
+      {
+        do_not_optimize(msg);
+        delete msg;
+        received++;
+        continue;
+      }
+
+      ssize_t recv_size = ::recv(sock, buf, BUFLEN, 0);
+      if (recv_size <= 0)
+      {
+        break;
+      }
+      buffer.append(buf, recv_size);
+    }
+
+    ::close(sock);
+    return received;
+  }
+};
+
+// Encoding benchmarks take a message factory, so they can time construction
+// and serialization separately.
+template <class Factory>
+class ConstructBenchmark : public Benchmark
+{
+public:
+  ConstructBenchmark(const std::string& name, const Factory& factory, size_t bytes) :
+    Benchmark(name, 1, bytes), _factory(factory)
+  {}
+
+  void run(size_t iterations)
+  {
+    for (size_t ii = 0; ii < iterations; ++ii)
+    {
+      Memcached::BaseMessage* msg = _factory();
+      do_not_optimize(msg);
+      delete msg;
+    }
+  }
+
+private:
+  Factory _factory;
+};
+
+template <class Factory>
+class ToWireBenchmark : public Benchmark
+{
+public:
+  ToWireBenchmark(const std::string& name, const Factory& factory, size_t bytes) :
+    Benchmark(name, 1, bytes), _msg(factory())
+  {}
+
+  ~ToWireBenchmark()
+  {
+    delete _msg; _msg = NULL;
+  }
+
+  void run(size_t iterations)
+  {
+    Memcached::WireMsg wire;
+
+    for (size_t ii = 0; ii < iterations; ++ii)
+    {
+      _msg->to_wire(wire);
+      do_not_optimize(wire);
+    }
+  }
+
+private:
+  Memcached::BaseMessage* _msg;
+};
+
+template <class Factory>
+class ToWireStringBenchmark : public Benchmark
+{
+public:
+  ToWireStringBenchmark(const std::string& name, const Factory& factory, size_t bytes) :
+    Benchmark(name, 1, bytes), _msg(factory())
+  {}
+
+  ~ToWireStringBenchmark()
+  {
+    delete _msg; _msg = NULL;
+  }
+
+  void run(size_t iterations)
+  {
+    for (size_t ii = 0; ii < iterations; ++ii)
+    {
+      std::string wire = _msg->to_wire();
+      do_not_optimize(wire);
+    }
+  }
+
+private:
+  Memcached::BaseMessage* _msg;
+};
+
+struct GetRspFactory
+{
+  std::string key;
+  std::string value;
+  Memcached::BaseMessage* operator()() const
+  {
+    return new Memcached::GetRsp(0, 1, 2, value, 12345, key);
+  }
+};
+
+struct SetReqFactory
+{
+  std::string key;
+  std::string value;
+  Memcached::BaseMessage* operator()() const
+  {
+    return new Memcached::SetReq(key, 0, value, 12345, 300);
+  }
+};
+
+struct TapMutateFactory
+{
+  std::string frame;
+  Memcached::BaseMessage* operator()() const
+  {
+    Memcached::MsgView view;
+    Memcached::parse(frame.data(), frame.length(), view);
+    return new Memcached::TapMutateReq(view);
+  }
+};
+
+template <template <class> class B, class Factory>
+static void measure_encode(const std::string& name,
+                           const Factory& factory,
+                           size_t bytes)
+{
+  B<Factory> benchmark(name, factory, bytes);
+  benchmark.measure();
+}
+
+static void usage()
+{
+  printf("Usage: codec_bench [options]\n"
+         "\n"
+         " -f, --filter <string>    Only run benchmarks whose names contain this\n"
+         " -t, --min-time <secs>    Minimum time to run each benchmark for (default 0.2)\n"
+         " -h, --help               Show this help screen\n");
+}
+
+int main(int argc, char** argv)
+{
+  struct option long_opt[] =
+  {
+    {"filter",   required_argument, NULL, 'f'},
+    {"min-time", required_argument, NULL, 't'},
+    {"help",     no_argument,       NULL, 'h'},
+    {NULL,       0,                 NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "f:t:h", long_opt, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'f':
+      options.filter = optarg;
+      break;
+
+    case 't':
+      options.min_time = atof(optarg);
+      break;
+
+    case 'h':
+      usage();
+      return 0;
+
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  const size_t key_sizes[] = { 16, 64, 250 };
+  const size_t value_sizes[] = { 16, 256, 4096, 65536, 1024 * 1024 };
+  const size_t frame_counts[] = { 1, 16, 256 };
+
+  // Don't build decode buffers bigger than this.
+  const size_t MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+
+  for (size_t key_size : key_sizes)
+  {
+    for (size_t value_size : value_sizes)
+    {
+      std::string key(key_size, 'k');
+      std::string value(value_size, 'v');
+      std::string frame = tap_mutate_frame(key, value);
+      std::string suffix = "/key:" + size_name(key_size) +
+                           "/value:" + size_name(value_size);
+
+      for (size_t frames : frame_counts)
+      {
+        if (frames * frame.length() > MAX_BUFFER_SIZE)
+        {
+          continue;
+        }
+
+        std::string decode_suffix = suffix + "/frames:" + std::to_string(frames);
+
+        ParseBenchmark("parse" + decode_suffix, frame, frames).measure();
+        IsMsgCompleteBenchmark("is_msg_complete" + decode_suffix, frame, frames).measure();
+        FromWireBenchmark("from_wire" + decode_suffix, frame, frames).measure();
+        FromWireStringBenchmark("from_wire_string" + decode_suffix, frame, frames).measure();
+        RecvBatchBenchmark("recv_batch" + decode_suffix, frame, frames).measure();
+        RecvFromWireBenchmark("recv/from_wire" + decode_suffix, frame, frames).measure();
+        RecvFromWireStringBenchmark("recv/from_wire_string" + decode_suffix, frame, frames).measure();
+      }
+
+      GetRspFactory get_rsp = { key, value };
+      SetReqFactory set_req = { key, value };
+      TapMutateFactory tap_mutate = { frame };
+      size_t bytes = frame.length();
+
+      measure_encode<ConstructBenchmark>("GetRsp()" + suffix, get_rsp, bytes);
+      measure_encode<ConstructBenchmark>("SetAddReplaceReq()" + suffix, set_req, bytes);
+      measure_encode<ConstructBenchmark>("TapMutateReq()" + suffix, tap_mutate, bytes);
+      measure_encode<ToWireBenchmark>("to_wire/GetRsp" + suffix, get_rsp, bytes);
+      measure_encode<ToWireBenchmark>("to_wire/SetReq" + suffix, set_req, bytes);
+      measure_encode<ToWireStringBenchmark>("to_wire_string/GetRsp" + suffix, get_rsp, bytes);
+      measure_encode<ToWireStringBenchmark>("to_wire_string/SetReq" + suffix, set_req, bytes);
+    }
+
+    // The requests Rogers receives.
+    std::string get_frame = Memcached::GetReq(std::string(key_size, 'k'), 1).to_wire();
+    for (size_t frames : frame_counts)
+    {
+      std::string get_suffix = "/GetReq/key:" + size_name(key_size) +
+                               "/frames:" + std::to_string(frames);
+
+      RecvBatchBenchmark("recv_batch" + get_suffix, get_frame, frames).measure();
+      RecvFromWireBenchmark("recv/from_wire" + get_suffix, get_frame, frames).measure();
+      RecvFromWireStringBenchmark("recv/from_wire_string" + get_suffix, get_frame, frames).measure();
+    }
+  }
+
+  return 0;
+}
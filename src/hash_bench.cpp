@@ -0,0 +1,243 @@
+/**
+ * @file hash_bench.cpp - Benchmark for vbucket hashing
+ *
+ * Checks that every implementation of VBucketHash gives the same hashes as
+ * libmemcached's MD5 hash, and then times each of them hashing batches of
+ * keys of various sizes, reporting the speedup over hashing the keys one at a
+ * time with libmemcached.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "vbucket_hash.hpp"
+
+extern "C" {
+#include <libmemcached/memcached.h>
+}
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <getopt.h>
+
+struct Options
+{
+  int batch_size;
+  int rounds;
+};
+
+static const VBucketHash::Implementation IMPLEMENTATIONS[] =
+{
+  VBucketHash::Implementation::SCALAR,
+  VBucketHash::Implementation::SSE2,
+  VBucketHash::Implementation::AVX2
+};
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string random_key(size_t length)
+{
+  std::string key(length, '\0');
+  for (size_t ii = 0; ii < length; ++ii)
+  {
+    key[ii] = (char)(rand() & 0xff);
+  }
+  return key;
+}
+
+static uint32_t reference_hash(const std::string& key)
+{
+  return memcached_generate_hash_value(key.data(), key.length(), MEMCACHED_HASH_MD5);
+}
+
+// Check every implementation against libmemcached, for keys of every length
+// up to a little over memcached's limit, in batches of various sizes (so that
+// every arrangement of keys into SIMD lanes is covered).
+static bool check_parity()
+{
+  std::vector<std::string> keys;
+  for (size_t length = 0; length <= 320; ++length)
+  {
+    for (int ii = 0; ii < 3; ++ii)
+    {
+      keys.push_back(random_key(length));
+    }
+  }
+
+  std::vector<uint32_t> expected(keys.size());
+  for (size_t ii = 0; ii < keys.size(); ++ii)
+  {
+    expected[ii] = reference_hash(keys[ii]);
+
+    if (VBucketHash::hash(keys[ii]) != expected[ii])
+    {
+      printf("Parity FAILED for single key of length %zu\n", keys[ii].length());
+      return false;
+    }
+  }
+
+  std::vector<boost::string_ref> refs(keys.begin(), keys.end());
+  const size_t batch_sizes[] = { 1, 3, 4, 7, 8, 9, 31, keys.size() };
+
+  for (VBucketHash::Implementation impl : IMPLEMENTATIONS)
+  {
+    if (!VBucketHash::is_supported(impl))
+    {
+      continue;
+    }
+
+    for (size_t batch_size : batch_sizes)
+    {
+      std::vector<uint32_t> hashes(keys.size());
+      for (size_t start = 0; start < keys.size(); start += batch_size)
+      {
+        size_t count = std::min(batch_size, keys.size() - start);
+        VBucketHash::hash_batch(&refs[start], count, &hashes[start], impl);
+      }
+
+      for (size_t ii = 0; ii < keys.size(); ++ii)
+      {
+        if (hashes[ii] != expected[ii])
+        {
+          printf("Parity FAILED for %s with batches of %zu (key of length %zu)\n",
+                 VBucketHash::implementation_name(impl),
+                 batch_size,
+                 keys[ii].length());
+          return false;
+        }
+      }
+    }
+  }
+
+  printf("Parity OK for %zu keys\n", keys.size());
+  return true;
+}
+
+static void run_benchmark(size_t key_length, const Options& options)
+{
+  std::vector<std::string> keys;
+  for (int ii = 0; ii < options.batch_size; ++ii)
+  {
+    keys.push_back(random_key(key_length));
+  }
+  std::vector<boost::string_ref> refs(keys.begin(), keys.end());
+  std::vector<uint32_t> hashes(keys.size());
+
+  double total_keys = (double)options.rounds * keys.size();
+  uint32_t sink = 0;
+
+  double start = now();
+  for (int round = 0; round < options.rounds; ++round)
+  {
+    for (size_t ii = 0; ii < keys.size(); ++ii)
+    {
+      sink += reference_hash(keys[ii]);
+    }
+  }
+  double reference_ns = (now() - start) * 1e9 / total_keys;
+
+  printf("%4zu byte keys  %-12s %8.1f ns/key\n", key_length, "libmemcached", reference_ns);
+
+  for (VBucketHash::Implementation impl : IMPLEMENTATIONS)
+  {
+    if (!VBucketHash::is_supported(impl))
+    {
+      continue;
+    }
+
+    start = now();
+    for (int round = 0; round < options.rounds; ++round)
+    {
+      VBucketHash::hash_batch(refs.data(), refs.size(), hashes.data(), impl);
+      sink += hashes[0];
+    }
+    double ns = (now() - start) * 1e9 / total_keys;
+
+    printf("%4zu byte keys  %-12s %8.1f ns/key %6.2fx\n",
+           key_length,
+           VBucketHash::implementation_name(impl),
+           ns,
+           reference_ns / ns);
+  }
+
+  // Stop the compiler throwing the hashing away.
+  if (sink == 1)
+  {
+    printf("\n");
+  }
+}
+
+static void usage()
+{
+  printf("Usage: hash_bench [options]\n"
+         "\n"
+         " -b, --batch-size <n>     Number of keys hashed in each batch (default 64)\n"
+         " -r, --rounds <n>         Number of batches to hash (default 20000)\n"
+         " -h, --help               Show this help screen\n");
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  options.batch_size = 64;
+  options.rounds = 20000;
+
+  struct option long_opt[] =
+  {
+    {"batch-size", required_argument, NULL, 'b'},
+    {"rounds",     required_argument, NULL, 'r'},
+    {"help",       no_argument,       NULL, 'h'},
+    {NULL,         0,                 NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:r:h", long_opt, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      options.batch_size = atoi(optarg);
+      break;
+
+    case 'r':
+      options.rounds = atoi(optarg);
+      break;
+
+    case 'h':
+      usage();
+      return 0;
+
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (!check_parity())
+  {
+    return 1;
+  }
+
+  printf("Best implementation is %s, batches of %d keys\n",
+         VBucketHash::implementation_name(VBucketHash::best_implementation()),
+         options.batch_size);
+
+  const size_t key_lengths[] = { 16, 48, 64, 128, 250 };
+  for (size_t key_length : key_lengths)
+  {
+    run_benchmark(key_length, options);
+  }
+
+  return 0;
+}
@@ -0,0 +1,441 @@
+/**
+ * @file io_bench.cpp - Benchmark for the memcached connection I/O paths
+ *
+ * Runs a simple GET server on loopback using each of the connection I/O
+ * paths in turn - a blocking thread per connection, the epoll event loop and
+ * (if built in and supported by the kernel) the io_uring event loop - and
+ * drives it from a fixed set of pipelining clients.  For each path
+ * it reports the throughput and the number of system calls the server made
+ * per operation.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "memcached_tap_client.hpp"
+#include "memcached_event_loop.hpp"
+#ifdef HAVE_IO_URING
+#include "memcached_uring_event_loop.hpp"
+#endif
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// System call counting.  The socket calls the connection layer makes are
+// intercepted here, and counted if they are made on a server thread.
+static std::atomic<uint64_t> server_syscalls(0);
+static __thread bool is_server_thread = false;
+
+static void count_syscall()
+{
+  if (is_server_thread)
+  {
+    server_syscalls.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+extern "C" ssize_t recv(int sock, void* buf, size_t len, int flags)
+{
+  typedef ssize_t (*fn_t)(int, void*, size_t, int);
+  static fn_t real = (fn_t)dlsym(RTLD_NEXT, "recv");
+  count_syscall();
+  return real(sock, buf, len, flags);
+}
+
+extern "C" ssize_t send(int sock, const void* buf, size_t len, int flags)
+{
+  typedef ssize_t (*fn_t)(int, const void*, size_t, int);
+  static fn_t real = (fn_t)dlsym(RTLD_NEXT, "send");
+  count_syscall();
+  return real(sock, buf, len, flags);
+}
+
+extern "C" ssize_t sendmsg(int sock, const struct msghdr* msg, int flags)
+{
+  typedef ssize_t (*fn_t)(int, const struct msghdr*, int);
+  static fn_t real = (fn_t)dlsym(RTLD_NEXT, "sendmsg");
+  count_syscall();
+  return real(sock, msg, flags);
+}
+
+extern "C" int epoll_wait(int epfd, struct epoll_event* events, int max, int timeout)
+{
+  typedef int (*fn_t)(int, struct epoll_event*, int, int);
+  static fn_t real = (fn_t)dlsym(RTLD_NEXT, "epoll_wait");
+  count_syscall();
+  return real(epfd, events, max, timeout);
+}
+
+struct Options
+{
+  int connections;
+  int window;
+  int ops;
+  int value_size;
+};
+
+class BenchServerConnection : public Memcached::ServerConnection
+{
+public:
+  BenchServerConnection(int sock) : Memcached::ServerConnection(sock, "client") {}
+};
+
+static std::string value;
+
+// Answer every GET in a batch of requests.
+static bool serve_batch(Memcached::Connection* conn,
+                        std::vector<Memcached::Message*>& msgs)
+{
+  bool ok = true;
+
+  for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+       it != msgs.end();
+       ++it)
+  {
+    Memcached::GetRsp rsp((uint16_t)Memcached::ResultCode::NO_ERROR,
+                          (*it)->opaque(),
+                          0,
+                          value,
+                          0);
+    ok = ok && conn->send(rsp);
+    conn->release(*it);
+  }
+
+  msgs.clear();
+  return ok;
+}
+
+class ServerHandler : public Memcached::EventLoop::Handler
+{
+public:
+  ServerHandler(Memcached::EventLoop* loop) : _loop(loop), _msgs() {}
+
+  virtual void on_readable(Memcached::Connection* conn)
+  {
+    Memcached::Status status = conn->recv_batch(_msgs);
+
+    if (status == Memcached::Status::OK)
+    {
+      serve_batch(conn, _msgs);
+    }
+    else if (status != Memcached::Status::WOULD_BLOCK)
+    {
+      _loop->remove(conn);
+    }
+  }
+
+  virtual void on_error(Memcached::Connection* conn, Memcached::Status status)
+  {
+    _loop->remove(conn);
+  }
+
+private:
+  Memcached::EventLoop* _loop;
+  std::vector<Memcached::Message*> _msgs;
+};
+
+static void* blocking_server_thread(void* data)
+{
+  is_server_thread = true;
+
+  Memcached::Connection* conn = (Memcached::Connection*)data;
+  std::vector<Memcached::Message*> msgs;
+
+  while (conn->recv_batch(msgs) == Memcached::Status::OK)
+  {
+    if (!serve_batch(conn, msgs))
+    {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void* loop_server_thread(void* data)
+{
+  is_server_thread = true;
+  ((Memcached::EventLoop*)data)->run();
+  return NULL;
+}
+
+struct ClientData
+{
+  int port;
+  const Options* options;
+  bool success;
+};
+
+// Keep `window` GETs in flight until `ops` have been answered.
+static void* client_thread(void* data)
+{
+  ClientData* client = (ClientData*)data;
+  Memcached::ClientConnection conn("127.0.0.1:" + std::to_string(client->port));
+  client->success = false;
+
+  if (conn.connect() != 0)
+  {
+    return NULL;
+  }
+
+  int sent = 0;
+  int received = 0;
+  std::vector<Memcached::Message*> msgs;
+
+  while ((sent < client->options->window) && (sent < client->options->ops))
+  {
+    conn.send(Memcached::GetReq("key" + std::to_string(sent), sent));
+    sent++;
+  }
+
+  while (received < client->options->ops)
+  {
+    if (conn.recv_batch(msgs) != Memcached::Status::OK)
+    {
+      return NULL;
+    }
+
+    for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+         it != msgs.end();
+         ++it)
+    {
+      received++;
+      conn.release(*it);
+
+      if (sent < client->options->ops)
+      {
+        conn.send(Memcached::GetReq("key" + std::to_string(sent), sent));
+        sent++;
+      }
+    }
+
+    msgs.clear();
+  }
+
+  client->success = true;
+  return NULL;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run one benchmark.  `loop` is the event loop for the server to use, or NULL
+// to use a blocking thread per connection.
+static void run_benchmark(const char* name,
+                          Memcached::EventLoop* loop,
+                          const Options& options)
+{
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+
+  if ((bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+      (getsockname(listener, (struct sockaddr*)&addr, &addr_len) < 0) ||
+      (listen(listener, options.connections) < 0))
+  {
+    fprintf(stderr, "Failed to set up listening socket\n");
+    exit(1);
+  }
+
+  std::vector<ClientData> clients(options.connections);
+  std::vector<pthread_t> client_threads(options.connections);
+  std::vector<BenchServerConnection*> server_conns;
+  std::vector<pthread_t> server_threads;
+  ServerHandler handler(loop);
+
+  double start = now();
+  server_syscalls = 0;
+
+  for (int ii = 0; ii < options.connections; ++ii)
+  {
+    clients[ii].port = ntohs(addr.sin_port);
+    clients[ii].options = &options;
+    pthread_create(&client_threads[ii], NULL, client_thread, &clients[ii]);
+
+    BenchServerConnection* conn = new BenchServerConnection(accept(listener, NULL, NULL));
+    server_conns.push_back(conn);
+
+    if (loop != NULL)
+    {
+      conn->set_nonblocking();
+      loop->add(conn, &handler);
+    }
+    else
+    {
+      pthread_t thread;
+      pthread_create(&thread, NULL, blocking_server_thread, conn);
+      server_threads.push_back(thread);
+    }
+  }
+
+  if (loop != NULL)
+  {
+    pthread_t thread;
+    pthread_create(&thread, NULL, loop_server_thread, loop);
+    server_threads.push_back(thread);
+  }
+
+  bool success = true;
+  for (int ii = 0; ii < options.connections; ++ii)
+  {
+    pthread_join(client_threads[ii], NULL);
+    success = success && clients[ii].success;
+  }
+
+  double elapsed = now() - start;
+
+  if (loop != NULL)
+  {
+    loop->stop();
+  }
+
+  for (std::vector<pthread_t>::iterator it = server_threads.begin();
+       it != server_threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  uint64_t syscalls = server_syscalls;
+#ifdef HAVE_IO_URING
+  Memcached::UringEventLoop* uring_loop = dynamic_cast<Memcached::UringEventLoop*>(loop);
+  if (uring_loop != NULL)
+  {
+    syscalls += uring_loop->ring_enters();
+  }
+#endif
+
+  for (std::vector<BenchServerConnection*>::iterator it = server_conns.begin();
+       it != server_conns.end();
+       ++it)
+  {
+    if (loop != NULL)
+    {
+      loop->remove(*it);
+    }
+    delete *it;
+  }
+  close(listener);
+
+  double total_ops = (double)options.connections * options.ops;
+  printf("%-10s %12.0f ops/s %10.3f syscalls/op%s\n",
+         name,
+         total_ops / elapsed,
+         syscalls / total_ops,
+         success ? "" : "  (FAILED)");
+}
+
+static void usage()
+{
+  printf("Usage: io_bench [options]\n"
+         "\n"
+         " -c, --connections <n>    Number of client connections (default 8)\n"
+         " -w, --window <n>         Requests in flight per connection (default 16)\n"
+         " -n, --ops <n>            Requests per connection (default 50000)\n"
+         " -s, --value-size <n>     Size of each value in bytes (default 100)\n"
+         " -h, --help               Show this help screen\n");
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  options.connections = 8;
+  options.window = 16;
+  options.ops = 50000;
+  options.value_size = 100;
+
+  struct option long_opt[] =
+  {
+    {"connections", required_argument, NULL, 'c'},
+    {"window",      required_argument, NULL, 'w'},
+    {"ops",         required_argument, NULL, 'n'},
+    {"value-size",  required_argument, NULL, 's'},
+    {"help",        no_argument,       NULL, 'h'},
+    {NULL,          0,                 NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:w:n:s:h", long_opt, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      options.connections = atoi(optarg);
+      break;
+
+    case 'w':
+      options.window = atoi(optarg);
+      break;
+
+    case 'n':
+      options.ops = atoi(optarg);
+      break;
+
+    case 's':
+      options.value_size = atoi(optarg);
+      break;
+
+    case 'h':
+      usage();
+      return 0;
+
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  value.assign(options.value_size, 'x');
+
+  printf("%d connections, %d requests in flight each, %d byte values\n",
+         options.connections,
+         options.window,
+         options.value_size);
+
+  run_benchmark("blocking", NULL, options);
+
+  Memcached::EpollEventLoop epoll_loop;
+  if (epoll_loop.init())
+  {
+    run_benchmark("epoll", &epoll_loop, options);
+  }
+
+#ifdef HAVE_IO_URING
+  if (Memcached::UringEventLoop::is_supported())
+  {
+    Memcached::UringEventLoop uring_loop;
+    if (uring_loop.init())
+    {
+      run_benchmark("io_uring", &uring_loop, options);
+    }
+  }
+  else
+  {
+    printf("io_uring not supported by this kernel\n");
+  }
+#else
+  printf("io_uring support not built in\n");
+#endif
+
+  return 0;
+}
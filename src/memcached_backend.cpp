@@ -30,6 +30,7 @@
 #include "updater.h"
 #include "memcachedstoreview.h"
 #include "memcached_backend.hpp"
+#include "vbucket_hash.hpp"
 
 
 MemcachedBackend::MemcachedBackend(MemcachedConfigReader* config_reader,
@@ -133,8 +134,8 @@ void MemcachedBackend::update_config()
 int MemcachedBackend::vbucket_for_key(const std::string& key)
 {
   // Hash the key and convert the hash to a vbucket.
-  int hash = memcached_generate_hash_value(key.data(), key.length(), MEMCACHED_HASH_MD5);
-  int vbucket = hash & (_vbuckets - 1);
+  uint32_t hash = VBucketHash::hash(key);
+  int vbucket = VBucketHash::vbucket_for_hash(hash, _vbuckets);
   TRC_DEBUG("Key %s hashes to vbucket %d via hash 0x%x", key.c_str(), vbucket, hash);
   return vbucket;
 }
@@ -397,6 +398,152 @@ Memcached::ResultCode MemcachedBackend::read_data(const std::string& key,
 }
 
 
+void MemcachedBackend::read_data_multi(const std::vector<std::string>& keys,
+                                       std::vector<Memcached::ResultCode>& statuses,
+                                       std::vector<std::string>& data,
+                                       std::vector<uint64_t>& cas)
+{
+  statuses.assign(keys.size(), Memcached::ResultCode::TEMPORARY_FAILURE);
+  data.assign(keys.size(), std::string());
+  cas.assign(keys.size(), 0);
+
+  // Hash all the keys together.
+  std::vector<int> vbuckets;
+  VBucketHash::vbuckets_for_keys(keys, _vbuckets, vbuckets);
+
+  // The state of each key, as in read_data.  Keys are read from each of their
+  // replicas in turn until they're found.  Any key whose batch hits a
+  // connection failure is read on its own instead, so it gets read_data's
+  // retry.
+  std::vector<std::vector<AddrInfo> > replica_addresses(keys.size());
+  std::vector<bool> found(keys.size(), false);
+  std::vector<bool> read_singly(keys.size(), false);
+  std::vector<bool> active_not_found(keys.size(), false);
+  std::vector<size_t> failed_replicas(keys.size(), 0);
+  size_t max_replicas = 0;
+
+  for (size_t ii = 0; ii < keys.size(); ++ii)
+  {
+    replica_addresses[ii] = get_replica_addresses(vbuckets[ii], Op::READ);
+    max_replicas = std::max(max_replicas, replica_addresses[ii].size());
+  }
+
+  for (size_t replica_idx = 0; replica_idx < max_replicas; ++replica_idx)
+  {
+    // Group the keys still to find by the replica we'd read them from next,
+    // so we can fetch each group with a single request.
+    std::map<std::string, AddrInfo> replicas;
+    std::map<std::string, std::vector<size_t> > keys_by_replica;
+
+    for (size_t ii = 0; ii < keys.size(); ++ii)
+    {
+      if ((!found[ii]) &&
+          (!read_singly[ii]) &&
+          (replica_idx < replica_addresses[ii].size()))
+      {
+        const AddrInfo& address = replica_addresses[ii][replica_idx];
+        std::string replica = address.address_and_port_to_string();
+        replicas[replica] = address;
+        keys_by_replica[replica].push_back(ii);
+      }
+    }
+
+    for (std::map<std::string, std::vector<size_t> >::const_iterator group = keys_by_replica.begin();
+         group != keys_by_replica.end();
+         ++group)
+    {
+      const std::vector<size_t>& indexes = group->second;
+
+      ConnectionHandle<memcached_st*> conn_handle =
+                               _conn_pool->get_connection(replicas[group->first]);
+      memcached_st* conn = conn_handle.get_connection();
+
+      TRC_DEBUG("Batch read of %d keys from replica %d (%s, connection %p)",
+                indexes.size(),
+                replica_idx,
+                group->first.c_str(),
+                conn);
+
+      memcached_return_t rc = get_batch_from_replica(conn,
+                                                     keys,
+                                                     indexes,
+                                                     found,
+                                                     data,
+                                                     cas);
+
+      for (std::vector<size_t>::const_iterator idx = indexes.begin();
+           idx != indexes.end();
+           ++idx)
+      {
+        if (found[*idx])
+        {
+          // Reset the CAS value if an earlier active replica didn't have the
+          // record, as read_data does.
+          if (active_not_found[*idx])
+          {
+            cas[*idx] = 0;
+          }
+        }
+        else if (memcached_success(rc))
+        {
+          // The batch completed without this key, so it isn't on this
+          // replica.
+          active_not_found[*idx] = true;
+        }
+        else if (rc == MEMCACHED_CONNECTION_FAILURE)
+        {
+          read_singly[*idx] = true;
+        }
+        else
+        {
+          ++failed_replicas[*idx];
+        }
+      }
+
+      if (!memcached_success(rc))
+      {
+        TRC_DEBUG("Batch read from replica %s returned error %d (%s)",
+                  group->first.c_str(),
+                  rc,
+                  memcached_strerror(conn, rc));
+      }
+    }
+  }
+
+  for (size_t ii = 0; ii < keys.size(); ++ii)
+  {
+    if (read_singly[ii])
+    {
+      statuses[ii] = read_data(keys[ii], data[ii], cas[ii]);
+    }
+    else if ((found[ii]) ||
+             (failed_replicas[ii] < replica_addresses[ii].size()))
+    {
+      // The key was found, or at least one replica returned NOT_FOUND.
+      statuses[ii] = found[ii] ? Memcached::ResultCode::NO_ERROR :
+                                 Memcached::ResultCode::KEY_NOT_FOUND;
+      update_vbucket_comm_state(vbuckets[ii], OK);
+
+      if (_comm_monitor)
+      {
+        _comm_monitor->inform_success();
+      }
+    }
+    else
+    {
+      TRC_VERBOSE("Failed to read data for %s from %d replicas",
+                  keys[ii].c_str(), replica_addresses[ii].size());
+      statuses[ii] = Memcached::ResultCode::TEMPORARY_FAILURE;
+      update_vbucket_comm_state(vbuckets[ii], FAILED);
+
+      if (_comm_monitor)
+      {
+        _comm_monitor->inform_failure();
+      }
+    }
+  }
+}
+
 Memcached::ResultCode MemcachedBackend::write_data(Memcached::OpCode operation,
                                                    const std::string& key,
                                                    const std::string& data,
@@ -710,6 +857,74 @@ memcached_return_t MemcachedBackend::get_from_replica(memcached_st* replica,
   return rc;
 }
 
+memcached_return_t MemcachedBackend::get_batch_from_replica(memcached_st* replica,
+                                                            const std::vector<std::string>& keys,
+                                                            const std::vector<size_t>& indexes,
+                                                            std::vector<bool>& found,
+                                                            std::vector<std::string>& data,
+                                                            std::vector<uint64_t>& cas)
+{
+  std::vector<const char*> key_ptrs;
+  std::vector<size_t> key_lens;
+
+  // A client may ask for the same key more than once, so map each key to
+  // every position it appears at.
+  std::map<std::string, std::vector<size_t> > positions;
+
+  for (std::vector<size_t>::const_iterator idx = indexes.begin();
+       idx != indexes.end();
+       ++idx)
+  {
+    std::vector<size_t>& key_positions = positions[keys[*idx]];
+    if (key_positions.empty())
+    {
+      key_ptrs.push_back(keys[*idx].data());
+      key_lens.push_back(keys[*idx].length());
+    }
+    key_positions.push_back(*idx);
+  }
+
+  memcached_return_t rc = memcached_mget(replica,
+                                         key_ptrs.data(),
+                                         key_lens.data(),
+                                         key_ptrs.size());
+  if (!memcached_success(rc))
+  {
+    return rc;
+  }
+
+  // Only the keys that were found come back.  The fetch ends with
+  // MEMCACHED_END once they all have, or an error if the request failed.
+  memcached_result_st result;
+  memcached_result_create(replica, &result);
+
+  while (memcached_fetch_result(replica, &result, &rc) != NULL)
+  {
+    std::string key(memcached_result_key_value(&result),
+                    memcached_result_key_length(&result));
+    std::map<std::string, std::vector<size_t> >::const_iterator key_positions =
+                                                           positions.find(key);
+    if (key_positions == positions.end())
+    {
+      continue;
+    }
+
+    for (std::vector<size_t>::const_iterator idx = key_positions->second.begin();
+         idx != key_positions->second.end();
+         ++idx)
+    {
+      data[*idx].assign(memcached_result_value(&result),
+                        memcached_result_length(&result));
+      cas[*idx] = memcached_result_cas(&result);
+      found[*idx] = true;
+    }
+  }
+
+  memcached_result_free(&result);
+
+  return ((rc == MEMCACHED_END) || (rc == MEMCACHED_NOTFOUND)) ? MEMCACHED_SUCCESS : rc;
+}
+
 Memcached::ResultCode
 MemcachedBackend::libmemcached_result_to_memcache_status(memcached_return_t rc)
 {
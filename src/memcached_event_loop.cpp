@@ -0,0 +1,349 @@
+/**
+ * @file memcached_event_loop.cpp - event loops for memcached connections.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "memcached_event_loop.hpp"
+#ifdef HAVE_IO_URING
+#include "memcached_uring_event_loop.hpp"
+#endif
+#include "log.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+Memcached::EventLoop* Memcached::EventLoop::create()
+{
+#ifdef HAVE_IO_URING
+  if (UringEventLoop::is_supported())
+  {
+    EventLoop* loop = new UringEventLoop();
+    if (loop->init())
+    {
+      TRC_STATUS("Using io_uring event loop");
+      return loop;
+    }
+
+    TRC_STATUS("Failed to set up io_uring event loop - falling back to epoll");
+    delete loop; loop = NULL;
+  }
+#endif
+
+  EventLoop* loop = new EpollEventLoop();
+  if (!loop->init())
+  {
+    delete loop; loop = NULL;
+  }
+
+  return loop;
+}
+
+void Memcached::EventLoop::run()
+{
+  _stopped = false;
+
+  while (!_stopped)
+  {
+    if (poll(-1) < 0)
+    {
+      break;
+    }
+  }
+}
+
+Memcached::EpollEventLoop::EpollEventLoop() :
+  EventLoop(),
+  _epoll_fd(-1),
+  _stop_fd(-1),
+  _registrations(),
+  _removed()
+{
+}
+
+Memcached::EpollEventLoop::~EpollEventLoop()
+{
+  for (std::map<Connection*, Registration*>::iterator it = _registrations.begin();
+       it != _registrations.end();
+       ++it)
+  {
+    delete it->second; it->second = NULL;
+  }
+
+  for (std::vector<Registration*>::iterator it = _removed.begin();
+       it != _removed.end();
+       ++it)
+  {
+    delete *it; *it = NULL;
+  }
+
+  if (_stop_fd != -1)
+  {
+    ::close(_stop_fd); _stop_fd = -1;
+  }
+
+  if (_epoll_fd != -1)
+  {
+    ::close(_epoll_fd); _epoll_fd = -1;
+  }
+}
+
+bool Memcached::EpollEventLoop::init()
+{
+  _epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+  if (_epoll_fd < 0)
+  {
+    int err = errno;
+    TRC_ERROR("Failed to create epoll instance (%d: %s)", err, ::strerror(err));
+    return false;
+  }
+
+  _stop_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_stop_fd < 0)
+  {
+    int err = errno;
+    TRC_ERROR("Failed to create eventfd (%d: %s)", err, ::strerror(err));
+    return false;
+  }
+
+  // The stop eventfd is the only descriptor registered without a
+  // Registration, so it is identified by a NULL data pointer.
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+
+  if (::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _stop_fd, &ev) < 0)
+  {
+    int err = errno;
+    TRC_ERROR("Failed to watch eventfd (%d: %s)", err, ::strerror(err));
+    return false;
+  }
+
+  return true;
+}
+
+bool Memcached::EpollEventLoop::add(Connection* conn, Handler* handler)
+{
+  if (conn->fd() < 0)
+  {
+    TRC_ERROR("Cannot watch connection to %s as it is not connected",
+              conn->address().c_str());
+    return false;
+  }
+
+  if (!conn->is_nonblocking())
+  {
+    TRC_ERROR("Cannot watch connection to %s as it is in blocking mode",
+              conn->address().c_str());
+    return false;
+  }
+
+  Registration* reg = new Registration();
+  reg->conn = conn;
+  reg->handler = handler;
+  reg->fd = conn->fd();
+  reg->events = EPOLLIN;
+  reg->removed = false;
+
+  if (conn->is_connecting() || conn->has_queued_output())
+  {
+    reg->events |= EPOLLOUT;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = reg->events;
+  ev.data.ptr = reg;
+
+  if (::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, reg->fd, &ev) < 0)
+  {
+    int err = errno;
+    TRC_ERROR("Failed to watch connection to %s (%d: %s)",
+              conn->address().c_str(),
+              err,
+              ::strerror(err));
+    delete reg; reg = NULL;
+    return false;
+  }
+
+  _registrations[conn] = reg;
+
+  return true;
+}
+
+void Memcached::EpollEventLoop::remove(Connection* conn)
+{
+  std::map<Connection*, Registration*>::iterator it = _registrations.find(conn);
+  if (it == _registrations.end())
+  {
+    return;
+  }
+
+  Registration* reg = it->second;
+  _registrations.erase(it);
+
+  // If the connection has closed its socket the kernel has already stopped
+  // watching it (and the descriptor may since have been reused), so only
+  // remove it from epoll if it is still open.
+  if (conn->fd() == reg->fd)
+  {
+    ::epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, reg->fd, NULL);
+  }
+
+  reg->removed = true;
+  _removed.push_back(reg);
+}
+
+void Memcached::EpollEventLoop::update(Connection* conn)
+{
+  std::map<Connection*, Registration*>::iterator it = _registrations.find(conn);
+  if (it != _registrations.end())
+  {
+    update_events(it->second);
+  }
+}
+
+void Memcached::EpollEventLoop::update_events(Registration* reg)
+{
+  if ((reg->removed) || (reg->conn->fd() != reg->fd))
+  {
+    return;
+  }
+
+  uint32_t events = EPOLLIN;
+  if (reg->conn->is_connecting() || reg->conn->has_queued_output())
+  {
+    events |= EPOLLOUT;
+  }
+
+  if (events != reg->events)
+  {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = reg;
+
+    if (::epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, reg->fd, &ev) < 0)
+    {
+      int err = errno;
+      TRC_ERROR("Failed to update events for connection to %s (%d: %s)",
+                reg->conn->address().c_str(),
+                err,
+                ::strerror(err));
+      return;
+    }
+
+    reg->events = events;
+  }
+}
+
+void Memcached::EpollEventLoop::dispatch(Registration* reg, uint32_t events)
+{
+  Connection* conn = reg->conn;
+
+  if (conn->is_connecting())
+  {
+    // A connection that is still being established reports its result by
+    // becoming writable (or failing).  Nothing else can happen on it yet.
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+    {
+      ClientConnection* client_conn = static_cast<ClientConnection*>(conn);
+      int rc = client_conn->complete_connect();
+      reg->handler->on_connected(client_conn, rc);
+    }
+
+    return;
+  }
+
+  if ((events & EPOLLOUT) && (conn->has_queued_output()))
+  {
+    Status status = conn->flush();
+
+    if (status == Status::OK)
+    {
+      reg->handler->on_writable(conn);
+    }
+    else if (status != Status::WOULD_BLOCK)
+    {
+      reg->handler->on_error(conn, status);
+      return;
+    }
+  }
+
+  // An error or hangup is reported to the handler as a read, as that is how
+  // it will find out what happened.
+  if ((!reg->removed) && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+  {
+    reg->handler->on_readable(conn);
+  }
+}
+
+int Memcached::EpollEventLoop::poll(int timeout_ms)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int num_events = ::epoll_wait(_epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+  if (num_events < 0)
+  {
+    int err = errno;
+    if (err == EINTR)
+    {
+      return 0;
+    }
+
+    TRC_ERROR("Error waiting for events (%d: %s)", err, ::strerror(err));
+    return -1;
+  }
+
+  for (int ii = 0; ii < num_events; ++ii)
+  {
+    Registration* reg = (Registration*)events[ii].data.ptr;
+
+    if (reg == NULL)
+    {
+      uint64_t count;
+      if (::read(_stop_fd, &count, sizeof(count)) == sizeof(count))
+      {
+        TRC_DEBUG("Event loop stopped");
+      }
+      _stopped = true;
+      continue;
+    }
+
+    // Skip connections that an earlier handler in this batch removed.
+    if (!reg->removed)
+    {
+      dispatch(reg, events[ii].events);
+      update_events(reg);
+    }
+  }
+
+  // Nothing can refer to the removed registrations any more.
+  for (std::vector<Registration*>::iterator it = _removed.begin();
+       it != _removed.end();
+       ++it)
+  {
+    delete *it; *it = NULL;
+  }
+  _removed.clear();
+
+  return num_events;
+}
+
+void Memcached::EpollEventLoop::stop()
+{
+  uint64_t count = 1;
+  if (::write(_stop_fd, &count, sizeof(count)) < 0)
+  {
+    int err = errno;
+    TRC_ERROR("Failed to stop event loop (%d: %s)", err, ::strerror(err));
+  }
+}
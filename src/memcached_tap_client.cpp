@@ -14,10 +14,12 @@
 
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 void Memcached::Utils::write(const std::string& str, std::string& ss)
 {
@@ -29,9 +31,15 @@ bool Memcached::is_msg_complete(const std::string& msg,
                                 uint32_t& body_length,
                                 uint8_t& op_code)
 {
-  uint32_t raw_length = msg.length();
-  const char* raw = msg.data();
+  return is_msg_complete(msg.data(), msg.length(), request, body_length, op_code);
+}
 
+bool Memcached::is_msg_complete(const char* raw,
+                                size_t raw_length,
+                                bool& request,
+                                uint32_t& body_length,
+                                uint8_t& op_code)
+{
   if (raw_length < sizeof(MsgHdr))
   {
     // Too short
@@ -63,45 +71,128 @@ bool Memcached::is_msg_complete(const std::string& msg,
   return true;
 }
 
+bool Memcached::parse(const char* raw, size_t raw_length, MsgView& output)
+{
+  uint32_t body_length;
+
+  if (!is_msg_complete(raw,
+                       raw_length,
+                       output.request,
+                       body_length,
+                       output.op_code))
+  {
+    // Need more data.
+    return false;
+  }
+
+  output.vbucket_or_status = HDR_GET(raw, vbucket_or_status);
+  output.opaque = HDR_GET(raw, opaque);
+  output.cas = HDR_GET(raw, cas);
+
+  // Split the body into its sections.  Clamp the extra and key lengths to the
+  // body length so that a malformed header can't make us read off the end of
+  // the message.
+  size_t extra_length = std::min<size_t>(HDR_GET(raw, extra_length),
+                                         body_length);
+  size_t key_length = std::min<size_t>(HDR_GET(raw, key_length),
+                                       body_length - extra_length);
+  const char* body = raw + sizeof(MsgHdr);
+
+  output.frame = boost::string_ref(raw, sizeof(MsgHdr) + body_length);
+  output.extra = boost::string_ref(body, extra_length);
+  output.key = boost::string_ref(body + extra_length, key_length);
+  output.value = boost::string_ref(body + extra_length + key_length,
+                                   body_length - (extra_length + key_length));
+
+  return true;
+}
+
 bool Memcached::from_wire(std::string& msg,
                           Memcached::BaseMessage*& output)
 {
-  bool request;
-  uint32_t body_length;
-  uint8_t op_code;
+  MsgView view;
 
-  if (!is_msg_complete(msg, request, body_length, op_code))
+  if (!parse(msg.data(), msg.length(), view))
   {
     // Need more data.
     return false;
   }
 
-  if (request)
+  output = from_wire(view);
+
+  // And finally trim the message from the start of the string.
+  msg.erase(0, view.frame.length());
+
+  return true;
+}
+
+bool Memcached::is_quiet(uint8_t op_code)
+{
+  return (unquiet(op_code) != op_code);
+}
+
+uint8_t Memcached::unquiet(uint8_t op_code)
+{
+  switch (op_code)
   {
-    switch (op_code)
+  case (uint8_t)OpCode::GETQ:
+    return (uint8_t)OpCode::GET;
+  case (uint8_t)OpCode::GETKQ:
+    return (uint8_t)OpCode::GETK;
+  case (uint8_t)OpCode::SETQ:
+    return (uint8_t)OpCode::SET;
+  case (uint8_t)OpCode::ADDQ:
+    return (uint8_t)OpCode::ADD;
+  case (uint8_t)OpCode::REPLACEQ:
+    return (uint8_t)OpCode::REPLACE;
+  case (uint8_t)OpCode::DELETEQ:
+    return (uint8_t)OpCode::DELETE;
+  case (uint8_t)OpCode::QUITQ:
+    return (uint8_t)OpCode::QUIT;
+  default:
+    return op_code;
+  }
+}
+
+Memcached::BaseMessage* Memcached::from_wire(const Memcached::MsgView& msg)
+{
+  Memcached::BaseMessage* output;
+
+  if (msg.request)
+  {
+    switch (msg.op_code)
     {
     case (uint8_t)OpCode::TAP_MUTATE:
       output = from_wire_int<Memcached::TapMutateReq>(msg);
       break;
     case (uint8_t)OpCode::GET:
     case (uint8_t)OpCode::GETK:
+    case (uint8_t)OpCode::GETQ:
+    case (uint8_t)OpCode::GETKQ:
       output = from_wire_int<Memcached::GetReq>(msg);
       break;
     case (uint8_t)OpCode::SET:
+    case (uint8_t)OpCode::SETQ:
       output = from_wire_int<Memcached::SetReq>(msg);
       break;
     case (uint8_t)OpCode::ADD:
+    case (uint8_t)OpCode::ADDQ:
       output = from_wire_int<Memcached::AddReq>(msg);
       break;
     case (uint8_t)OpCode::REPLACE:
+    case (uint8_t)OpCode::REPLACEQ:
       output = from_wire_int<Memcached::ReplaceReq>(msg);
       break;
     case (uint8_t)OpCode::DELETE:
+    case (uint8_t)OpCode::DELETEQ:
       output = from_wire_int<Memcached::DeleteReq>(msg);
       break;
     case (uint8_t)OpCode::VERSION:
       output = from_wire_int<Memcached::VersionReq>(msg);
       break;
+    case (uint8_t)OpCode::NOOP:
+      output = from_wire_int<Memcached::NoopReq>(msg);
+      break;
     default:
       output = from_wire_int<Memcached::BaseReq>(msg);
       break;
@@ -109,11 +200,17 @@ bool Memcached::from_wire(std::string& msg,
   }
   else
   {
-    switch (op_code)
+    switch (msg.op_code)
     {
     case (uint8_t)OpCode::GET:
+    case (uint8_t)OpCode::GETK:
+    case (uint8_t)OpCode::GETQ:
+    case (uint8_t)OpCode::GETKQ:
       output = Memcached::from_wire_int<Memcached::GetRsp>(msg);
       break;
+    case (uint8_t)OpCode::NOOP:
+      output = Memcached::from_wire_int<Memcached::NoopRsp>(msg);
+      break;
     case (uint8_t)OpCode::ADD:
       output = Memcached::from_wire_int<Memcached::AddRsp>(msg);
       break;
@@ -126,91 +223,190 @@ bool Memcached::from_wire(std::string& msg,
     }
   }
 
-  // And finally trim the message from the start of the string.
-  msg = msg.substr(sizeof(MsgHdr) + body_length, std::string::npos);
+  return output;
+}
 
-  return true;
+uint32_t Memcached::MsgView::extra_word(size_t index) const
+{
+  uint32_t word = 0;
+
+  if (extra.length() >= (index + 1) * sizeof(uint32_t))
+  {
+    // The extras aren't necessarily aligned, so copy the word out rather than
+    // dereferencing it in place.
+    memcpy(&word, extra.data() + index * sizeof(uint32_t), sizeof(uint32_t));
+    word = Utils::network_to_host(word);
+  }
+
+  return word;
 }
 
-std::string Memcached::BaseMessage::to_wire() const
+char* Memcached::RecvBuffer::reserve(size_t size)
 {
-  std::string ss;
+  if (_buf->size() - _end < size)
+  {
+    if (held())
+    {
+      // Messages still point into this block, so leave it to them and move
+      // the unconsumed data to a new block.
+      Block block = std::make_shared<std::vector<char>>(
+                                     std::max(length() + size, _buf->size()));
+      memcpy(block->data(), data(), length());
+      _end -= _start;
+      _start = 0;
+      _buf = block;
+      return _buf->data() + _end;
+    }
+
+    // Not enough space at the end of the buffer.  First reclaim the space
+    // taken up by data that has already been consumed.
+    if (_start > 0)
+    {
+      memmove(_buf->data(), _buf->data() + _start, _end - _start);
+      _end -= _start;
+      _start = 0;
+    }
+
+    // If that wasn't enough, grow the buffer.
+    if (_buf->size() - _end < size)
+    {
+      _buf->resize(std::max(_end + size, 2 * _buf->size()));
+    }
+  }
+
+  return _buf->data() + _end;
+}
 
-  // Build the message-specific sections.
-  std::string extra = generate_extra();
-  std::string value = generate_value();
+void Memcached::RecvBuffer::consume(size_t size)
+{
+  _start += size;
+
+  if ((_start == _end) && (!held()))
+  {
+    // The buffer is empty, so we can start writing at the front again without
+    // having to move anything.
+    _start = 0;
+    _end = 0;
+  }
+}
+
+void Memcached::RecvBuffer::clear()
+{
+  if (held())
+  {
+    _buf = std::make_shared<std::vector<char>>();
+  }
+  _start = 0;
+  _end = 0;
+}
+
+void Memcached::BaseMessage::to_wire(Memcached::WireMsg& wire) const
+{
+  // Build the message-specific sections.  The extras are written straight
+  // into the header buffer, after the fixed-length header.
+  char* extra = wire.header + sizeof(MsgHdr);
+  size_t extra_length = generate_extra(extra);
+  assert(extra_length <= WireMsg::MAX_EXTRA_LENGTH);
+  boost::string_ref value = generate_value();
   uint16_t vbucket_or_status = generate_vbucket_or_status();
 
   // Calculate body size, this is the sum of the sizes of Extras, Key and
   // Values sections.
-  uint32_t body_size = extra.length() + _key.length() + value.length();
+  uint32_t body_size = extra_length + _key.length() + value.length();
 
   // In the memcache protocol the first byte (aka the "magic" byte) is 0x80 for
   // a request and 0x81 for a response.
   uint8_t magic_byte = is_request() ? 0x80 : 0x81;
-  Utils::write(magic_byte, ss);
-  Utils::write((uint8_t)_op_code, ss);
-  Utils::write((uint16_t)_key.length(), ss);
-  Utils::write((uint8_t)extra.length(), ss);
-  Utils::write((uint8_t)0x00, ss); // Data Type (0x00 - RAW_DATA)
-  Utils::write((uint16_t)vbucket_or_status, ss);
-  Utils::write((uint32_t)body_size, ss);
-  Utils::write((uint32_t)_opaque, ss);
-  Utils::write((uint64_t)_cas, ss);
-  Utils::write(extra, ss);
-  Utils::write(_key, ss);
-  Utils::write(value, ss);
+  char* ptr = wire.header;
+  ptr = Utils::write(magic_byte, ptr);
+  ptr = Utils::write((uint8_t)_op_code, ptr);
+  ptr = Utils::write((uint16_t)_key.length(), ptr);
+  ptr = Utils::write((uint8_t)extra_length, ptr);
+  ptr = Utils::write((uint8_t)0x00, ptr); // Data Type (0x00 - RAW_DATA)
+  ptr = Utils::write((uint16_t)vbucket_or_status, ptr);
+  ptr = Utils::write((uint32_t)body_size, ptr);
+  ptr = Utils::write((uint32_t)_opaque, ptr);
+  ptr = Utils::write((uint64_t)_cas, ptr);
+
+  // The header and extras go in the first buffer, followed by the key and
+  // value in place.  Empty sections are left out.
+  wire.iov[0].iov_base = wire.header;
+  wire.iov[0].iov_len = sizeof(MsgHdr) + extra_length;
+  wire.iov_count = 1;
+
+  if (!_key.empty())
+  {
+    wire.iov[wire.iov_count].iov_base = (void*)_key.data();
+    wire.iov[wire.iov_count].iov_len = _key.length();
+    wire.iov_count++;
+  }
+
+  if (!value.empty())
+  {
+    wire.iov[wire.iov_count].iov_base = (void*)value.data();
+    wire.iov[wire.iov_count].iov_len = value.length();
+    wire.iov_count++;
+  }
+
+  wire.length = sizeof(MsgHdr) + body_size;
+}
+
+std::string Memcached::BaseMessage::to_wire() const
+{
+  WireMsg wire;
+  to_wire(wire);
+
+  std::string ss;
+  ss.reserve(wire.length);
+  for (int ii = 0; ii < wire.iov_count; ++ii)
+  {
+    ss.append((const char*)wire.iov[ii].iov_base, wire.iov[ii].iov_len);
+  }
 
   return ss;
 }
 
-Memcached::BaseMessage::BaseMessage(const std::string& msg)
+Memcached::BaseMessage::BaseMessage(const MsgView& msg) :
+  _op_code(msg.op_code),
+  _key(msg.key.data(), msg.key.length()),
+  _opaque(msg.opaque),
+  _cas(msg.cas)
 {
-  const char* raw = msg.data();
-  _op_code = HDR_GET(raw, op_code);
-  _opaque = HDR_GET(raw, opaque);
-  _cas = HDR_GET(raw, cas);
-  _key = msg.substr(sizeof(MsgHdr) + HDR_GET(raw, extra_length),
-                    HDR_GET(raw, key_length));
 }
 
-Memcached::BaseReq::BaseReq(const std::string& msg) : BaseMessage(msg)
+Memcached::BaseReq::BaseReq(const MsgView& msg) :
+  BaseMessage(msg),
+  _vbucket(msg.vbucket_or_status)
 {
-  _vbucket = HDR_GET(msg.data(), vbucket_or_status);
 }
 
-Memcached::BaseRsp::BaseRsp(const std::string& msg) : BaseMessage(msg)
+Memcached::BaseRsp::BaseRsp(const MsgView& msg) :
+  BaseMessage(msg),
+  _status(msg.vbucket_or_status)
 {
-  _status = HDR_GET(msg.data(), vbucket_or_status);
 }
 
 bool Memcached::GetReq::response_needs_key() const
 {
-  return (_op_code == (uint8_t)OpCode::GETK);
+  return ((_op_code == (uint8_t)OpCode::GETK) ||
+          (_op_code == (uint8_t)OpCode::GETKQ));
 }
 
-Memcached::GetRsp::GetRsp(const std::string& msg) : BaseRsp(msg)
+Memcached::GetRsp::GetRsp(const MsgView& msg) :
+  BaseRsp(msg),
+  _value(msg.value.data(), msg.value.length()),
+  _flags(msg.extra_word(0)) // The extra section just contains the flags.
 {
-  const char* raw = msg.data();
-  uint16_t key_length = HDR_GET(raw, key_length);
-  uint8_t extra_length = HDR_GET(raw, extra_length);
-  uint32_t body_length = HDR_GET(raw, body_length);
-  raw = NULL; // It's now safe to call non-const functions on `msg`
-
-  // The extra section just contains the flags.
-  std::string extra = msg.substr(sizeof(MsgHdr), extra_length);
-  _flags = Utils::network_to_host(((uint32_t*)extra.data())[0]);
-  _value = msg.substr(sizeof(MsgHdr) + extra_length + key_length, body_length - (extra_length + key_length));
 }
 
 Memcached::GetRsp::GetRsp(uint16_t status,
                           uint32_t opaque,
                           uint64_t cas,
-                          const std::string& value,
+                          std::string value,
                           uint32_t flags,
                           const std::string& key) :
   BaseRsp((uint8_t)OpCode::GET, "", status, opaque, cas),
-  _value(value),
+  _value(std::move(value)),
   _flags(flags)
 {
   if (!key.empty())
@@ -222,41 +418,29 @@ Memcached::GetRsp::GetRsp(uint16_t status,
   }
 }
 
-std::string Memcached::GetRsp::generate_extra() const
+void Memcached::GetRsp::make_quiet()
 {
-  std::string extras_string;
+  _op_code = (_op_code == (uint8_t)OpCode::GETK) ?
+               (uint8_t)OpCode::GETKQ : (uint8_t)OpCode::GETQ;
+}
 
+size_t Memcached::GetRsp::generate_extra(char* buf) const
+{
   // Only add the flags if a result has been found.
   if (_status == (uint16_t)ResultCode::NO_ERROR)
   {
-    Utils::write(_flags, extras_string);
+    return Utils::write(_flags, buf) - buf;
   }
 
-  return extras_string;
-}
-
-std::string Memcached::GetRsp::generate_value() const
-{
-  return _value;
+  return 0;
 }
 
-Memcached::SetAddReplaceReq::SetAddReplaceReq(const std::string& msg) :
+Memcached::SetAddReplaceReq::SetAddReplaceReq(const MsgView& msg) :
   BaseReq(msg),
-  _value(),
-  _flags(0),
-  _expiry(0)
+  _value(msg.value.data(), msg.value.length()),
+  _flags(msg.extra_word(0)),
+  _expiry(msg.extra_word(1))
 {
-  const char* raw = msg.data();
-  uint16_t key_length = HDR_GET(raw, key_length);
-  uint8_t extra_length = HDR_GET(raw, extra_length);
-  uint32_t body_length = HDR_GET(raw, body_length);
-  raw = NULL; // It's now safe to call non-const functions on `msg`
-
-  std::string extra = msg.substr(sizeof(MsgHdr), extra_length);
-  _flags = Utils::network_to_host(((uint32_t*)extra.data())[0]);
-  _expiry = Utils::network_to_host(((uint32_t*)extra.data())[1]);
-  _value = msg.substr(sizeof(MsgHdr) + (extra_length + key_length),
-                      body_length - (extra_length + key_length));
 }
 
 Memcached::SetAddReplaceReq::SetAddReplaceReq(uint8_t command,
@@ -265,30 +449,26 @@ Memcached::SetAddReplaceReq::SetAddReplaceReq(uint8_t command,
                                               std::string value,
                                               uint64_t cas,
                                               uint32_t flags,
-                                              uint32_t expiry) :
+                                              uint32_t expiry,
+                                              uint32_t opaque) :
   BaseReq(command,
-          key,
+          std::move(key),
           vbucket,
-          0,
+          opaque,
           cas
          ),
-  _value(value),
+  _value(std::move(value)),
   _flags(flags),
   _expiry(expiry)
 {
 }
 
-std::string Memcached::SetAddReplaceReq::generate_extra() const
+size_t Memcached::SetAddReplaceReq::generate_extra(char* buf) const
 {
-  std::string ss;
-  Utils::write(_flags, ss); // Flags
-  Utils::write(_expiry, ss); // Expiry
-  return ss;
-}
-
-std::string Memcached::SetAddReplaceReq::generate_value() const
-{
-  return _value;
+  char* ptr = buf;
+  ptr = Utils::write(_flags, ptr); // Flags
+  ptr = Utils::write(_expiry, ptr); // Expiry
+  return ptr - buf;
 }
 
 Memcached::VersionRsp::VersionRsp(uint16_t status,
@@ -299,60 +479,64 @@ Memcached::VersionRsp::VersionRsp(uint16_t status,
 {
 }
 
-std::string Memcached::VersionRsp::generate_value() const
-{
-  return _version;
-}
-
-Memcached::TapConnectReq::TapConnectReq(const VBucketList& buckets) :
+Memcached::TapConnectReq::TapConnectReq(const VBucketList& buckets,
+                                        uint64_t backfill_date,
+                                        bool keys_only) :
   BaseReq((uint8_t)OpCode::TAP_CONNECT,
           "",
           0,
           0,
           0
          ),
-  _buckets(buckets)
+  _buckets(buckets),
+  _backfill_date(backfill_date),
+  _keys_only(keys_only),
+  _value()
 {
-}
-
-std::string Memcached::TapConnectReq::generate_extra() const
-{
-  std::string ss;
-  uint32_t extra = 0x00000002; // DUMP
-  if (!_buckets.empty())
+  // The value holds the backfill date (if there is one) followed by the
+  // bucket list (if there is one).
+  if (_backfill_date != 0)
   {
-    extra |= 0x00000004; // LIST_BUCKETS
+    Utils::write(_backfill_date, _value);
   }
-  Utils::write((uint32_t)extra, ss);
-  return ss;
-}
-
-std::string Memcached::TapConnectReq::generate_value() const
-{
-  std::string ss;
 
   if (!_buckets.empty())
   {
-    Utils::write((uint16_t)_buckets.size(), ss);
+    Utils::write((uint16_t)_buckets.size(), _value);
     for (VBucketIter it = _buckets.begin();
          it != _buckets.end();
          ++it)
     {
-      Utils::write((uint16_t)*it, ss); // VBucket ID
+      Utils::write((uint16_t)*it, _value); // VBucket ID
     }
   }
-
-  return ss;
 }
 
-Memcached::TapMutateReq::TapMutateReq(const std::string& msg) : BaseReq(msg)
+size_t Memcached::TapConnectReq::generate_extra(char* buf) const
 {
-  const char* raw = msg.data();
-  uint16_t key_length = HDR_GET(raw, key_length);
-  uint8_t extra_length = HDR_GET(raw, extra_length);
-  uint32_t body_length = HDR_GET(raw, body_length);
-  raw = NULL; // It's now safe to call non-const functions on `msg`
+  // The DUMP flag is still set with BACKFILL, so that the server closes the
+  // stream once it has sent the changed records, rather than going on to
+  // stream new changes as they happen.
+  uint32_t extra = 0x00000002; // DUMP
+  if (_backfill_date != 0)
+  {
+    extra |= 0x00000001; // BACKFILL
+  }
+  if (!_buckets.empty())
+  {
+    extra |= 0x00000004; // LIST_BUCKETS
+  }
+  if (_keys_only)
+  {
+    extra |= 0x00000020; // REQUEST_KEYS_ONLY
+  }
+  return Utils::write((uint32_t)extra, buf) - buf;
+}
 
+Memcached::TapMutateReq::TapMutateReq(const MsgView& msg) :
+  BaseReq(msg),
+  _value(msg.value.data(), msg.value.length())
+{
   // Byte/     0       |       1       |       2       |       3       |
   //    /              |               |               |               |
   //   |0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|
@@ -366,21 +550,165 @@ Memcached::TapMutateReq::TapMutateReq(const std::string& msg) : BaseReq(msg)
   // 12| Expiration                                                    |
   //   +---------------+---------------+---------------+---------------+
   //   Total 8 bytes
-  std::string extra = msg.substr(sizeof(MsgHdr), extra_length);
-  _flags = Utils::network_to_host(((uint32_t*)extra.data())[2]);
-  _expiry = Utils::network_to_host(((uint32_t*)extra.data())[3]);
-  _value = msg.substr(sizeof(MsgHdr) + extra_length + key_length, body_length - (extra_length + key_length));
+  _flags = msg.extra_word(2);
+  _expiry = msg.extra_word(3);
 }
 
-std::string Memcached::SetVBucketReq::generate_extra() const
+size_t Memcached::SetVBucketReq::generate_extra(char* buf) const
 {
-  std::string ss;
-  Utils::write((uint32_t)_status, ss);
-  return ss;
+  return Utils::write((uint32_t)_status, buf) - buf;
+}
+
+uint32_t Memcached::Message::flags() const
+{
+  uint32_t flags = 0;
+
+  switch (unquiet(_view.op_code))
+  {
+  case (uint8_t)OpCode::TAP_MUTATE:
+    // See the layout of the TAP_MUTATE extras in the TapMutateReq
+    // constructor.
+    flags = _view.request ? _view.extra_word(2) : 0;
+    break;
+  case (uint8_t)OpCode::GET:
+  case (uint8_t)OpCode::GETK:
+  case (uint8_t)OpCode::SET:
+  case (uint8_t)OpCode::ADD:
+  case (uint8_t)OpCode::REPLACE:
+    // On GET responses the extras are just the flags.  On SET/ADD/REPLACE
+    // requests they are the flags followed by the expiry.
+    flags = _view.extra_word(0);
+    break;
+  default:
+    break;
+  }
+
+  return flags;
+}
+
+uint32_t Memcached::Message::expiry() const
+{
+  uint32_t expiry = 0;
+
+  if (_view.request)
+  {
+    switch (unquiet(_view.op_code))
+    {
+    case (uint8_t)OpCode::TAP_MUTATE:
+      expiry = _view.extra_word(3);
+      break;
+    case (uint8_t)OpCode::SET:
+    case (uint8_t)OpCode::ADD:
+    case (uint8_t)OpCode::REPLACE:
+      expiry = _view.extra_word(1);
+      break;
+    default:
+      break;
+    }
+  }
+
+  return expiry;
+}
+
+bool Memcached::Message::response_needs_key() const
+{
+  return ((_view.op_code == (uint8_t)OpCode::GETK) ||
+          (_view.op_code == (uint8_t)OpCode::GETKQ));
+}
+
+void Memcached::Message::detach()
+{
+  if (_view.frame.data() != _storage.data())
+  {
+    // Assigning reuses the storage's existing capacity, so this only
+    // allocates if this is the largest message this object has held.
+    _storage.assign(_view.frame.data(), _view.frame.length());
+    parse(_storage.data(), _storage.length(), _view);
+    _block.reset();
+  }
+}
+
+// The flags and expiry that make up a SET/ADD/REPLACE request's extras are
+// the last two words of a TAP_MUTATE's extras (see the TapMutateReq
+// constructor), immediately before the key.  The request's header therefore
+// goes immediately before them, over the mutate's header and the first half
+// of its extras, which aren't needed any more.
+boost::string_ref Memcached::Message::rewrite_as_store(uint8_t op_code,
+                                                       uint16_t vbucket,
+                                                       uint32_t opaque,
+                                                       uint64_t cas)
+{
+  const size_t TAP_MUTATE_EXTRA_LENGTH = 16;
+  const size_t STORE_EXTRA_LENGTH = 8;
+
+  if ((!_view.request) ||
+      (unquiet(_view.op_code) != (uint8_t)OpCode::TAP_MUTATE) ||
+      (_view.extra.length() != TAP_MUTATE_EXTRA_LENGTH) ||
+      ((_view.frame.data() != _storage.data()) && (_block == NULL)))
+  {
+    return boost::string_ref();
+  }
+
+  // A held message's frame has already been consumed from the receive
+  // buffer, and nothing else refers to it, so it can be written to.
+  char* frame = (_view.frame.data() == _storage.data()) ?
+                  &_storage[0] : const_cast<char*>(_view.frame.data());
+  size_t start = (_view.key.data() - _view.frame.data()) -
+                 STORE_EXTRA_LENGTH - sizeof(MsgHdr);
+  uint32_t body_size = STORE_EXTRA_LENGTH + _view.key.length() + _view.value.length();
+
+  char* ptr = frame + start;
+  ptr = Utils::write((uint8_t)0x80, ptr);
+  ptr = Utils::write(op_code, ptr);
+  ptr = Utils::write((uint16_t)_view.key.length(), ptr);
+  ptr = Utils::write((uint8_t)STORE_EXTRA_LENGTH, ptr);
+  ptr = Utils::write((uint8_t)0x00, ptr); // Data Type (0x00 - RAW_DATA)
+  ptr = Utils::write(vbucket, ptr);
+  ptr = Utils::write(body_size, ptr);
+  ptr = Utils::write(opaque, ptr);
+  ptr = Utils::write(cas, ptr);
+
+  return boost::string_ref(frame + start, sizeof(MsgHdr) + body_size);
+}
+
+Memcached::MessagePool::~MessagePool()
+{
+  for (std::vector<Message*>::iterator it = _free.begin();
+       it != _free.end();
+       ++it)
+  {
+    delete *it;
+  }
+}
+
+Memcached::Message* Memcached::MessagePool::get()
+{
+  if (_free.empty())
+  {
+    return new Message();
+  }
+
+  Message* msg = _free.back();
+  _free.pop_back();
+  return msg;
+}
+
+void Memcached::MessagePool::put(Memcached::Message* msg)
+{
+  msg->_block.reset();
+  _free.push_back(msg);
 }
 
 Memcached::Connection::Connection() :
-  _sock(-1)
+  _sock(-1),
+  _buffer(),
+  _delivered_length(0),
+  _pool(),
+  _nonblocking(false),
+  _send_queue(),
+  _send_offset(0),
+  _external_io(false),
+  _external_status(Memcached::Status::OK)
 {
 }
 
@@ -395,6 +723,10 @@ void Memcached::Connection::disconnect()
   {
     ::close(_sock); _sock = -1;
   }
+
+  // Anything still queued can never be sent now.
+  _send_queue.clear();
+  _send_offset = 0;
 }
 
 bool Memcached::Connection::send(const Memcached::BaseMessage& req)
@@ -404,92 +736,484 @@ bool Memcached::Connection::send(const Memcached::BaseMessage& req)
     return false;
   }
 
-  std::string bin = req.to_wire();
+  Memcached::WireMsg wire;
+  req.to_wire(wire);
+
+  return send(wire.iov, wire.iov_count);
+}
+
+bool Memcached::Connection::send_frame(boost::string_ref frame)
+{
+  if (_sock < 0)
+  {
+    return false;
+  }
+
+  struct iovec iov;
+  iov.iov_base = (void*)frame.data();
+  iov.iov_len = frame.length();
+
+  return send(&iov, 1);
+}
+
+bool Memcached::Connection::send_store(uint8_t op_code,
+                                       boost::string_ref key,
+                                       uint16_t vbucket,
+                                       boost::string_ref value,
+                                       uint32_t flags,
+                                       uint32_t expiry)
+{
+  const size_t STORE_EXTRA_LENGTH = 8;
+
+  if (_sock < 0)
+  {
+    return false;
+  }
+
+  char header[sizeof(MsgHdr) + STORE_EXTRA_LENGTH];
+  uint32_t body_size = STORE_EXTRA_LENGTH + key.length() + value.length();
+
+  char* ptr = header;
+  ptr = Utils::write((uint8_t)0x80, ptr);
+  ptr = Utils::write(op_code, ptr);
+  ptr = Utils::write((uint16_t)key.length(), ptr);
+  ptr = Utils::write((uint8_t)STORE_EXTRA_LENGTH, ptr);
+  ptr = Utils::write((uint8_t)0x00, ptr); // Data Type (0x00 - RAW_DATA)
+  ptr = Utils::write(vbucket, ptr);
+  ptr = Utils::write(body_size, ptr);
+  ptr = Utils::write((uint32_t)0, ptr); // Opaque
+  ptr = Utils::write((uint64_t)0, ptr); // CAS
+  ptr = Utils::write(flags, ptr);
+  ptr = Utils::write(expiry, ptr);
+
+  struct iovec iov[3];
+  int iov_count = 1;
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+
+  if (!key.empty())
+  {
+    iov[iov_count].iov_base = (void*)key.data();
+    iov[iov_count].iov_len = key.length();
+    iov_count++;
+  }
+
+  if (!value.empty())
+  {
+    iov[iov_count].iov_base = (void*)value.data();
+    iov[iov_count].iov_len = value.length();
+    iov_count++;
+  }
+
+  return send(iov, iov_count);
+}
+
+bool Memcached::Connection::send(struct iovec* iov, int iov_count)
+{
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = iov_count;
 
-  // Send the command
-  if (::send(_sock, bin.data(), bin.length(), 0) < 0)
+  // If there's output queued already, this message must go behind it.  If an
+  // event loop is doing our I/O, it sends the queue for us.
+  bool queue = (has_queued_output()) || (_external_io);
+
+  while ((!queue) && (mh.msg_iovlen > 0))
+  {
+    ssize_t sent = ::sendmsg(_sock, &mh, MSG_NOSIGNAL);
+
+    if (sent < 0)
+    {
+      int err = errno;
+      if (err == EINTR)
+      {
+        continue;
+      }
+      else if ((_nonblocking) && ((err == EAGAIN) || (err == EWOULDBLOCK)))
+      {
+        // The socket is full.  Queue the rest of the message.
+        queue = true;
+        break;
+      }
+
+      TRC_ERROR("Error during send() on socket (%d)", err);
+      ::close(_sock); _sock = -1;
+      return false;
+    }
+
+    // The socket may not have accepted all of the data.  Skip past the
+    // buffers that have been sent in full, and trim the one that was only
+    // partially sent, before trying again with the rest.
+    size_t remaining = sent;
+    while ((mh.msg_iovlen > 0) && (remaining >= mh.msg_iov->iov_len))
+    {
+      remaining -= mh.msg_iov->iov_len;
+      mh.msg_iov++;
+      mh.msg_iovlen--;
+    }
+
+    if (remaining > 0)
+    {
+      mh.msg_iov->iov_base = (char*)mh.msg_iov->iov_base + remaining;
+      mh.msg_iov->iov_len -= remaining;
+    }
+  }
+
+  if (queue)
+  {
+    for (size_t ii = 0; ii < mh.msg_iovlen; ++ii)
+    {
+      _send_queue.append((const char*)mh.msg_iov[ii].iov_base,
+                         mh.msg_iov[ii].iov_len);
+    }
+  }
+
+  return true;
+}
+
+Memcached::Status Memcached::Connection::flush()
+{
+  if (_sock == -1)
+  {
+    return Memcached::Status::DISCONNECTED;
+  }
+
+  while (has_queued_output())
+  {
+    ssize_t sent = ::send(_sock,
+                          _send_queue.data() + _send_offset,
+                          _send_queue.length() - _send_offset,
+                          MSG_NOSIGNAL);
+
+    if (sent < 0)
+    {
+      int err = errno;
+      if (err == EINTR)
+      {
+        continue;
+      }
+      else if ((err == EAGAIN) || (err == EWOULDBLOCK))
+      {
+        return Memcached::Status::WOULD_BLOCK;
+      }
+
+      TRC_ERROR("Error during send() on socket (%d)", err);
+      ::close(_sock); _sock = -1;
+      return Memcached::Status::ERROR;
+    }
+
+    _send_offset += sent;
+  }
+
+  // Everything has been sent.  Keep the queue's storage for next time.
+  _send_queue.clear();
+  _send_offset = 0;
+
+  return Memcached::Status::OK;
+}
+
+void Memcached::Connection::reset()
+{
+  disconnect();
+  _buffer.clear();
+  _delivered_length = 0;
+  _nonblocking = false;
+  _external_status = Memcached::Status::OK;
+}
+
+void Memcached::Connection::append_received(const char* data, size_t length)
+{
+  // Views onto messages that were handed out before this data arrived are
+  // invalidated here, rather than by the next `recv`.
+  consume_delivered();
+  memcpy(_buffer.reserve(length), data, length);
+  _buffer.commit(length);
+}
+
+void Memcached::Connection::take_queued_output(std::string& output)
+{
+  _send_queue.erase(0, _send_offset);
+  output.clear();
+  output.swap(_send_queue);
+  _send_offset = 0;
+}
+
+bool Memcached::Connection::set_nonblocking()
+{
+  int flags = ::fcntl(_sock, F_GETFL, 0);
+  if ((flags < 0) || (::fcntl(_sock, F_SETFL, flags | O_NONBLOCK) < 0))
   {
     int err = errno;
-    TRC_ERROR("Error during send() on socket (%d)", err);
-    ::close(_sock); _sock = -1;
+    TRC_ERROR("Failed to make connection to %s non-blocking (%d: %s)",
+              _address.c_str(),
+              err,
+              ::strerror(err));
     return false;
   }
+
+  _nonblocking = true;
   return true;
 }
 
 Memcached::Status Memcached::Connection::recv(Memcached::BaseMessage** msg)
+{
+  MsgView view;
+  Memcached::Status status = recv(view);
+
+  if (status == Memcached::Status::OK)
+  {
+    *msg = Memcached::from_wire(view);
+  }
+
+  return status;
+}
+
+void Memcached::Connection::hold(Memcached::Message* msg)
+{
+  if (msg->_view.frame.data() != msg->_storage.data())
+  {
+    msg->_block = _buffer.hold();
+  }
+}
+
+Memcached::Status Memcached::Connection::recv(Memcached::Message*& msg)
+{
+  MsgView view;
+  Memcached::Status status = recv(view);
+
+  if (status == Memcached::Status::OK)
+  {
+    msg = _pool.get();
+    msg->_view = view;
+  }
+
+  return status;
+}
+
+Memcached::Status Memcached::Connection::recv(Memcached::MsgView& msg)
 {
   if (_sock == -1)
   {
     return Memcached::Status::DISCONNECTED;
   }
 
-  static const int BUFLEN = 16 * 1024;
-  char buf[BUFLEN];
-  ssize_t recv_size = 0;
+  consume_delivered();
 
-  bool finished = Memcached::from_wire(_buffer, *msg);
-  while (!finished)
+  while (!Memcached::parse(_buffer.data(), _buffer.length(), msg))
   {
-    recv_size = ::recv(_sock, buf, BUFLEN, 0);
+    Memcached::Status status = read_more();
+    if (status != Memcached::Status::OK)
+    {
+      return status;
+    }
+  }
+
+  _delivered_length = msg.frame.length();
+
+  return Memcached::Status::OK;
+}
 
-    if (recv_size > 0)
+Memcached::Status Memcached::Connection::recv_batch(std::vector<Memcached::Message*>& msgs)
+{
+  if (_sock == -1)
+  {
+    return Memcached::Status::DISCONNECTED;
+  }
+
+  consume_delivered();
+
+  // Walk along the buffer decoding messages until we hit one that is
+  // incomplete.  We only read from the socket if there wasn't a single
+  // complete message buffered - once we have a message we return what we've
+  // got rather than block for more.
+  size_t offset = 0;
+  size_t count = 0;
+  MsgView view;
+
+  while (true)
+  {
+    while (Memcached::parse(_buffer.data() + offset,
+                            _buffer.length() - offset,
+                            view))
     {
-      _buffer.append(buf, recv_size);
-      finished = Memcached::from_wire(_buffer, *msg);
+      Message* msg = _pool.get();
+      msg->_view = view;
+      msgs.push_back(msg);
+      offset += view.frame.length();
+      count++;
     }
-    else if (recv_size == 0)
+
+    if (count > 0)
     {
-      TRC_DEBUG("Socket closed by peer");
-      ::close(_sock); _sock = -1;
-      return Memcached::Status::DISCONNECTED;
+      break;
     }
-    else
+
+    Memcached::Status status = read_more();
+    if (status != Memcached::Status::OK)
+    {
+      return status;
+    }
+  }
+
+  _delivered_length = offset;
+
+  return Memcached::Status::OK;
+}
+
+bool Memcached::Connection::recv_ready()
+{
+  if (_sock == -1)
+  {
+    return true;
+  }
+
+  consume_delivered();
+
+  MsgView view;
+  while (!Memcached::parse(_buffer.data(), _buffer.length(), view))
+  {
+    Memcached::Status status = read_more(MSG_DONTWAIT);
+    if (status == Memcached::Status::WOULD_BLOCK)
+    {
+      return false;
+    }
+    else if (status != Memcached::Status::OK)
+    {
+      // `recv` returns the error straight away.
+      return true;
+    }
+  }
+
+  return true;
+}
+
+void Memcached::Connection::consume_delivered()
+{
+  _buffer.consume(_delivered_length);
+  _delivered_length = 0;
+}
+
+Memcached::Status Memcached::Connection::read_more(int flags)
+{
+  if (_external_io)
+  {
+    // The event loop appends data to the buffer as it arrives, so there's
+    // nothing to read unless the loop has seen the socket close.
+    if (_external_status != Memcached::Status::OK)
     {
-      int err = errno;
-      TRC_ERROR("Error during recv() on socket (%d: %s)",
-                err,
-                ::strerror(err));
       ::close(_sock); _sock = -1;
-      return Memcached::Status::ERROR;
+      return _external_status;
+    }
+
+    return Memcached::Status::WOULD_BLOCK;
+  }
+
+  static const size_t BUFLEN = 16 * 1024;
+
+  // Read straight into the receive buffer.  If we know how long the message at
+  // the front of the buffer is, make room for all of it so that large values
+  // arrive in as few reads as possible.
+  size_t space = BUFLEN;
+  if (_buffer.length() >= sizeof(MsgHdr))
+  {
+    size_t msg_length = sizeof(MsgHdr) + HDR_GET(_buffer.data(), body_length);
+    if (msg_length > _buffer.length())
+    {
+      space = std::max(space, msg_length - _buffer.length());
     }
   }
 
+  ssize_t recv_size = ::recv(_sock, _buffer.reserve(space), space, flags);
+
+  if (recv_size > 0)
+  {
+    _buffer.commit(recv_size);
+  }
+  else if ((recv_size < 0) &&
+           ((_nonblocking) || (flags & MSG_DONTWAIT)) &&
+           ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+  {
+    // Nothing more to read for now.
+    return Memcached::Status::WOULD_BLOCK;
+  }
+  else if (recv_size == 0)
+  {
+    TRC_DEBUG("Socket closed by peer");
+    ::close(_sock); _sock = -1;
+    return Memcached::Status::DISCONNECTED;
+  }
+  else
+  {
+    int err = errno;
+    TRC_ERROR("Error during recv() on socket (%d: %s)",
+              err,
+              ::strerror(err));
+    ::close(_sock); _sock = -1;
+    return Memcached::Status::ERROR;
+  }
+
   return Memcached::Status::OK;
 }
 
 Memcached::ClientConnection::ClientConnection(const std::string& address) :
-  Connection()
+  Connection(),
+  _connecting(false),
+  _addr_info(NULL)
 {
   _address = address;
 }
 
-int Memcached::ClientConnection::connect()
+Memcached::ClientConnection::~ClientConnection()
 {
-  struct addrinfo ai_hint;
-  memset(&ai_hint, 0x00, sizeof(ai_hint));
-  ai_hint.ai_family = AF_UNSPEC;
-  ai_hint.ai_socktype = SOCK_STREAM;
+  forget_address();
+}
 
-  std::string host;
-  int port;
-  if (!::Utils::split_host_port(_address, host, port))
+void Memcached::ClientConnection::forget_address()
+{
+  if (_addr_info != NULL)
   {
-    return -1;
+    ::freeaddrinfo(_addr_info); _addr_info = NULL;
   }
+}
 
-  struct addrinfo* ai;
-  int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &ai_hint, &ai);
-  if (rc < 0)
+int Memcached::ClientConnection::create_socket()
+{
+  // Throw away anything left over from a previous connection.
+  reset();
+
+  if (_addr_info == NULL)
   {
-    TRC_ERROR("Failed to resolve hostname %s (%d, %s)",
-              _address.c_str(),
-              rc,
-              gai_strerror(rc));
-    return rc;
+    struct addrinfo ai_hint;
+    memset(&ai_hint, 0x00, sizeof(ai_hint));
+    ai_hint.ai_family = AF_UNSPEC;
+    ai_hint.ai_socktype = SOCK_STREAM;
+
+    std::string host;
+    int port;
+    if (!::Utils::split_host_port(_address, host, port))
+    {
+      return -1;
+    }
+
+    int rc = getaddrinfo(host.c_str(),
+                         std::to_string(port).c_str(),
+                         &ai_hint,
+                         &_addr_info);
+    if (rc != 0)
+    {
+      TRC_ERROR("Failed to resolve hostname %s (%d, %s)",
+                _address.c_str(),
+                rc,
+                gai_strerror(rc));
+      _addr_info = NULL;
+      return rc;
+    }
   }
 
-  _sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  _sock = socket(_addr_info->ai_family,
+                 _addr_info->ai_socktype,
+                 _addr_info->ai_protocol);
   if (_sock < 0)
   {
     int err = errno;
@@ -497,7 +1221,18 @@ int Memcached::ClientConnection::connect()
     return err;
   }
 
-  if (::connect(_sock, ai->ai_addr, ai->ai_addrlen) < 0)
+  return 0;
+}
+
+int Memcached::ClientConnection::connect()
+{
+  int rc = create_socket();
+  if (rc != 0)
+  {
+    return rc;
+  }
+
+  if (::connect(_sock, _addr_info->ai_addr, _addr_info->ai_addrlen) < 0)
   {
     int err = errno;
     TRC_ERROR("Failed to connect to %s (%d: %s)",
@@ -505,11 +1240,17 @@ int Memcached::ClientConnection::connect()
               err,
               strerror(err));
     ::close(_sock); _sock = -1;
+
+    // If the connection was refused we reached the host and there's just
+    // nothing listening yet (for example, because memcached is restarting).
+    // Otherwise the server may have moved, so look it up again next time.
+    if (err != ECONNREFUSED)
+    {
+      forget_address();
+    }
     return err;
   }
 
-  ::freeaddrinfo(ai); ai = NULL;
-
   // Since Astaire uses blocking reads, set a (high) timeout on all read
   // operations on the socket.  In the mainline, we'd expect all reads to
   // succeed in < 100ms so using a timeout of 10s will never interfere with
@@ -529,6 +1270,142 @@ int Memcached::ClientConnection::connect()
   return 0;
 }
 
+int Memcached::ClientConnection::connect_async()
+{
+  int rc = create_socket();
+  if (rc != 0)
+  {
+    return rc;
+  }
+
+  if (!set_nonblocking())
+  {
+    ::close(_sock); _sock = -1;
+    return -1;
+  }
+
+  if (::connect(_sock, _addr_info->ai_addr, _addr_info->ai_addrlen) < 0)
+  {
+    int err = errno;
+    if (err != EINPROGRESS)
+    {
+      TRC_ERROR("Failed to connect to %s (%d: %s)",
+                _address.c_str(),
+                err,
+                strerror(err));
+      ::close(_sock); _sock = -1;
+
+      if (err != ECONNREFUSED)
+      {
+        forget_address();
+      }
+      return err;
+    }
+
+    // The connection will complete in the background.
+    _connecting = true;
+  }
+
+  return 0;
+}
+
+int Memcached::ClientConnection::complete_connect()
+{
+  int err = 0;
+  socklen_t err_len = sizeof(err);
+
+  if (::getsockopt(_sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+  {
+    err = errno;
+  }
+
+  _connecting = false;
+
+  if (err != 0)
+  {
+    TRC_ERROR("Failed to connect to %s (%d: %s)",
+              _address.c_str(),
+              err,
+              strerror(err));
+    ::close(_sock); _sock = -1;
+  }
+
+  return err;
+}
+
+Memcached::ClientConnectionPool::ClientConnectionPool(const std::string& address,
+                                                      size_t max_idle) :
+  _address(address),
+  _max_idle(max_idle),
+  _idle()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+Memcached::ClientConnectionPool::~ClientConnectionPool()
+{
+  for (std::vector<ClientConnection*>::iterator it = _idle.begin();
+       it != _idle.end();
+       ++it)
+  {
+    delete *it; *it = NULL;
+  }
+
+  pthread_mutex_destroy(&_lock);
+}
+
+Memcached::ClientConnection* Memcached::ClientConnectionPool::get()
+{
+  ClientConnection* conn = NULL;
+
+  pthread_mutex_lock(&_lock);
+  if (!_idle.empty())
+  {
+    conn = _idle.back();
+    _idle.pop_back();
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (conn == NULL)
+  {
+    conn = new ClientConnection(_address);
+  }
+
+  if (conn->fd() < 0)
+  {
+    int rc = conn->connect();
+    if (rc != 0)
+    {
+      TRC_VERBOSE("Failed to connect to %s, error was (%d)", _address.c_str(), rc);
+
+      // Keep hold of the connection anyway, as it may have cached the
+      // server's address.
+      put(conn, false);
+      return NULL;
+    }
+  }
+
+  return conn;
+}
+
+void Memcached::ClientConnectionPool::put(ClientConnection* conn, bool healthy)
+{
+  if (!healthy)
+  {
+    conn->disconnect();
+  }
+
+  pthread_mutex_lock(&_lock);
+  if (_idle.size() < _max_idle)
+  {
+    _idle.push_back(conn);
+    conn = NULL;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  delete conn; conn = NULL;
+}
+
 Memcached::ServerConnection::ServerConnection(int sock, const std::string& address) :
   Connection()
 {
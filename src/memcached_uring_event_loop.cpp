@@ -0,0 +1,913 @@
+/**
+ * @file memcached_uring_event_loop.cpp - io_uring-based event loop for
+ * memcached connections.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifdef HAVE_IO_URING
+
+#include "memcached_uring_event_loop.hpp"
+#include "log.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// Fill in the fields of a submission queue entry that most operations use.
+static void prep_rw(struct io_uring_sqe* sqe,
+                    uint8_t op_code,
+                    int fd,
+                    const void* addr,
+                    unsigned length,
+                    void* data)
+{
+  sqe->opcode = op_code;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)addr;
+  sqe->len = length;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+}
+
+// Receive repeatedly from a socket into buffers picked from a provided
+// buffer group, until the socket closes or the operation is cancelled.
+static void prep_recv_multishot(struct io_uring_sqe* sqe,
+                                int fd,
+                                uint16_t group,
+                                void* data)
+{
+  prep_rw(sqe, IORING_OP_RECV, fd, NULL, 0, data);
+  sqe->ioprio |= IORING_RECV_MULTISHOT;
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = group;
+}
+
+Memcached::UringEventLoop::Ring::Ring() :
+  _fd(-1),
+  _features(0),
+  _sq_map(MAP_FAILED),
+  _sq_map_size(0),
+  _cq_map(MAP_FAILED),
+  _cq_map_size(0),
+  _sqes((struct io_uring_sqe*)MAP_FAILED),
+  _sqes_size(0),
+  _sq_head(NULL),
+  _sq_tail(NULL),
+  _sq_mask(0),
+  _sq_entries(0),
+  _sq_local_tail(0),
+  _sq_submitted(0),
+  _cq_head(NULL),
+  _cq_tail(NULL),
+  _cq_mask(0),
+  _cqes(NULL),
+  _buf_ring((struct io_uring_buf_ring*)MAP_FAILED),
+  _buf_ring_size(0),
+  _buf_ring_mask(0)
+{
+}
+
+Memcached::UringEventLoop::Ring::~Ring()
+{
+  exit();
+}
+
+void Memcached::UringEventLoop::Ring::exit()
+{
+  // Closing the ring cancels everything still outstanding on it, so it must
+  // go before the memory the kernel shares with us.
+  if (_fd >= 0)
+  {
+    ::close(_fd); _fd = -1;
+  }
+
+  if (_buf_ring != MAP_FAILED)
+  {
+    ::munmap(_buf_ring, _buf_ring_size);
+    _buf_ring = (struct io_uring_buf_ring*)MAP_FAILED;
+  }
+
+  if (_sqes != MAP_FAILED)
+  {
+    ::munmap(_sqes, _sqes_size);
+    _sqes = (struct io_uring_sqe*)MAP_FAILED;
+  }
+
+  if (_cq_map != MAP_FAILED)
+  {
+    ::munmap(_cq_map, _cq_map_size);
+    _cq_map = MAP_FAILED;
+    _sq_map = MAP_FAILED;
+  }
+}
+
+int Memcached::UringEventLoop::Ring::init(unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  _fd = ::syscall(__NR_io_uring_setup, entries, &params);
+  if (_fd < 0)
+  {
+    return -errno;
+  }
+
+  // We rely on the submission and completion queues sharing one mapping, and
+  // on being able to pass a timeout when waiting, which every kernel with the
+  // operations we need supports.
+  _features = params.features;
+  if ((!(_features & IORING_FEAT_SINGLE_MMAP)) ||
+      (!(_features & IORING_FEAT_EXT_ARG)))
+  {
+    return -EOPNOTSUPP;
+  }
+
+  _sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cq_map_size = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+  _cq_map_size = std::max(_sq_map_size, _cq_map_size);
+
+  _cq_map = ::mmap(NULL,
+                   _cq_map_size,
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE,
+                   _fd,
+                   IORING_OFF_SQ_RING);
+  if (_cq_map == MAP_FAILED)
+  {
+    return -errno;
+  }
+  _sq_map = _cq_map;
+  _sq_map_size = _cq_map_size;
+
+  _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = (struct io_uring_sqe*)::mmap(NULL,
+                                       _sqes_size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE,
+                                       _fd,
+                                       IORING_OFF_SQES);
+  if (_sqes == MAP_FAILED)
+  {
+    return -errno;
+  }
+
+  char* sq = (char*)_sq_map;
+  _sq_head = (unsigned*)(sq + params.sq_off.head);
+  _sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  _sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  _sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+  _sq_local_tail = *_sq_tail;
+  _sq_submitted = *_sq_tail;
+
+  // Entries are always submitted in the order they were got, so the
+  // submission queue's indirection array never changes.
+  unsigned* array = (unsigned*)(sq + params.sq_off.array);
+  for (unsigned ii = 0; ii < _sq_entries; ++ii)
+  {
+    array[ii] = ii;
+  }
+
+  char* cq = (char*)_cq_map;
+  _cq_head = (unsigned*)(cq + params.cq_off.head);
+  _cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  _cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  _cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+struct io_uring_sqe* Memcached::UringEventLoop::Ring::get_sqe()
+{
+  unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+  if (_sq_local_tail - head >= _sq_entries)
+  {
+    return NULL;
+  }
+
+  struct io_uring_sqe* sqe = &_sqes[_sq_local_tail & _sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  _sq_local_tail++;
+  return sqe;
+}
+
+int Memcached::UringEventLoop::Ring::submit_and_wait(unsigned wait_nr,
+                                                      const struct __kernel_timespec* ts)
+{
+  // Publish the entries got since the last submission.
+  __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+  unsigned to_submit = _sq_local_tail - _sq_submitted;
+
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uint64_t)(uintptr_t)ts;
+
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  if (wait_nr > 0)
+  {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+
+  int rc = ::syscall(__NR_io_uring_enter,
+                     _fd,
+                     to_submit,
+                     wait_nr,
+                     flags,
+                     &arg,
+                     sizeof(arg));
+  if (rc < 0)
+  {
+    return -errno;
+  }
+
+  _sq_submitted += rc;
+  return rc;
+}
+
+struct io_uring_cqe* Memcached::UringEventLoop::Ring::peek_cqe(unsigned index)
+{
+  unsigned head = *_cq_head;
+  unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+  if (tail - head <= index)
+  {
+    return NULL;
+  }
+
+  return &_cqes[(head + index) & _cq_mask];
+}
+
+void Memcached::UringEventLoop::Ring::advance(unsigned count)
+{
+  __atomic_store_n(_cq_head, *_cq_head + count, __ATOMIC_RELEASE);
+}
+
+bool Memcached::UringEventLoop::Ring::op_supported(uint8_t op)
+{
+  static const unsigned MAX_OPS = 256;
+  std::vector<char> buf(sizeof(struct io_uring_probe) +
+                        MAX_OPS * sizeof(struct io_uring_probe_op), 0);
+  struct io_uring_probe* probe = (struct io_uring_probe*)buf.data();
+
+  if (::syscall(__NR_io_uring_register,
+                _fd,
+                IORING_REGISTER_PROBE,
+                probe,
+                MAX_OPS) < 0)
+  {
+    return false;
+  }
+
+  return ((op <= probe->last_op) &&
+          (probe->ops[op].flags & IO_URING_OP_SUPPORTED));
+}
+
+int Memcached::UringEventLoop::Ring::register_buffers(unsigned entries,
+                                                       uint16_t group)
+{
+  // The ring has to be page aligned, so is mapped rather than allocated.
+  _buf_ring_size = entries * sizeof(struct io_uring_buf);
+  _buf_ring = (struct io_uring_buf_ring*)::mmap(NULL,
+                                                _buf_ring_size,
+                                                PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANONYMOUS,
+                                                -1,
+                                                0);
+  if (_buf_ring == MAP_FAILED)
+  {
+    return -errno;
+  }
+
+  // Fault the ring in before the kernel pins it, as we share it from then on.
+  memset(_buf_ring, 0, _buf_ring_size);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)_buf_ring;
+  reg.ring_entries = entries;
+  reg.bgid = group;
+
+  if (::syscall(__NR_io_uring_register,
+                _fd,
+                IORING_REGISTER_PBUF_RING,
+                &reg,
+                1) < 0)
+  {
+    return -errno;
+  }
+
+  _buf_ring->tail = 0;
+  _buf_ring_mask = entries - 1;
+  return 0;
+}
+
+void Memcached::UringEventLoop::Ring::add_buffer(char* addr,
+                                                 unsigned length,
+                                                 uint16_t bid,
+                                                 unsigned offset)
+{
+  // The buffers overlay the ring's header, tail and all.  This doesn't use
+  // `bufs` to get at them, as the kernel header's flexible array is offset by
+  // its placeholder member when compiled as C++.
+  struct io_uring_buf* buf = (struct io_uring_buf*)_buf_ring +
+                             ((_buf_ring->tail + offset) & _buf_ring_mask);
+  buf->addr = (uint64_t)(uintptr_t)addr;
+  buf->len = length;
+  buf->bid = bid;
+}
+
+void Memcached::UringEventLoop::Ring::commit_buffers(unsigned count)
+{
+  __atomic_store_n(&_buf_ring->tail,
+                   (uint16_t)(_buf_ring->tail + count),
+                   __ATOMIC_RELEASE);
+}
+
+Memcached::UringEventLoop::UringEventLoop() :
+  EventLoop(),
+  _ring(),
+  _buffers(NULL),
+  _stop_fd(-1),
+  _stop_value(0),
+  _ring_enters(0),
+  _registrations(),
+  _removed()
+{
+  _stop_op.reg = NULL;
+  _stop_op.type = STOP;
+}
+
+Memcached::UringEventLoop::~UringEventLoop()
+{
+  // The ring must be torn down (cancelling every outstanding operation)
+  // before the memory those operations refer to.
+  _ring.exit();
+
+  for (std::map<Connection*, Registration*>::iterator it = _registrations.begin();
+       it != _registrations.end();
+       ++it)
+  {
+    delete it->second; it->second = NULL;
+  }
+
+  for (std::vector<Registration*>::iterator it = _removed.begin();
+       it != _removed.end();
+       ++it)
+  {
+    delete *it; *it = NULL;
+  }
+
+  delete[] _buffers; _buffers = NULL;
+
+  if (_stop_fd != -1)
+  {
+    ::close(_stop_fd); _stop_fd = -1;
+  }
+}
+
+bool Memcached::UringEventLoop::is_supported()
+{
+  Ring ring;
+  int rc = ring.init(8);
+  if (rc < 0)
+  {
+    TRC_DEBUG("io_uring not available (%d: %s)", -rc, ::strerror(-rc));
+    return false;
+  }
+
+  if ((!ring.op_supported(IORING_OP_RECV)) ||
+      (!ring.op_supported(IORING_OP_SEND)) ||
+      (!ring.op_supported(IORING_OP_POLL_ADD)) ||
+      (!ring.op_supported(IORING_OP_READ)) ||
+      (!ring.op_supported(IORING_OP_ASYNC_CANCEL)))
+  {
+    TRC_DEBUG("io_uring lacks the operations we need");
+    return false;
+  }
+
+  // Provided buffer rings.
+  rc = ring.register_buffers(1, BUFFER_GROUP);
+  if (rc < 0)
+  {
+    TRC_DEBUG("io_uring lacks provided buffer rings (%d: %s)", -rc, ::strerror(-rc));
+    return false;
+  }
+
+  // Multishot receive.  There's no way to ask about this other than trying
+  // it, so receive from one end of a socket pair and check that the receive
+  // is still armed after it has completed.  Older kernels fail it instead.
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+  {
+    return false;
+  }
+
+  char buf[16];
+  ring.add_buffer(buf, sizeof(buf), 0, 0);
+  ring.commit_buffers(1);
+
+  bool supported = false;
+  struct io_uring_sqe* sqe = ring.get_sqe();
+  prep_recv_multishot(sqe, fds[0], BUFFER_GROUP, NULL);
+
+  struct __kernel_timespec ts;
+  ts.tv_sec = 1;
+  ts.tv_nsec = 0;
+
+  if ((::send(fds[1], "x", 1, MSG_NOSIGNAL) == 1) &&
+      (ring.submit_and_wait(1, &ts) >= 0))
+  {
+    struct io_uring_cqe* cqe = ring.peek_cqe(0);
+    supported = ((cqe != NULL) &&
+                 (cqe->res == 1) &&
+                 (cqe->flags & IORING_CQE_F_BUFFER) &&
+                 (cqe->flags & IORING_CQE_F_MORE));
+  }
+
+  if (!supported)
+  {
+    TRC_DEBUG("io_uring lacks multishot receive");
+  }
+
+  // The ring goes before the socket pair and buffer, cancelling the receive.
+  ring.exit();
+  ::close(fds[0]);
+  ::close(fds[1]);
+
+  return supported;
+}
+
+bool Memcached::UringEventLoop::init()
+{
+  int rc = _ring.init(RING_ENTRIES);
+  if (rc < 0)
+  {
+    TRC_ERROR("Failed to create io_uring (%d: %s)", -rc, ::strerror(-rc));
+    return false;
+  }
+
+  rc = _ring.register_buffers(NUM_BUFFERS, BUFFER_GROUP);
+  if (rc < 0)
+  {
+    TRC_ERROR("Failed to register receive buffers (%d: %s)", -rc, ::strerror(-rc));
+    return false;
+  }
+
+  _buffers = new char[NUM_BUFFERS * BUFFER_SIZE];
+  for (unsigned ii = 0; ii < NUM_BUFFERS; ++ii)
+  {
+    _ring.add_buffer(_buffers + ii * BUFFER_SIZE, BUFFER_SIZE, ii, ii);
+  }
+  _ring.commit_buffers(NUM_BUFFERS);
+
+  _stop_fd = ::eventfd(0, EFD_CLOEXEC);
+  if (_stop_fd < 0)
+  {
+    int err = errno;
+    TRC_ERROR("Failed to create eventfd (%d: %s)", err, ::strerror(err));
+    return false;
+  }
+
+  arm_stop();
+
+  return true;
+}
+
+bool Memcached::UringEventLoop::add(Connection* conn, Handler* handler)
+{
+  if (conn->fd() < 0)
+  {
+    TRC_ERROR("Cannot watch connection to %s as it is not connected",
+              conn->address().c_str());
+    return false;
+  }
+
+  if (!conn->is_nonblocking())
+  {
+    TRC_ERROR("Cannot watch connection to %s as it is in blocking mode",
+              conn->address().c_str());
+    return false;
+  }
+
+  Registration* reg = new Registration();
+  reg->conn = conn;
+  reg->handler = handler;
+  reg->fd = conn->fd();
+  reg->removed = false;
+  reg->recv_op.reg = reg;
+  reg->recv_op.type = RECV;
+  reg->send_op.reg = reg;
+  reg->send_op.type = SEND;
+  reg->connect_op.reg = reg;
+  reg->connect_op.type = CONNECT;
+  reg->recv_armed = false;
+  reg->send_in_flight = false;
+  reg->connect_in_flight = false;
+  reg->sent = 0;
+
+  _registrations[conn] = reg;
+
+  // From now on we do the connection's I/O.
+  conn->set_external_io(true);
+
+  if (conn->is_connecting())
+  {
+    arm_connect(reg);
+  }
+  else
+  {
+    arm_recv(reg);
+    after_handler(reg);
+  }
+
+  return true;
+}
+
+void Memcached::UringEventLoop::remove(Connection* conn)
+{
+  std::map<Connection*, Registration*>::iterator it = _registrations.find(conn);
+  if (it == _registrations.end())
+  {
+    return;
+  }
+
+  Registration* reg = it->second;
+  _registrations.erase(it);
+
+  // Hand the connection's I/O back.  Anything it had queued that we haven't
+  // started sending stays queued on it.
+  conn->set_external_io(false);
+  reg->removed = true;
+
+  // Cancel the operations that would otherwise never complete.  A send in
+  // flight is left to finish, as the data it refers to belongs to us.
+  if (reg->recv_armed)
+  {
+    cancel(&reg->recv_op);
+  }
+
+  if (reg->connect_in_flight)
+  {
+    cancel(&reg->connect_op);
+  }
+
+  _removed.push_back(reg);
+}
+
+void Memcached::UringEventLoop::update(Connection* conn)
+{
+  std::map<Connection*, Registration*>::iterator it = _registrations.find(conn);
+  if (it != _registrations.end())
+  {
+    after_handler(it->second);
+  }
+}
+
+struct io_uring_sqe* Memcached::UringEventLoop::get_sqe()
+{
+  struct io_uring_sqe* sqe = _ring.get_sqe();
+
+  if (sqe == NULL)
+  {
+    // The submission queue is full.  Submit what's there to make space.
+    _ring.submit_and_wait(0, NULL);
+    _ring_enters++;
+    sqe = _ring.get_sqe();
+
+    if (sqe == NULL)
+    {
+      TRC_ERROR("No space in io_uring submission queue");
+    }
+  }
+
+  return sqe;
+}
+
+void Memcached::UringEventLoop::arm_recv(Registration* reg)
+{
+  struct io_uring_sqe* sqe = get_sqe();
+  if (sqe == NULL)
+  {
+    return;
+  }
+
+  prep_recv_multishot(sqe, reg->fd, BUFFER_GROUP, &reg->recv_op);
+  reg->recv_armed = true;
+}
+
+void Memcached::UringEventLoop::arm_connect(Registration* reg)
+{
+  struct io_uring_sqe* sqe = get_sqe();
+  if (sqe == NULL)
+  {
+    return;
+  }
+
+  // A non-blocking connect reports its result by the socket becoming
+  // writable.
+  prep_rw(sqe, IORING_OP_POLL_ADD, reg->fd, NULL, 0, &reg->connect_op);
+  sqe->poll32_events = POLLOUT;
+  reg->connect_in_flight = true;
+}
+
+void Memcached::UringEventLoop::arm_stop()
+{
+  struct io_uring_sqe* sqe = get_sqe();
+  if (sqe == NULL)
+  {
+    return;
+  }
+
+  prep_rw(sqe, IORING_OP_READ, _stop_fd, &_stop_value, sizeof(_stop_value), &_stop_op);
+}
+
+void Memcached::UringEventLoop::cancel(Op* op)
+{
+  struct io_uring_sqe* sqe = get_sqe();
+  if (sqe == NULL)
+  {
+    return;
+  }
+
+  // The cancellation's own completion has no Op, so is ignored.
+  prep_rw(sqe, IORING_OP_ASYNC_CANCEL, -1, op, 0, NULL);
+}
+
+void Memcached::UringEventLoop::start_send(Registration* reg)
+{
+  // Swapping the output out of the connection means handlers can keep
+  // queuing more while this is in flight.
+  reg->conn->take_queued_output(reg->sending);
+  reg->sent = 0;
+  submit_send(reg);
+}
+
+void Memcached::UringEventLoop::submit_send(Registration* reg)
+{
+  struct io_uring_sqe* sqe = get_sqe();
+  if (sqe == NULL)
+  {
+    return;
+  }
+
+  prep_rw(sqe,
+          IORING_OP_SEND,
+          reg->fd,
+          reg->sending.data() + reg->sent,
+          reg->sending.length() - reg->sent,
+          &reg->send_op);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  reg->send_in_flight = true;
+}
+
+void Memcached::UringEventLoop::after_handler(Registration* reg)
+{
+  if ((!reg->removed) &&
+      (!reg->send_in_flight) &&
+      (!reg->conn->is_connecting()) &&
+      (reg->conn->has_queued_output()))
+  {
+    start_send(reg);
+  }
+}
+
+void Memcached::UringEventLoop::handle_recv(Registration* reg,
+                                            struct io_uring_cqe* cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+  {
+    // The multishot receive has finished.  We re-arm it below if the
+    // connection is still open.
+    reg->recv_armed = false;
+  }
+
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+  {
+    // Copy the data out and give the buffer straight back to the kernel.
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char* buf = _buffers + bid * BUFFER_SIZE;
+
+    if ((!reg->removed) && (cqe->res > 0))
+    {
+      reg->conn->append_received(buf, cqe->res);
+    }
+
+    _ring.add_buffer(buf, BUFFER_SIZE, bid, 0);
+    _ring.commit_buffers(1);
+  }
+
+  if (reg->removed)
+  {
+    return;
+  }
+
+  if (cqe->res == 0)
+  {
+    TRC_DEBUG("Socket closed by peer");
+    reg->conn->set_external_status(Status::DISCONNECTED);
+    reg->handler->on_readable(reg->conn);
+
+    // If there were complete messages buffered, the handler got those rather
+    // than hearing about the close, so call it again.
+    if ((!reg->removed) && (reg->conn->fd() >= 0))
+    {
+      reg->handler->on_readable(reg->conn);
+    }
+    return;
+  }
+  else if ((cqe->res < 0) && (cqe->res != -ENOBUFS))
+  {
+    // Running out of buffers just means we're reading faster than we're
+    // processing - we re-arm below, by which time buffers will have been
+    // returned.  Anything else is a real error.
+    TRC_ERROR("Error during recv() on socket (%d: %s)",
+              -cqe->res,
+              ::strerror(-cqe->res));
+    reg->conn->set_external_status(Status::ERROR);
+    reg->handler->on_readable(reg->conn);
+
+    if ((!reg->removed) && (reg->conn->fd() >= 0))
+    {
+      reg->handler->on_readable(reg->conn);
+    }
+    return;
+  }
+
+  if (cqe->res > 0)
+  {
+    reg->handler->on_readable(reg->conn);
+  }
+
+  if ((!reg->removed) && (!reg->recv_armed))
+  {
+    arm_recv(reg);
+  }
+}
+
+void Memcached::UringEventLoop::handle_send(Registration* reg,
+                                            struct io_uring_cqe* cqe)
+{
+  reg->send_in_flight = false;
+
+  if (reg->removed)
+  {
+    return;
+  }
+
+  if (cqe->res < 0)
+  {
+    TRC_ERROR("Error during send() on socket (%d: %s)",
+              -cqe->res,
+              ::strerror(-cqe->res));
+    reg->sending.clear();
+    reg->conn->disconnect();
+    reg->handler->on_error(reg->conn, Status::ERROR);
+    return;
+  }
+
+  reg->sent += cqe->res;
+
+  if (reg->sent < reg->sending.length())
+  {
+    // The socket didn't take all of it.  Send the rest.
+    submit_send(reg);
+  }
+  else if (reg->conn->has_queued_output())
+  {
+    start_send(reg);
+  }
+  else
+  {
+    reg->handler->on_writable(reg->conn);
+  }
+}
+
+void Memcached::UringEventLoop::handle_connect(Registration* reg,
+                                               struct io_uring_cqe* cqe)
+{
+  reg->connect_in_flight = false;
+
+  if (reg->removed)
+  {
+    return;
+  }
+
+  ClientConnection* client_conn = static_cast<ClientConnection*>(reg->conn);
+  int rc = client_conn->complete_connect();
+  reg->handler->on_connected(client_conn, rc);
+
+  if ((rc == 0) && (!reg->removed))
+  {
+    arm_recv(reg);
+  }
+}
+
+int Memcached::UringEventLoop::poll(int timeout_ms)
+{
+  struct __kernel_timespec ts;
+  struct __kernel_timespec* ts_ptr = NULL;
+
+  if (timeout_ms >= 0)
+  {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    ts_ptr = &ts;
+  }
+
+  // Submit everything queued since the last poll and wait for completions in
+  // one go, unless there are completions waiting already.
+  int rc = _ring.submit_and_wait((_ring.peek_cqe(0) == NULL) ? 1 : 0, ts_ptr);
+  _ring_enters++;
+
+  if ((rc < 0) && (rc != -ETIME) && (rc != -EINTR))
+  {
+    TRC_ERROR("Error waiting for completions (%d: %s)", -rc, ::strerror(-rc));
+    return -1;
+  }
+
+  // Handle the completions in place, and hand their slots back to the kernel
+  // once they have all been handled.
+  unsigned num_cqes = 0;
+  struct io_uring_cqe* cqe;
+
+  while ((num_cqes < MAX_CQES) && ((cqe = _ring.peek_cqe(num_cqes)) != NULL))
+  {
+    num_cqes++;
+    Op* op = (Op*)(uintptr_t)cqe->user_data;
+
+    if (op == NULL)
+    {
+      // Completion of a cancellation.
+      continue;
+    }
+
+    switch (op->type)
+    {
+    case RECV:
+      handle_recv(op->reg, cqe);
+      after_handler(op->reg);
+      break;
+
+    case SEND:
+      handle_send(op->reg, cqe);
+      after_handler(op->reg);
+      break;
+
+    case CONNECT:
+      handle_connect(op->reg, cqe);
+      after_handler(op->reg);
+      break;
+
+    case STOP:
+      TRC_DEBUG("Event loop stopped");
+      _stopped = true;
+      arm_stop();
+      break;
+    }
+  }
+
+  _ring.advance(num_cqes);
+
+  // Free removed registrations that no longer have anything in flight.
+  std::vector<Registration*>::iterator it = _removed.begin();
+  while (it != _removed.end())
+  {
+    Registration* reg = *it;
+
+    if ((!reg->recv_armed) && (!reg->send_in_flight) && (!reg->connect_in_flight))
+    {
+      delete reg; reg = NULL;
+      it = _removed.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+
+  return num_cqes;
+}
+
+void Memcached::UringEventLoop::stop()
+{
+  uint64_t count = 1;
+  if (::write(_stop_fd, &count, sizeof(count)) < 0)
+  {
+    int err = errno;
+    TRC_ERROR("Failed to stop event loop (%d: %s)", err, ::strerror(err));
+  }
+}
+
+#endif
@@ -15,6 +15,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <atomic>
+#include <vector>
 
 #include "log.h"
 #include "memcached_tap_client.hpp"
@@ -223,82 +224,33 @@ void ProxyServer::connection_thread_fn(Memcached::ServerConnection* connection)
              connection->address().c_str(),
              num_active_threads.load());
 
+  std::vector<Memcached::Message*> msgs;
+  QuietGetList quiet_gets;
+
   while (keep_going)
   {
-    Memcached::BaseMessage* msg = NULL;
-    Memcached::Status status = connection->recv(&msg);
+    // Pick up every request the client has pipelined to us so far.
+    Memcached::Status status = connection->recv_batch(msgs);
 
     if (status == Memcached::Status::OK)
     {
-      if (msg->is_request())
+      // Handle the requests in the order they arrived, stopping if one of
+      // them means we should close the connection.
+      for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+           keep_going && (it != msgs.end());
+           ++it)
       {
-        Memcached::BaseReq* req = dynamic_cast<Memcached::BaseReq*>(msg);
-        TRC_VERBOSE("Received request with type: 0x%x from %s", req->op_code(), connection->address().c_str());
-
-        switch (req->op_code())
-        {
-        case (uint8_t)Memcached::OpCode::GET:
-        case (uint8_t)Memcached::OpCode::GETK:
-          {
-            Memcached::GetReq* get_req = dynamic_cast<Memcached::GetReq*>(msg);
-            handle_get(get_req, connection);
-          }
-          break;
-
-        case (uint8_t)Memcached::OpCode::ADD:
-        case (uint8_t)Memcached::OpCode::SET:
-        case (uint8_t)Memcached::OpCode::REPLACE:
-          {
-            Memcached::SetAddReplaceReq* sar_req =
-              dynamic_cast<Memcached::SetAddReplaceReq*>(msg);
-            handle_set_add_replace(sar_req, connection);
-          }
-          break;
-
-        case (uint8_t)Memcached::OpCode::DELETE:
-          {
-            Memcached::DeleteReq* delete_req =
-              dynamic_cast<Memcached::DeleteReq*>(msg);
-            handle_delete(delete_req, connection);
-          }
-          break;
-
-        case (uint8_t)Memcached::OpCode::VERSION:
-          {
-            Memcached::VersionRsp* version_rsp =
-              new Memcached::VersionRsp((uint16_t)Memcached::ResultCode::NO_ERROR,
-                                        req->opaque(),
-                                        "1.6.0_beta1_106_g62c7e7a");
-            connection->send(*version_rsp);
-            delete version_rsp; version_rsp = NULL;
-          }
-          break;
-
-        case (uint8_t)Memcached::OpCode::QUIT:
-          {
-            TRC_DEBUG("QUIT operation received");
-            keep_going = false;
-          }
-          break;
-
-        default:
-          {
-            TRC_WARNING("Unrecognized operation: %d", req->op_code());
-            keep_going = false;
-          }
-          break;
-        }
+        keep_going = handle_message(**it, connection, quiet_gets);
       }
-      else
+
+      // Return the messages to the connection's pool now they've been handled.
+      for (std::vector<Memcached::Message*>::iterator it = msgs.begin();
+           it != msgs.end();
+           ++it)
       {
-        // We shouldn't receive responses. Break out of the loop so we'll close
-        // the connection.
-        TRC_WARNING("Received unexpected response with type: 0x%x", msg->op_code());
-        keep_going = false;
+        connection->release(*it);
       }
-
-      // We can delete the original message now.
-      delete msg; msg = NULL;
+      msgs.clear();
     }
     else if (status == Memcached::Status::DISCONNECTED)
     {
@@ -318,61 +270,206 @@ void ProxyServer::connection_thread_fn(Memcached::ServerConnection* connection)
   num_active_threads--;
 }
 
-void ProxyServer::handle_get(Memcached::GetReq* get_req,
+bool ProxyServer::handle_message(const Memcached::Message& msg,
+                                 Memcached::ServerConnection* connection,
+                                 QuietGetList& quiet_gets)
+{
+  bool keep_going = true;
+
+  if (msg.is_request())
+  {
+    TRC_VERBOSE("Received request with type: 0x%x from %s", msg.op_code(), connection->address().c_str());
+
+    // Quiet GETs are collected until the client sends something else
+    // (normally a NOOP), at which point we fetch them all together.  Their
+    // responses must go out before the response to the new request.
+    if ((msg.op_code() != (uint8_t)Memcached::OpCode::GETQ) &&
+        (msg.op_code() != (uint8_t)Memcached::OpCode::GETKQ) &&
+        (!quiet_gets.empty()))
+    {
+      handle_quiet_gets(quiet_gets, connection);
+    }
+
+    switch (msg.op_code())
+    {
+    case (uint8_t)Memcached::OpCode::GET:
+    case (uint8_t)Memcached::OpCode::GETK:
+      handle_get(msg, connection);
+      break;
+
+    case (uint8_t)Memcached::OpCode::GETQ:
+    case (uint8_t)Memcached::OpCode::GETKQ:
+      {
+        QuietGet quiet_get;
+        quiet_get.key = msg.key().to_string();
+        quiet_get.opaque = msg.opaque();
+        quiet_get.response_needs_key = msg.response_needs_key();
+        quiet_gets.push_back(quiet_get);
+
+        if (quiet_gets.size() >= MAX_QUIET_GETS)
+        {
+          handle_quiet_gets(quiet_gets, connection);
+        }
+      }
+      break;
+
+    case (uint8_t)Memcached::OpCode::ADD:
+    case (uint8_t)Memcached::OpCode::SET:
+    case (uint8_t)Memcached::OpCode::REPLACE:
+    case (uint8_t)Memcached::OpCode::ADDQ:
+    case (uint8_t)Memcached::OpCode::SETQ:
+    case (uint8_t)Memcached::OpCode::REPLACEQ:
+      handle_set_add_replace(msg, connection);
+      break;
+
+    case (uint8_t)Memcached::OpCode::DELETE:
+    case (uint8_t)Memcached::OpCode::DELETEQ:
+      handle_delete(msg, connection);
+      break;
+
+    case (uint8_t)Memcached::OpCode::NOOP:
+      {
+        // Any quiet GETs have been answered above, so this marks the end of
+        // their responses.
+        Memcached::NoopRsp noop_rsp(msg.opaque());
+        connection->send(noop_rsp);
+      }
+      break;
+
+    case (uint8_t)Memcached::OpCode::VERSION:
+      {
+        Memcached::VersionRsp version_rsp((uint16_t)Memcached::ResultCode::NO_ERROR,
+                                          msg.opaque(),
+                                          "1.6.0_beta1_106_g62c7e7a");
+        connection->send(version_rsp);
+      }
+      break;
+
+    case (uint8_t)Memcached::OpCode::QUIT:
+    case (uint8_t)Memcached::OpCode::QUITQ:
+      {
+        TRC_DEBUG("QUIT operation received");
+        keep_going = false;
+      }
+      break;
+
+    default:
+      {
+        TRC_WARNING("Unrecognized operation: %d", msg.op_code());
+        keep_going = false;
+      }
+      break;
+    }
+  }
+  else
+  {
+    // We shouldn't receive responses. Break out of the loop so we'll close
+    // the connection.
+    TRC_WARNING("Received unexpected response with type: 0x%x", msg.op_code());
+    keep_going = false;
+  }
+
+  return keep_going;
+}
+
+void ProxyServer::handle_get(const Memcached::Message& get_req,
                              Memcached::ServerConnection* connection)
 {
   Memcached::ResultCode status;
   std::string value;
-  std::string key;
+  std::string key = get_req.key().to_string();
   uint64_t cas;
 
-  status = _backend->read_data(get_req->key(), value, cas);
+  status = _backend->read_data(key, value, cas);
+
+  if (!get_req.response_needs_key())
+  {
+    key.clear();
+  }
+
+  Memcached::GetRsp get_rsp((uint16_t)status,
+                            get_req.opaque(),
+                            cas,
+                            std::move(value),
+                            0,
+                            key);
+  connection->send(get_rsp);
+}
+
+void ProxyServer::handle_quiet_gets(QuietGetList& quiet_gets,
+                                    Memcached::ServerConnection* connection)
+{
+  std::vector<std::string> keys;
+  keys.reserve(quiet_gets.size());
 
-  if (get_req->response_needs_key())
+  for (QuietGetList::const_iterator it = quiet_gets.begin();
+       it != quiet_gets.end();
+       ++it)
   {
-    key = get_req->key();
+    keys.push_back(it->key);
   }
 
-  Memcached::GetRsp* get_rsp =
-    new Memcached::GetRsp((uint16_t)status,
-                          get_req->opaque(),
-                          cas,
-                          value,
-                          0,
-                          key);
-  connection->send(*get_rsp);
-  delete get_rsp; get_rsp = NULL;
+  std::vector<Memcached::ResultCode> statuses;
+  std::vector<std::string> values;
+  std::vector<uint64_t> cas;
+  _backend->read_data_multi(keys, statuses, values, cas);
+
+  for (size_t ii = 0; ii < quiet_gets.size(); ++ii)
+  {
+    // Quiet GETs don't get a response if the key isn't found.
+    if (statuses[ii] != Memcached::ResultCode::KEY_NOT_FOUND)
+    {
+      Memcached::GetRsp get_rsp((uint16_t)statuses[ii],
+                                quiet_gets[ii].opaque,
+                                cas[ii],
+                                std::move(values[ii]),
+                                0,
+                                quiet_gets[ii].response_needs_key ?
+                                  quiet_gets[ii].key : "");
+      get_rsp.make_quiet();
+      connection->send(get_rsp);
+    }
+  }
+
+  quiet_gets.clear();
 }
 
-void ProxyServer::handle_set_add_replace(Memcached::SetAddReplaceReq* sar_req,
+void ProxyServer::handle_set_add_replace(const Memcached::Message& sar_req,
                                          Memcached::ServerConnection* connection)
 {
   Memcached::ResultCode status;
 
-  status = _backend->write_data((Memcached::OpCode)sar_req->op_code(),
-                                sar_req->key(),
-                                sar_req->value(),
-                                sar_req->cas(),
-                                sar_req->expiry());
-
-  Memcached::SetAddReplaceRsp* sar_rsp =
-    new Memcached::SetAddReplaceRsp((uint8_t)sar_req->op_code(),
-                                    (uint16_t)status,
-                                    sar_req->opaque());
-  connection->send(*sar_rsp);
-  delete sar_rsp; sar_rsp = NULL;
+  status = _backend->write_data((Memcached::OpCode)Memcached::unquiet(sar_req.op_code()),
+                                sar_req.key().to_string(),
+                                sar_req.value().to_string(),
+                                sar_req.cas(),
+                                sar_req.expiry());
+
+  // Quiet requests only get a response if they fail.
+  if ((!Memcached::is_quiet(sar_req.op_code())) ||
+      (status != Memcached::ResultCode::NO_ERROR))
+  {
+    Memcached::SetAddReplaceRsp sar_rsp((uint8_t)sar_req.op_code(),
+                                        (uint16_t)status,
+                                        sar_req.opaque());
+    connection->send(sar_rsp);
+  }
 }
 
-void ProxyServer::handle_delete(Memcached::DeleteReq* delete_req,
+void ProxyServer::handle_delete(const Memcached::Message& delete_req,
                                 Memcached::ServerConnection* connection)
 {
   Memcached::ResultCode status;
 
-  status = _backend->delete_data(delete_req->key());
+  status = _backend->delete_data(delete_req.key().to_string());
 
-  Memcached::DeleteRsp* delete_rsp =
-    new Memcached::DeleteRsp((uint16_t)status, delete_req->opaque());
-
-  connection->send(*delete_rsp);
-  delete delete_rsp; delete_rsp = NULL;
+  // Quiet requests only get a response if they fail.
+  if ((!Memcached::is_quiet(delete_req.op_code())) ||
+      (status != Memcached::ResultCode::NO_ERROR))
+  {
+    Memcached::DeleteRsp delete_rsp((uint16_t)status,
+                                    delete_req.opaque(),
+                                    delete_req.op_code());
+    connection->send(delete_rsp);
+  }
 }
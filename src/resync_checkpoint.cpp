@@ -0,0 +1,215 @@
+/**
+ * @file resync_checkpoint.cpp - Records the progress of a resync on disk
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "resync_checkpoint.hpp"
+#include "vbucket_hash.hpp"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+
+const std::string CHECKPOINT_HEADER = "astaire-resync-checkpoint 1";
+
+ResyncCheckpoint::ResyncCheckpoint(const std::string& filename) :
+  _filename(filename),
+  _fd(-1)
+{
+}
+
+ResyncCheckpoint::~ResyncCheckpoint()
+{
+  close_file();
+}
+
+// The ID is the type of resync, the number of vbuckets, and a hash of every
+// vbucket and its replicas.
+std::string ResyncCheckpoint::view_id(const WorkList& owl, bool full_resync)
+{
+  std::string description;
+  for (WorkList::const_iterator it = owl.begin(); it != owl.end(); ++it)
+  {
+    description += std::to_string(it->first);
+    for (std::vector<std::string>::const_iterator replica = it->second.begin();
+         replica != it->second.end();
+         ++replica)
+    {
+      description += " " + *replica;
+    }
+    description += "\n";
+  }
+
+  char hash[9];
+  snprintf(hash, sizeof(hash), "%08x", VBucketHash::hash(description));
+
+  return std::string(full_resync ? "full-" : "minimal-") +
+         std::to_string(owl.size()) + "-" + hash;
+}
+
+std::string ResyncCheckpoint::generate_id()
+{
+  std::random_device rd;
+  char id[17];
+  snprintf(id, sizeof(id), "%08x%08x", (unsigned int)rd(), (unsigned int)rd());
+  return id;
+}
+
+bool ResyncCheckpoint::load(const std::string& view_id,
+                            std::string& resync_id,
+                            CompletedSet& completed)
+{
+  std::ifstream file(_filename.c_str());
+  if (!file.is_open())
+  {
+    TRC_DEBUG("No resync checkpoint in %s", _filename.c_str());
+    return false;
+  }
+
+  std::string line;
+  std::string file_view_id;
+  resync_id.clear();
+  completed.clear();
+
+  if ((!std::getline(file, line)) || (line != CHECKPOINT_HEADER))
+  {
+    TRC_WARNING("Ignoring invalid resync checkpoint %s", _filename.c_str());
+    return false;
+  }
+
+  while (std::getline(file, line))
+  {
+    // The last line may be incomplete if we crashed while writing it, in
+    // which case it won't parse and is ignored.
+    std::istringstream iss(line);
+    std::string type;
+    iss >> type;
+
+    if (type == "view")
+    {
+      iss >> file_view_id;
+    }
+    else if (type == "resync")
+    {
+      iss >> resync_id;
+    }
+    else if (type == "done")
+    {
+      int vbucket = -1;
+      std::string server;
+      iss >> vbucket >> server;
+      if ((!iss.fail()) && (vbucket >= 0) && (!server.empty()))
+      {
+        completed.insert(std::make_pair((uint16_t)vbucket, server));
+      }
+    }
+  }
+
+  if ((file_view_id != view_id) || (resync_id.empty()))
+  {
+    TRC_INFO("Resync checkpoint is for a different view (%s, now %s)",
+             file_view_id.c_str(), view_id.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+void ResyncCheckpoint::resume()
+{
+  close_file();
+  _fd = open(_filename.c_str(), O_WRONLY | O_APPEND);
+  if (_fd < 0)
+  {
+    TRC_WARNING("Failed to open resync checkpoint %s (%d), progress won't be saved",
+                _filename.c_str(), errno);
+  }
+}
+
+// Write the new checkpoint to a temporary file and rename it into place, so
+// that there is never a half-written header on disk.
+std::string ResyncCheckpoint::start(const std::string& view_id)
+{
+  close_file();
+
+  std::string resync_id = generate_id();
+  std::string header = CHECKPOINT_HEADER + "\n" +
+                       "view " + view_id + "\n" +
+                       "resync " + resync_id + "\n";
+  std::string tmp_filename = _filename + ".tmp";
+
+  int fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if ((fd < 0) ||
+      (write(fd, header.data(), header.length()) != (ssize_t)header.length()) ||
+      (fsync(fd) != 0) ||
+      (rename(tmp_filename.c_str(), _filename.c_str()) != 0))
+  {
+    TRC_WARNING("Failed to write resync checkpoint %s (%d), progress won't be saved",
+                _filename.c_str(), errno);
+    if (fd >= 0)
+    {
+      close(fd);
+      unlink(tmp_filename.c_str());
+    }
+    return resync_id;
+  }
+
+  _fd = fd;
+  lseek(_fd, 0, SEEK_END);
+  return resync_id;
+}
+
+void ResyncCheckpoint::record(const std::vector<uint16_t>& buckets,
+                              const std::string& server)
+{
+  if (_fd < 0)
+  {
+    return;
+  }
+
+  std::string lines;
+  for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+       it != buckets.end();
+       ++it)
+  {
+    lines += "done " + std::to_string(*it) + " " + server + "\n";
+  }
+
+  if ((write(_fd, lines.data(), lines.length()) != (ssize_t)lines.length()) ||
+      (fdatasync(_fd) != 0))
+  {
+    TRC_WARNING("Failed to update resync checkpoint %s (%d)",
+                _filename.c_str(), errno);
+  }
+}
+
+void ResyncCheckpoint::clear()
+{
+  close_file();
+  if ((unlink(_filename.c_str()) != 0) && (errno != ENOENT))
+  {
+    TRC_WARNING("Failed to remove resync checkpoint %s (%d)",
+                _filename.c_str(), errno);
+  }
+}
+
+void ResyncCheckpoint::close_file()
+{
+  if (_fd >= 0)
+  {
+    close(_fd);
+    _fd = -1;
+  }
+}
@@ -0,0 +1,108 @@
+/**
+ * @file resync_concurrency_controller.cpp - Adapts how hard Astaire resyncs
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "resync_concurrency_controller.hpp"
+#include "log.h"
+
+#include <algorithm>
+
+// How many latencies to collect before adjusting the window.  This is enough
+// for the 99th percentile to mean something.
+const size_t SAMPLES_PER_ADJUSTMENT = 256;
+
+// How much the window grows by after a batch of latencies under the target.
+const uint32_t ADDITIVE_INCREASE = 4;
+
+// Each tap should be able to have at least this many requests in flight
+// before it's worth running another one.
+const uint32_t MIN_STREAM_DEPTH = 8;
+
+ResyncConcurrencyController::ResyncConcurrencyController(AstaireGlobalStatistics* global_stats,
+                                                         uint32_t target_latency_us,
+                                                         uint32_t initial_window,
+                                                         uint32_t max_window) :
+  _global_stats(global_stats),
+  _target_latency_us(target_latency_us),
+  _max_window(std::max(max_window, (uint32_t)1)),
+  _window(std::min(std::max(initial_window, (uint32_t)1), _max_window)),
+  _streams(0),
+  _samples()
+{
+  pthread_mutex_init(&_lock, NULL);
+  _samples.reserve(SAMPLES_PER_ADJUSTMENT);
+  _global_stats->set_concurrency_window(_window.load());
+}
+
+ResyncConcurrencyController::~ResyncConcurrencyController()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void ResyncConcurrencyController::record_latencies(const std::vector<uint32_t>& latencies_us)
+{
+  pthread_mutex_lock(&_lock);
+  _samples.insert(_samples.end(), latencies_us.begin(), latencies_us.end());
+
+  if (_samples.size() >= SAMPLES_PER_ADJUSTMENT)
+  {
+    std::vector<uint32_t>::iterator p99 =
+      _samples.begin() + (_samples.size() * 99) / 100;
+    std::nth_element(_samples.begin(), p99, _samples.end());
+    adjust_window(*p99);
+    _samples.clear();
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void ResyncConcurrencyController::stream_started()
+{
+  _streams.fetch_add(1);
+}
+
+void ResyncConcurrencyController::stream_finished()
+{
+  _streams.fetch_sub(1);
+}
+
+uint32_t ResyncConcurrencyController::pipeline_depth(uint32_t max_depth) const
+{
+  uint32_t streams = std::max((uint32_t)_streams.load(), (uint32_t)1);
+  uint32_t depth = _window.load() / streams;
+  return std::min(std::max(depth, (uint32_t)1), max_depth);
+}
+
+bool ResyncConcurrencyController::may_start_stream() const
+{
+  uint32_t streams = _streams.load();
+  return ((streams == 0) ||
+          ((streams + 1) * MIN_STREAM_DEPTH <= _window.load()));
+}
+
+// Must be called with the lock held.
+void ResyncConcurrencyController::adjust_window(uint32_t p99_latency_us)
+{
+  uint32_t window = _window.load();
+
+  if (p99_latency_us > _target_latency_us)
+  {
+    window = std::max(window / 2, (uint32_t)1);
+    TRC_DEBUG("Local p99 latency %uus over target %uus, reduce window to %u",
+              p99_latency_us, _target_latency_us, window);
+  }
+  else
+  {
+    window = std::min(window + ADDITIVE_INCREASE, _max_window);
+  }
+
+  _window.store(window);
+  _global_stats->set_concurrency_window(window);
+  _global_stats->set_local_latency_us(p99_latency_us);
+}
@@ -0,0 +1,82 @@
+/**
+ * @file resync_digest.cpp - Digests of the records in each vbucket
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "resync_digest.hpp"
+
+// 64-bit FNV-1a hash of a key, which picks its key range.
+static uint64_t key_hash(boost::string_ref key)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (boost::string_ref::const_iterator it = key.begin(); it != key.end(); ++it)
+  {
+    hash ^= (uint8_t)*it;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Spread the bits of a value, so that the sums of the hashes of different
+// sets of records are unlikely to collide (the splitmix64 finalizer).
+static uint64_t mix(uint64_t value)
+{
+  value ^= value >> 30;
+  value *= 0xbf58476d1ce4e5b9ull;
+  value ^= value >> 27;
+  value *= 0x94d049bb133111ebull;
+  value ^= value >> 31;
+  return value;
+}
+
+void ResyncDigest::add(uint16_t vbucket, boost::string_ref key, uint32_t flags)
+{
+  uint64_t hash = key_hash(key);
+  uint64_t record_hash = mix(hash ^ mix(flags));
+
+  // The key range is picked by the top bits of the key's hash, so a record
+  // is always in the same range whatever its timestamp.
+  Tree& tree = _trees[vbucket];
+  tree.records++;
+  tree.root += record_hash;
+  tree.ranges[hash >> 60] += record_hash;
+}
+
+bool ResyncDigest::empty(uint16_t vbucket) const
+{
+  return (_trees.find(vbucket) == _trees.end());
+}
+
+size_t ResyncDigest::compare(uint16_t vbucket, const ResyncDigest& other) const
+{
+  static const Tree EMPTY_TREE;
+
+  std::map<uint16_t, Tree>::const_iterator it = _trees.find(vbucket);
+  const Tree& tree = (it != _trees.end()) ? it->second : EMPTY_TREE;
+  std::map<uint16_t, Tree>::const_iterator other_it = other._trees.find(vbucket);
+  const Tree& other_tree = (other_it != other._trees.end()) ? other_it->second : EMPTY_TREE;
+
+  if ((tree.records == other_tree.records) && (tree.root == other_tree.root))
+  {
+    return 0;
+  }
+
+  // The vbuckets differ, so work out in how many of the key ranges.  If the
+  // records differ but no range does, count the whole vbucket as one.
+  size_t differ = 0;
+  for (size_t ii = 0; ii < RANGES; ++ii)
+  {
+    if (tree.ranges[ii] != other_tree.ranges[ii])
+    {
+      differ++;
+    }
+  }
+
+  return (differ > 0) ? differ : 1;
+}
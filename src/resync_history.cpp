@@ -0,0 +1,163 @@
+/**
+ * @file resync_history.cpp - Records when vbuckets were last resynced
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "resync_history.hpp"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+const std::string HISTORY_HEADER = "astaire-resync-history 1";
+
+ResyncHistory::ResyncHistory(const std::string& filename) :
+  _filename(filename),
+  _fd(-1),
+  _last_synced()
+{
+}
+
+ResyncHistory::~ResyncHistory()
+{
+  close_file();
+}
+
+void ResyncHistory::load(const std::string& data_id)
+{
+  close_file();
+  _last_synced.clear();
+
+  if (data_id.empty())
+  {
+    TRC_INFO("Local data has no ID, discarding resync history");
+    unlink(_filename.c_str());
+    return;
+  }
+
+  std::ifstream file(_filename.c_str());
+  std::string line;
+  std::string file_data_id;
+
+  if ((file.is_open()) &&
+      (std::getline(file, line)) &&
+      (line == HISTORY_HEADER))
+  {
+    while (std::getline(file, line))
+    {
+      // Later lines override earlier ones.  The last line may be incomplete
+      // if we crashed while writing it, in which case it won't parse and is
+      // ignored.
+      std::istringstream iss(line);
+      std::string type;
+      iss >> type;
+
+      if (type == "data")
+      {
+        iss >> file_data_id;
+      }
+      else if (type == "synced")
+      {
+        int vbucket = -1;
+        std::string server;
+        uint64_t time = 0;
+        iss >> vbucket >> server >> time;
+        if ((!iss.fail()) && (vbucket >= 0) && (time != 0))
+        {
+          _last_synced[std::make_pair((uint16_t)vbucket, server)] = time;
+        }
+      }
+    }
+  }
+
+  if (file_data_id != data_id)
+  {
+    TRC_INFO("Discarding resync history for %s, local data is now %s",
+             file_data_id.empty() ? "unknown data" : file_data_id.c_str(),
+             data_id.c_str());
+    _last_synced.clear();
+  }
+
+  // Write out a fresh copy of the history, so the file doesn't keep growing.
+  std::string contents = HISTORY_HEADER + "\n" + "data " + data_id + "\n";
+  for (std::map<std::pair<uint16_t, std::string>, uint64_t>::const_iterator it =
+         _last_synced.begin();
+       it != _last_synced.end();
+       ++it)
+  {
+    contents += "synced " + std::to_string(it->first.first) + " " +
+                it->first.second + " " + std::to_string(it->second) + "\n";
+  }
+
+  std::string tmp_filename = _filename + ".tmp";
+  int fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if ((fd < 0) ||
+      (write(fd, contents.data(), contents.length()) != (ssize_t)contents.length()) ||
+      (fsync(fd) != 0) ||
+      (rename(tmp_filename.c_str(), _filename.c_str()) != 0))
+  {
+    TRC_WARNING("Failed to write resync history %s (%d), it won't be updated",
+                _filename.c_str(), errno);
+    if (fd >= 0)
+    {
+      close(fd);
+      unlink(tmp_filename.c_str());
+    }
+    return;
+  }
+
+  _fd = fd;
+  lseek(_fd, 0, SEEK_END);
+}
+
+uint64_t ResyncHistory::last_synced(uint16_t vbucket,
+                                    const std::string& server) const
+{
+  std::map<std::pair<uint16_t, std::string>, uint64_t>::const_iterator it =
+    _last_synced.find(std::make_pair(vbucket, server));
+  return (it != _last_synced.end()) ? it->second : 0;
+}
+
+// The history is only an optimization (losing an update just means the next
+// resync of those vbuckets is a full dump), so this doesn't sync the file to
+// disk.
+void ResyncHistory::record(const std::vector<uint16_t>& buckets,
+                           const std::string& server,
+                           uint64_t time)
+{
+  std::string lines;
+  for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+       it != buckets.end();
+       ++it)
+  {
+    _last_synced[std::make_pair(*it, server)] = time;
+    lines += "synced " + std::to_string(*it) + " " + server + " " +
+             std::to_string(time) + "\n";
+  }
+
+  if ((_fd >= 0) &&
+      (write(_fd, lines.data(), lines.length()) != (ssize_t)lines.length()))
+  {
+    TRC_WARNING("Failed to update resync history %s (%d)",
+                _filename.c_str(), errno);
+  }
+}
+
+void ResyncHistory::close_file()
+{
+  if (_fd >= 0)
+  {
+    close(_fd);
+    _fd = -1;
+  }
+}
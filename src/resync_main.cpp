@@ -13,6 +13,7 @@
 #include "astaire.hpp"
 #include "astaire_pd_definitions.hpp"
 #include "astaire_statistics.hpp"
+#include "resync_rate_limiter.hpp"
 #include "logger.h"
 #include "utils.h"
 #include "astaire_alarmdefinition.h"
@@ -25,6 +26,16 @@ struct options
 {
   std::string local_memcached_server;
   std::string cluster_settings_file;
+  int tap_fanout;
+  int tap_workers;
+  int target_latency_us;
+  std::string checkpoint_file;
+  std::string history_file;
+  bool merge_replicas;
+  std::string snapshot_file;
+  int snapshot_interval_s;
+  bool anti_entropy;
+  int anti_entropy_interval_s;
   bool log_to_file;
   std::string log_directory;
   int log_level;
@@ -36,6 +47,16 @@ enum Options
 {
   LOCAL_NAME=256+1,
   CLUSTER_SETTINGS_FILE,
+  TAP_FANOUT,
+  TAP_WORKERS,
+  TARGET_LATENCY,
+  CHECKPOINT_FILE,
+  HISTORY_FILE,
+  MERGE_REPLICAS,
+  SNAPSHOT_FILE,
+  SNAPSHOT_INTERVAL,
+  ANTI_ENTROPY,
+  ANTI_ENTROPY_INTERVAL,
   BIND_ADDR,
   LOG_FILE,
   LOG_LEVEL,
@@ -48,6 +69,16 @@ const static struct option long_opt[] =
 {
   {"local-name",             required_argument, NULL, LOCAL_NAME},
   {"cluster-settings-file",  required_argument, NULL, CLUSTER_SETTINGS_FILE},
+  {"tap-fanout",             required_argument, NULL, TAP_FANOUT},
+  {"tap-workers",            required_argument, NULL, TAP_WORKERS},
+  {"target-latency-us",      required_argument, NULL, TARGET_LATENCY},
+  {"checkpoint-file",        required_argument, NULL, CHECKPOINT_FILE},
+  {"history-file",           required_argument, NULL, HISTORY_FILE},
+  {"merge-replicas",         no_argument,       NULL, MERGE_REPLICAS},
+  {"snapshot-file",          required_argument, NULL, SNAPSHOT_FILE},
+  {"snapshot-interval",      required_argument, NULL, SNAPSHOT_INTERVAL},
+  {"anti-entropy",           no_argument,       NULL, ANTI_ENTROPY},
+  {"anti-entropy-interval",  required_argument, NULL, ANTI_ENTROPY_INTERVAL},
   {"log-file",               required_argument, NULL, LOG_FILE},
   {"log-level",              required_argument, NULL, LOG_LEVEL},
   {"pidfile",                required_argument, NULL, PIDFILE},
@@ -65,6 +96,29 @@ void usage(void)
        " --local-name <hostname>    Specify the name of the local memcached server\n"
        " --cluster-settings-file=<filename>\n"
        "                            The filename of the cluster settings file\n"
+       " --tap-fanout=N             Split the tap of each server into up to N parallel\n"
+       "                            streams (default: 1)\n"
+       " --tap-workers=N            Run at most N taps at once (default: 8)\n"
+       " --target-latency-us=N      Back off resyncing when the local memcached's 99th\n"
+       "                            percentile latency is over N microseconds, or 0 to\n"
+       "                            never back off (default: 0)\n"
+       " --checkpoint-file=<filename>\n"
+       "                            Record the progress of resyncs in this file, so that\n"
+       "                            they can be resumed if Astaire restarts\n"
+       " --history-file=<filename>  Record when vbuckets were last resynced in this\n"
+       "                            file, so that later resyncs only need the records\n"
+       "                            that have changed since\n"
+       " --merge-replicas           Stream each vbucket from all its replicas at once,\n"
+       "                            merging their records before writing them\n"
+       " --snapshot-file=<filename> Keep a copy of the local memcached's records in this\n"
+       "                            file, to reload if the local memcached restarts\n"
+       " --snapshot-interval=N      Refresh the snapshot every N seconds (default: 3600)\n"
+       " --anti-entropy             Before a full resync, compare digests of each vbucket\n"
+       "                            with the other replicas, and only stream those that\n"
+       "                            differ\n"
+       " --anti-entropy-interval=N  Compare digests with the other replicas every N\n"
+       "                            seconds, resyncing any vbuckets that differ, or 0 to\n"
+       "                            never do so (default: 0)\n"
        " --log-file=<directory>     Log to file in specified directory\n"
        " --log-level=N              Set log level to N (default: 4)\n"
        " --pidfile=<filename>       Write pidfile\n"
@@ -124,6 +178,76 @@ int init_options(int argc, char**argv, struct options& options)
       options.cluster_settings_file = optarg;
       break;
 
+    case TAP_FANOUT:
+      options.tap_fanout = atoi(optarg);
+      if (options.tap_fanout < 1)
+      {
+        CL_ASTAIRE_INVALID_OPTION.log(argv[optind - 1]);
+        TRC_ERROR("Invalid tap fan-out: %s.  It must be at least 1.", optarg);
+        exit(2);
+      }
+      break;
+
+    case TAP_WORKERS:
+      options.tap_workers = atoi(optarg);
+      if (options.tap_workers < 1)
+      {
+        CL_ASTAIRE_INVALID_OPTION.log(argv[optind - 1]);
+        TRC_ERROR("Invalid number of tap workers: %s.  It must be at least 1.", optarg);
+        exit(2);
+      }
+      break;
+
+    case CHECKPOINT_FILE:
+      options.checkpoint_file = optarg;
+      break;
+
+    case HISTORY_FILE:
+      options.history_file = optarg;
+      break;
+
+    case MERGE_REPLICAS:
+      options.merge_replicas = true;
+      break;
+
+    case SNAPSHOT_FILE:
+      options.snapshot_file = optarg;
+      break;
+
+    case SNAPSHOT_INTERVAL:
+      options.snapshot_interval_s = atoi(optarg);
+      if (options.snapshot_interval_s < 1)
+      {
+        CL_ASTAIRE_INVALID_OPTION.log(argv[optind - 1]);
+        TRC_ERROR("Invalid snapshot interval: %s.  It must be at least 1.", optarg);
+        exit(2);
+      }
+      break;
+
+    case ANTI_ENTROPY:
+      options.anti_entropy = true;
+      break;
+
+    case ANTI_ENTROPY_INTERVAL:
+      options.anti_entropy_interval_s = atoi(optarg);
+      if (options.anti_entropy_interval_s < 0)
+      {
+        CL_ASTAIRE_INVALID_OPTION.log(argv[optind - 1]);
+        TRC_ERROR("Invalid anti-entropy interval: %s.  It must not be negative.", optarg);
+        exit(2);
+      }
+      break;
+
+    case TARGET_LATENCY:
+      options.target_latency_us = atoi(optarg);
+      if (options.target_latency_us < 0)
+      {
+        CL_ASTAIRE_INVALID_OPTION.log(argv[optind - 1]);
+        TRC_ERROR("Invalid target latency: %s.  It must not be negative.", optarg);
+        exit(2);
+      }
+      break;
+
     case PIDFILE:
       options.pidfile = std::string(optarg);
       break;
@@ -196,6 +320,16 @@ int main(int argc, char** argv)
   options.log_directory = "";
   options.local_memcached_server = "";
   options.cluster_settings_file = "";
+  options.tap_fanout = 1;
+  options.tap_workers = 8;
+  options.target_latency_us = 0;
+  options.checkpoint_file = "";
+  options.history_file = "";
+  options.merge_replicas = false;
+  options.snapshot_file = "";
+  options.snapshot_interval_s = 3600;
+  options.anti_entropy = false;
+  options.anti_entropy_interval_s = 0;
   options.pidfile = "";
   options.daemon = false;
 
@@ -282,13 +416,33 @@ int main(int argc, char** argv)
   AstaireGlobalStatistics* global_stats = new AstaireGlobalStatistics(lvc);
   AstairePerConnectionStatistics* per_conn_stats = new AstairePerConnectionStatistics(lvc);
 
+  // Create the resync rate limiter, and re-read its limits on SIGHUP.  It reads
+  // them when it is created, so the updater doesn't need to run straight away.
+  ResyncRateLimiter* rate_limiter = new ResyncRateLimiter("/etc/clearwater/config");
+  Updater<void, ResyncRateLimiter>* rate_limiter_updater =
+    new Updater<void, ResyncRateLimiter>(rate_limiter,
+                                         std::mem_fun(&ResyncRateLimiter::reload_config),
+                                         &_sighup_handler,
+                                         false);
+
   // Start Astaire last as this might cause a resync to happen synchronously.
   Astaire* astaire = new Astaire(view,
                                  view_cfg,
                                  astaire_resync_alarm,
                                  global_stats,
                                  per_conn_stats,
-                                 options.local_memcached_server);
+                                 rate_limiter,
+                                 options.local_memcached_server,
+                                 options.tap_fanout,
+                                 options.tap_workers,
+                                 options.target_latency_us,
+                                 options.checkpoint_file,
+                                 options.history_file,
+                                 options.merge_replicas,
+                                 options.snapshot_file,
+                                 options.snapshot_interval_s,
+                                 options.anti_entropy,
+                                 options.anti_entropy_interval_s);
 
   sem_wait(&term_sem);
 
@@ -298,6 +452,8 @@ int main(int argc, char** argv)
   delete global_stats;
   delete lvc;
   delete astaire;
+  delete rate_limiter_updater; rate_limiter_updater = NULL;
+  delete rate_limiter; rate_limiter = NULL;
   delete alarm_manager; alarm_manager = NULL;
   delete view_cfg;
   delete view;
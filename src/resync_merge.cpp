@@ -0,0 +1,184 @@
+/**
+ * @file resync_merge.cpp - Merges the records streamed from several replicas
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "resync_merge.hpp"
+#include "log.h"
+
+ResyncMerge::ResyncMerge(const std::vector<uint16_t>& buckets,
+                         int taps,
+                         size_t max_bytes) :
+  taps_outstanding(taps),
+  sources(),
+  _buckets(buckets),
+  _max_bytes(max_bytes),
+  _records(),
+  _bytes(0),
+  _rank_bytes(taps, 0),
+  _finished(taps, false),
+  _taps_running(taps),
+  _lowest_running(0),
+  _write_succeeded(true)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_room_cv, NULL);
+  pthread_mutex_init(&_write_lock, NULL);
+}
+
+ResyncMerge::~ResyncMerge()
+{
+  // Anything left hasn't been written, because a write failed.
+  for (std::unordered_map<std::string, Record>::iterator it = _records.begin();
+       it != _records.end();
+       ++it)
+  {
+    delete it->second.mutate;
+  }
+
+  pthread_mutex_destroy(&_write_lock);
+  pthread_cond_destroy(&_room_cv);
+  pthread_mutex_destroy(&_lock);
+}
+
+Memcached::Message* ResyncMerge::offer(Memcached::Message* mutate,
+                                       uint16_t vbucket,
+                                       int rank)
+{
+  std::string key = mutate->key().to_string();
+  Memcached::Message* loser = NULL;
+
+  pthread_mutex_lock(&_lock);
+  std::unordered_map<std::string, Record>::iterator it = _records.find(key);
+
+  if (it == _records.end())
+  {
+    Record record;
+    record.mutate = mutate;
+    record.vbucket = vbucket;
+    record.rank = rank;
+    _records[key] = record;
+    _bytes += mutate->frame().size();
+    _rank_bytes[rank] += mutate->frame().size();
+  }
+  else
+  {
+    // The flags field encodes a timestamp.  The copy held loses if it is
+    // older, or is as old but from a higher ranked replica.
+    int32_t age = ((int32_t)it->second.mutate->flags()) - ((int32_t)mutate->flags());
+    if ((age < 0) || ((age == 0) && (rank < it->second.rank)))
+    {
+      loser = it->second.mutate;
+      _bytes += mutate->frame().size();
+      _bytes -= loser->frame().size();
+      _rank_bytes[rank] += mutate->frame().size();
+      _rank_bytes[it->second.rank] -= loser->frame().size();
+      it->second.mutate = mutate;
+      it->second.vbucket = vbucket;
+      it->second.rank = rank;
+    }
+    else
+    {
+      loser = mutate;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return loser;
+}
+
+bool ResyncMerge::full()
+{
+  pthread_mutex_lock(&_lock);
+  bool full = (writable_bytes() >= _max_bytes);
+  pthread_mutex_unlock(&_lock);
+  return full;
+}
+
+void ResyncMerge::wait_for_room(int rank)
+{
+  pthread_mutex_lock(&_lock);
+  while ((_bytes >= _max_bytes) && (rank > _lowest_running))
+  {
+    pthread_cond_wait(&_room_cv, &_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void ResyncMerge::start_write(RecordList& records)
+{
+  pthread_mutex_lock(&_write_lock);
+
+  pthread_mutex_lock(&_lock);
+  std::unordered_map<std::string, Record>::iterator it = _records.begin();
+  while (it != _records.end())
+  {
+    if (it->second.rank <= _lowest_running)
+    {
+      records.push_back(std::make_pair(it->second.mutate, it->second.vbucket));
+      _bytes -= it->second.mutate->frame().size();
+      _rank_bytes[it->second.rank] -= it->second.mutate->frame().size();
+      it = _records.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+  pthread_cond_broadcast(&_room_cv);
+  pthread_mutex_unlock(&_lock);
+
+  TRC_DEBUG("Writing %d merged records", records.size());
+}
+
+void ResyncMerge::end_write(bool success)
+{
+  if (!success)
+  {
+    _write_succeeded = false;
+  }
+  pthread_mutex_unlock(&_write_lock);
+}
+
+bool ResyncMerge::tap_finished(int rank)
+{
+  pthread_mutex_lock(&_lock);
+  _finished[rank] = true;
+  while ((_lowest_running < (int)_finished.size()) && (_finished[_lowest_running]))
+  {
+    _lowest_running++;
+  }
+  bool last = (--_taps_running == 0);
+  pthread_cond_broadcast(&_room_cv);
+  pthread_mutex_unlock(&_lock);
+
+  return last;
+}
+
+bool ResyncMerge::write_succeeded()
+{
+  pthread_mutex_lock(&_write_lock);
+  bool success = _write_succeeded;
+  pthread_mutex_unlock(&_write_lock);
+  return success;
+}
+
+// The bytes of the records held that can be written out now.  Must be called
+// with the lock held.
+size_t ResyncMerge::writable_bytes() const
+{
+  size_t bytes = 0;
+  for (int rank = 0;
+       (rank <= _lowest_running) && (rank < (int)_rank_bytes.size());
+       ++rank)
+  {
+    bytes += _rank_bytes[rank];
+  }
+  return bytes;
+}
@@ -0,0 +1,196 @@
+/**
+ * @file resync_rate_limiter.cpp - Limits the rate at which Astaire resyncs
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "resync_rate_limiter.hpp"
+#include "log.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <time.h>
+#include <unistd.h>
+
+// Clearwater nodes should have at least 20% CPU headroom for management /
+// orchestration actions. By default we give astaire 5% of the CPU. Assuming
+// memcached's CPU usage is similar this means resyncing doesn't use more than
+// 10% of the CPU, which is well within the recommended headroom.
+const int DEFAULT_CPU_LIMIT_PERCENTAGE = 5;
+
+// How long the buckets can save up tokens for when the tap threads aren't
+// using them, which bounds how bursty the resync can be.
+const double BURST_SECONDS = 0.1;
+
+// How much weight each new measurement of the CPU time per key gets.
+const double CPU_COST_SMOOTHING = 0.1;
+
+ResyncRateLimiter::ResyncRateLimiter(const std::string& config_file) :
+  _config_file(config_file),
+  _cpu_limit_percentage(0),
+  _num_cpus(std::max((int)sysconf(_SC_NPROCESSORS_ONLN), 1)),
+  _cpu_ns_per_key(0),
+  _keys(),
+  _bytes(),
+  _last_refill_ns(monotonic_ns())
+{
+  pthread_mutex_init(&_lock, NULL);
+  reload_config();
+}
+
+ResyncRateLimiter::~ResyncRateLimiter()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+// The config file is a shell script of `name=value` lines, so pick out the
+// values we're interested in and ignore everything else.
+void ResyncRateLimiter::reload_config()
+{
+  int cpu_limit_percentage = DEFAULT_CPU_LIMIT_PERCENTAGE;
+  uint64_t bandwidth_limit_mbps = 0;
+
+  std::ifstream file(_config_file.c_str());
+  if (!file.is_open())
+  {
+    TRC_WARNING("Failed to open %s, using default resync limits",
+                _config_file.c_str());
+  }
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    size_t equals = line.find('=');
+    if ((line.empty()) || (line[0] == '#') || (equals == std::string::npos))
+    {
+      continue;
+    }
+
+    std::string name = line.substr(0, equals);
+    std::string value = line.substr(equals + 1);
+    name.erase(0, name.find_first_not_of(" \t"));
+    value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+    value.erase(std::remove(value.begin(), value.end(), '\''), value.end());
+
+    if (name == "astaire_cpu_limit_percentage")
+    {
+      cpu_limit_percentage = atoi(value.c_str());
+    }
+    else if (name == "astaire_bandwidth_limit_mbps")
+    {
+      bandwidth_limit_mbps = strtoull(value.c_str(), NULL, 10);
+    }
+  }
+
+  TRC_STATUS("Resync limited to %d%% CPU and %lu Mbps (0 is unlimited)",
+             cpu_limit_percentage, bandwidth_limit_mbps);
+  set_limits(cpu_limit_percentage, bandwidth_limit_mbps * 1000 * 1000 / 8);
+}
+
+void ResyncRateLimiter::set_limits(int cpu_limit_percentage,
+                                   uint64_t bandwidth_limit_bps)
+{
+  pthread_mutex_lock(&_lock);
+  _cpu_limit_percentage = ((cpu_limit_percentage > 0) &&
+                           (cpu_limit_percentage < 100)) ?
+                          cpu_limit_percentage : 0;
+  _bytes.set_rate(bandwidth_limit_bps);
+  update_key_rate();
+  pthread_mutex_unlock(&_lock);
+}
+
+void ResyncRateLimiter::throttle(uint64_t keys, uint64_t bytes, uint64_t cpu_ns)
+{
+  pthread_mutex_lock(&_lock);
+
+  uint64_t now_ns = monotonic_ns();
+  double elapsed = (now_ns - _last_refill_ns) / 1e9;
+  _last_refill_ns = now_ns;
+
+  if (keys > 0)
+  {
+    double cpu_ns_per_key = (double)cpu_ns / keys;
+    _cpu_ns_per_key = (_cpu_ns_per_key == 0) ?
+                      cpu_ns_per_key :
+                      (1 - CPU_COST_SMOOTHING) * _cpu_ns_per_key +
+                      CPU_COST_SMOOTHING * cpu_ns_per_key;
+    update_key_rate();
+  }
+
+  _keys.refill(elapsed);
+  _bytes.refill(elapsed);
+  _keys.consume(keys);
+  _bytes.consume(bytes);
+
+  // The tokens have been taken, so any other thread that gets in before we
+  // wake up waits for the debt we've run up as well as its own.
+  double wait = std::max(_keys.wait_seconds(), _bytes.wait_seconds());
+
+  pthread_mutex_unlock(&_lock);
+
+  if (wait > 0)
+  {
+    struct timespec ts;
+    ts.tv_sec = (time_t)wait;
+    ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+  }
+}
+
+uint64_t ResyncRateLimiter::monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The key rate is the CPU time we're allowed each second (a percentage of
+// every CPU on the node, matching the old cpulimit throttle) divided by the
+// CPU time each key is currently taking.  This must be called with the lock
+// held.
+void ResyncRateLimiter::update_key_rate()
+{
+  if ((_cpu_limit_percentage == 0) || (_cpu_ns_per_key == 0))
+  {
+    _keys.set_rate(0);
+  }
+  else
+  {
+    double cpu_ns_per_second = _cpu_limit_percentage / 100.0 * _num_cpus * 1e9;
+    _keys.set_rate(cpu_ns_per_second / _cpu_ns_per_key);
+  }
+}
+
+void ResyncRateLimiter::TokenBucket::set_rate(double rate)
+{
+  // Any debt is forgotten when the limit is lifted.
+  _rate = rate;
+  _tokens = (_rate > 0) ? std::min(_tokens, _rate * BURST_SECONDS) : 0;
+}
+
+void ResyncRateLimiter::TokenBucket::refill(double seconds)
+{
+  if (_rate > 0)
+  {
+    _tokens = std::min(_tokens + _rate * seconds, _rate * BURST_SECONDS);
+  }
+}
+
+void ResyncRateLimiter::TokenBucket::consume(double tokens)
+{
+  if (_rate > 0)
+  {
+    _tokens -= tokens;
+  }
+}
+
+double ResyncRateLimiter::TokenBucket::wait_seconds() const
+{
+  return ((_rate > 0) && (_tokens < 0)) ? -_tokens / _rate : 0;
+}
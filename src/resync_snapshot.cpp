@@ -0,0 +1,266 @@
+/**
+ * @file resync_snapshot.cpp - A copy on disk of the local memcached's records
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "resync_snapshot.hpp"
+#include "memcached_tap_client.hpp"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const std::string SNAPSHOT_HEADER = "astaire-resync-snapshot 1\n";
+
+// How many bytes of records to buffer before writing them to the file.
+const size_t SNAPSHOT_WRITE_BYTES = 1024 * 1024;
+
+// The fixed size part of each record - the key length, vbucket, flags,
+// expiry and value length.  A key length of zero marks the end of the
+// snapshot.
+const size_t SNAPSHOT_RECORD_HDR_BYTES = 16;
+
+// Read a value in network byte order from the mapping, moving the offset on
+// past it.  The caller must have checked there is room for it.
+template<class T> static T read_value(const char* map, size_t& offset)
+{
+  T network_value;
+  memcpy(&network_value, map + offset, sizeof(T));
+  offset += sizeof(T);
+  return Memcached::Utils::network_to_host(network_value);
+}
+
+ResyncSnapshot::ResyncSnapshot(const std::string& filename) :
+  _filename(filename),
+  _fd(-1),
+  _buffer(),
+  _records(0),
+  _map(NULL),
+  _map_size(0),
+  _offset(0),
+  _complete(false),
+  _time(0),
+  _buckets()
+{
+}
+
+ResyncSnapshot::~ResyncSnapshot()
+{
+  abort();
+  close();
+}
+
+bool ResyncSnapshot::start(uint64_t time, const std::vector<uint16_t>& buckets)
+{
+  abort();
+
+  std::string tmp_filename = _filename + ".tmp";
+  _fd = ::open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (_fd < 0)
+  {
+    TRC_WARNING("Failed to create snapshot %s (%d)", tmp_filename.c_str(), errno);
+    return false;
+  }
+
+  _buffer = SNAPSHOT_HEADER;
+  Memcached::Utils::write(time, _buffer);
+  Memcached::Utils::write((uint16_t)buckets.size(), _buffer);
+  for (std::vector<uint16_t>::const_iterator it = buckets.begin();
+       it != buckets.end();
+       ++it)
+  {
+    Memcached::Utils::write(*it, _buffer);
+  }
+  _records = 0;
+
+  return true;
+}
+
+bool ResyncSnapshot::add(const Record& record)
+{
+  if (_fd < 0)
+  {
+    return false;
+  }
+
+  Memcached::Utils::write((uint16_t)record.key.size(), _buffer);
+  Memcached::Utils::write(record.vbucket, _buffer);
+  Memcached::Utils::write(record.flags, _buffer);
+  Memcached::Utils::write(record.expiry, _buffer);
+  Memcached::Utils::write((uint32_t)record.value.size(), _buffer);
+  _buffer.append(record.key.data(), record.key.size());
+  _buffer.append(record.value.data(), record.value.size());
+  _records++;
+
+  return (_buffer.size() < SNAPSHOT_WRITE_BYTES) || (flush());
+}
+
+// Write out the end marker, and sync the new snapshot to disk before renaming
+// it over the old one, so that a crash leaves one or the other.
+bool ResyncSnapshot::commit()
+{
+  if (_fd < 0)
+  {
+    return false;
+  }
+
+  _buffer.append(SNAPSHOT_RECORD_HDR_BYTES, '\0');
+
+  std::string tmp_filename = _filename + ".tmp";
+  if ((!flush()) ||
+      (fsync(_fd) != 0) ||
+      (rename(tmp_filename.c_str(), _filename.c_str()) != 0))
+  {
+    TRC_WARNING("Failed to write snapshot %s (%d)", _filename.c_str(), errno);
+    abort();
+    return false;
+  }
+
+  ::close(_fd);
+  _fd = -1;
+  _buffer.clear();
+
+  TRC_INFO("Wrote snapshot of %lu records to %s", _records, _filename.c_str());
+  return true;
+}
+
+void ResyncSnapshot::abort()
+{
+  if (_fd >= 0)
+  {
+    ::close(_fd);
+    _fd = -1;
+    unlink((_filename + ".tmp").c_str());
+  }
+  _buffer.clear();
+}
+
+bool ResyncSnapshot::flush()
+{
+  if (write(_fd, _buffer.data(), _buffer.size()) != (ssize_t)_buffer.size())
+  {
+    TRC_WARNING("Failed to write snapshot %s (%d)", _filename.c_str(), errno);
+    abort();
+    return false;
+  }
+
+  _buffer.clear();
+  return true;
+}
+
+bool ResyncSnapshot::open()
+{
+  close();
+
+  int fd = ::open(_filename.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    TRC_DEBUG("No snapshot in %s", _filename.c_str());
+    return false;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size == 0))
+  {
+    ::close(fd);
+    TRC_WARNING("Ignoring empty snapshot %s", _filename.c_str());
+    return false;
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+  {
+    TRC_WARNING("Failed to map snapshot %s (%d)", _filename.c_str(), errno);
+    return false;
+  }
+
+  // The records are read once, in order.
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  _map = (const char*)map;
+  _map_size = st.st_size;
+  _offset = SNAPSHOT_HEADER.size();
+
+  if ((_map_size < _offset + sizeof(uint64_t) + sizeof(uint16_t)) ||
+      (SNAPSHOT_HEADER.compare(0, std::string::npos, _map, SNAPSHOT_HEADER.size()) != 0))
+  {
+    TRC_WARNING("Ignoring invalid snapshot %s", _filename.c_str());
+    close();
+    return false;
+  }
+
+  _time = read_value<uint64_t>(_map, _offset);
+  uint16_t num_buckets = read_value<uint16_t>(_map, _offset);
+  if (_map_size < _offset + num_buckets * sizeof(uint16_t))
+  {
+    TRC_WARNING("Ignoring invalid snapshot %s", _filename.c_str());
+    close();
+    return false;
+  }
+
+  for (uint16_t ii = 0; ii < num_buckets; ++ii)
+  {
+    _buckets.push_back(read_value<uint16_t>(_map, _offset));
+  }
+
+  return true;
+}
+
+bool ResyncSnapshot::next(Record& record)
+{
+  if ((_map == NULL) ||
+      (_complete) ||
+      (_map_size < _offset + SNAPSHOT_RECORD_HDR_BYTES))
+  {
+    return false;
+  }
+
+  size_t offset = _offset;
+  uint16_t key_length = read_value<uint16_t>(_map, offset);
+  record.vbucket = read_value<uint16_t>(_map, offset);
+  record.flags = read_value<uint32_t>(_map, offset);
+  record.expiry = read_value<uint32_t>(_map, offset);
+  uint32_t value_length = read_value<uint32_t>(_map, offset);
+
+  if (key_length == 0)
+  {
+    _complete = true;
+    return false;
+  }
+
+  if (_map_size - offset < (size_t)key_length + value_length)
+  {
+    TRC_WARNING("Snapshot %s is truncated", _filename.c_str());
+    return false;
+  }
+
+  record.key = boost::string_ref(_map + offset, key_length);
+  record.value = boost::string_ref(_map + offset + key_length, value_length);
+  _offset = offset + key_length + value_length;
+
+  return true;
+}
+
+void ResyncSnapshot::close()
+{
+  if (_map != NULL)
+  {
+    munmap((void*)_map, _map_size);
+    _map = NULL;
+  }
+  _map_size = 0;
+  _offset = 0;
+  _complete = false;
+  _time = 0;
+  _buckets.clear();
+}
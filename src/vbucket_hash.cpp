@@ -0,0 +1,393 @@
+/**
+ * @file vbucket_hash.cpp - Hashing of keys onto vbuckets
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "vbucket_hash.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+// The MD5 algorithm is described in RFC 1321.  Only the first word of the
+// digest is needed, but all four words of state are needed to compute it.
+//
+// A message is padded to a multiple of 64 bytes by appending a 0x80 byte,
+// zeros, and the message length in bits as a little-endian 64-bit integer,
+// and then processed one 64-byte block at a time.
+
+namespace
+{
+  const uint32_t MD5_INIT[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+  const uint32_t MD5_K[64] =
+  {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+  };
+
+  const int MD5_S[64] =
+  {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+  };
+
+  // The message word used by each step.
+  const int MD5_G[64] =
+  {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+    5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+    0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9
+  };
+
+  // The number of 64-byte blocks in the padded form of a message.
+  inline size_t md5_blocks(size_t length)
+  {
+    return (length + 8) / 64 + 1;
+  }
+
+  // Write block `block` of the padded form of `key` to `out`.
+  void md5_padded_block(const boost::string_ref& key,
+                        size_t block,
+                        unsigned char* out)
+  {
+    size_t start = block * 64;
+    size_t length = key.length();
+    size_t copy = 0;
+
+    if (start < length)
+    {
+      copy = std::min(length - start, (size_t)64);
+      memcpy(out, key.data() + start, copy);
+    }
+
+    memset(out + copy, 0, 64 - copy);
+
+    if ((length >= start) && (length < start + 64))
+    {
+      out[length - start] = 0x80;
+    }
+
+    if (block == md5_blocks(length) - 1)
+    {
+      uint64_t bits = (uint64_t)length * 8;
+      for (int ii = 0; ii < 8; ++ii)
+      {
+        out[56 + ii] = (unsigned char)(bits >> (8 * ii));
+      }
+    }
+  }
+
+  inline uint32_t load_le32(const unsigned char* p)
+  {
+    return (uint32_t)p[0] |
+           ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+  }
+
+  // The MD5 compression function, written once for any type that supports
+  // the usual arithmetic and bitwise operators.  This is used with plain
+  // integers for the scalar implementation, and with GCC vector types to hash
+  // several messages at once.  It is always inlined so that the vector
+  // versions are compiled for the instruction set of their caller.
+  template <class V>
+  inline __attribute__((always_inline)) void md5_compress(V* state, const V* m)
+  {
+    V a = state[0];
+    V b = state[1];
+    V c = state[2];
+    V d = state[3];
+
+#pragma GCC unroll 64
+    for (int ii = 0; ii < 64; ++ii)
+    {
+      V f;
+      if (ii < 16)
+      {
+        f = d ^ (b & (c ^ d));
+      }
+      else if (ii < 32)
+      {
+        f = c ^ (d & (b ^ c));
+      }
+      else if (ii < 48)
+      {
+        f = b ^ c ^ d;
+      }
+      else
+      {
+        f = c ^ (b | ~d);
+      }
+
+      V sum = a + f + MD5_K[ii] + m[MD5_G[ii]];
+      a = d;
+      d = c;
+      c = b;
+      b = b + ((sum << MD5_S[ii]) | (sum >> (32 - MD5_S[ii])));
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+  }
+
+  uint32_t hash_scalar(const boost::string_ref& key)
+  {
+    uint32_t state[4] = { MD5_INIT[0], MD5_INIT[1], MD5_INIT[2], MD5_INIT[3] };
+    unsigned char block[64];
+    uint32_t m[16];
+
+    size_t blocks = md5_blocks(key.length());
+    for (size_t bb = 0; bb < blocks; ++bb)
+    {
+      md5_padded_block(key, bb, block);
+      for (int ww = 0; ww < 16; ++ww)
+      {
+        m[ww] = load_le32(block + 4 * ww);
+      }
+      md5_compress(state, m);
+    }
+
+    return state[0];
+  }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  typedef uint32_t u32x4 __attribute__((vector_size(16)));
+  typedef uint32_t u32x8 __attribute__((vector_size(32)));
+
+  // The longest key the SIMD implementations handle.  This covers every key
+  // memcached accepts (250 bytes) - anything longer is hashed one at a time.
+  const size_t MAX_SIMD_BLOCKS = 5;
+
+  // Hash `count` keys in lanes of a `V`, which holds `LANES` 32-bit words.
+  // Keys are grouped by their padded length, so that all the keys being
+  // hashed together need the same number of blocks.
+  template <class V, int LANES>
+  inline __attribute__((always_inline)) void hash_lanes(const boost::string_ref* keys,
+                                                        size_t count,
+                                                        uint32_t* hashes)
+  {
+    std::vector<size_t> by_blocks[MAX_SIMD_BLOCKS + 1];
+
+    for (size_t ii = 0; ii < count; ++ii)
+    {
+      size_t blocks = md5_blocks(keys[ii].length());
+      if (blocks > MAX_SIMD_BLOCKS)
+      {
+        hashes[ii] = hash_scalar(keys[ii]);
+      }
+      else
+      {
+        by_blocks[blocks].push_back(ii);
+      }
+    }
+
+    uint32_t blocks_by_lane[LANES][16];
+    V m[16];
+    V state[4];
+
+    for (size_t blocks = 1; blocks <= MAX_SIMD_BLOCKS; ++blocks)
+    {
+      const std::vector<size_t>& indexes = by_blocks[blocks];
+
+      for (size_t group = 0; group < indexes.size(); group += LANES)
+      {
+        // Fill any spare lanes in the last group with repeats of its first
+        // key.  They are hashed but the results are thrown away.
+        size_t lane_keys[LANES];
+        for (int lane = 0; lane < LANES; ++lane)
+        {
+          lane_keys[lane] = (group + lane < indexes.size()) ?
+                              indexes[group + lane] : indexes[group];
+        }
+
+        for (int ww = 0; ww < 4; ++ww)
+        {
+          for (int lane = 0; lane < LANES; ++lane)
+          {
+            state[ww][lane] = MD5_INIT[ww];
+          }
+        }
+
+        for (size_t bb = 0; bb < blocks; ++bb)
+        {
+          // Pad the block of each key, then transpose them into the lanes of
+          // the message words.  x86 is little-endian, so the words can be
+          // read straight out of the padded blocks.
+          for (int lane = 0; lane < LANES; ++lane)
+          {
+            md5_padded_block(keys[lane_keys[lane]],
+                             bb,
+                             (unsigned char*)blocks_by_lane[lane]);
+          }
+
+          for (int ww = 0; ww < 16; ++ww)
+          {
+            for (int lane = 0; lane < LANES; ++lane)
+            {
+              m[ww][lane] = blocks_by_lane[lane][ww];
+            }
+          }
+
+          md5_compress(state, m);
+        }
+
+        for (int lane = 0; lane < LANES; ++lane)
+        {
+          if (group + lane < indexes.size())
+          {
+            hashes[lane_keys[lane]] = state[0][lane];
+          }
+        }
+      }
+    }
+  }
+
+  // SSE2 is part of the x86-64 baseline, so this needs no special options.
+  void hash_batch_sse2(const boost::string_ref* keys,
+                       size_t count,
+                       uint32_t* hashes)
+  {
+    hash_lanes<u32x4, 4>(keys, count, hashes);
+  }
+
+  __attribute__((target("avx2")))
+  void hash_batch_avx2(const boost::string_ref* keys,
+                       size_t count,
+                       uint32_t* hashes)
+  {
+    hash_lanes<u32x8, 8>(keys, count, hashes);
+  }
+#endif
+}
+
+VBucketHash::Implementation VBucketHash::best_implementation()
+{
+  static const Implementation best =
+    is_supported(Implementation::AVX2) ? Implementation::AVX2 :
+    is_supported(Implementation::SSE2) ? Implementation::SSE2 :
+                                         Implementation::SCALAR;
+  return best;
+}
+
+bool VBucketHash::is_supported(Implementation impl)
+{
+  switch (impl)
+  {
+  case Implementation::SCALAR:
+    return true;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  case Implementation::SSE2:
+    return true;
+
+  case Implementation::AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+
+  default:
+    return false;
+  }
+}
+
+const char* VBucketHash::implementation_name(Implementation impl)
+{
+  switch (impl)
+  {
+  case Implementation::SCALAR:
+    return "scalar";
+
+  case Implementation::SSE2:
+    return "sse2";
+
+  case Implementation::AVX2:
+    return "avx2";
+
+  default:
+    return "unknown";
+  }
+}
+
+uint32_t VBucketHash::hash(const char* key, size_t length)
+{
+  return hash_scalar(boost::string_ref(key, length));
+}
+
+void VBucketHash::hash_batch(const boost::string_ref* keys,
+                             size_t count,
+                             uint32_t* hashes)
+{
+  hash_batch(keys, count, hashes, best_implementation());
+}
+
+void VBucketHash::hash_batch(const boost::string_ref* keys,
+                             size_t count,
+                             uint32_t* hashes,
+                             Implementation impl)
+{
+  // A single key gains nothing from the SIMD implementations.
+  if (count == 1)
+  {
+    impl = Implementation::SCALAR;
+  }
+
+  switch (impl)
+  {
+#if defined(__x86_64__) && defined(__GNUC__)
+  case Implementation::AVX2:
+    hash_batch_avx2(keys, count, hashes);
+    break;
+
+  case Implementation::SSE2:
+    hash_batch_sse2(keys, count, hashes);
+    break;
+#endif
+
+  default:
+    for (size_t ii = 0; ii < count; ++ii)
+    {
+      hashes[ii] = hash_scalar(keys[ii]);
+    }
+    break;
+  }
+}
+
+void VBucketHash::vbuckets_for_keys(const std::vector<std::string>& keys,
+                                    int num_vbuckets,
+                                    std::vector<int>& vbuckets)
+{
+  std::vector<boost::string_ref> refs(keys.begin(), keys.end());
+  std::vector<uint32_t> hashes(keys.size());
+  hash_batch(refs.data(), refs.size(), hashes.data());
+
+  vbuckets.resize(keys.size());
+  for (size_t ii = 0; ii < keys.size(); ++ii)
+  {
+    vbuckets[ii] = vbucket_for_hash(hashes[ii], num_vbuckets);
+  }
+}